@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "SDL.h"
+
+#include "control.h"
+#include "script.h"
+#include "screenshot.h"
+#include "state.h"
+#include "fbconfig.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/// Most clients connected at once
+#define CONTROL_MAX_CLIENTS		4
+
+/// Longest command line
+#define CONTROL_LINE_MAX		1024
+
+typedef struct {
+	int			fd;					///< socket, -1 if this slot is free
+	FILE		*out;				///< replies and script output
+	SCRIPT		*script;			///< runs script commands
+
+	char		in[CONTROL_LINE_MAX];	///< commands not yet run
+	size_t		inlen;
+
+	bool		busy;				///< a script command is running
+	bool		stepping;			///< waiting for a step to finish
+	bool		exiting;			///< answer once the images are closed
+} CONTROL_CLIENT;
+
+static struct {
+	bool			active;
+	int				listen_fd;
+	char			*path;			///< socket path, to remove at exit
+	CONTROL_CLIENT	clients[CONTROL_MAX_CLIENTS];
+
+	bool			paused;
+	uint32_t		step_ticks;		///< ticks left to run before pausing again
+	bool			exit_requested;
+	int				exit_status;
+} ctl;
+
+static void client_close(CONTROL_CLIENT *c)
+{
+	if (c->fd < 0)
+		return;
+	script_free(c->script);
+	if (c->out != NULL)
+		fclose(c->out);
+	close(c->fd);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+static void reply(CONTROL_CLIENT *c, const char *error)
+{
+	if (error == NULL)
+		fprintf(c->out, "ok\n");
+	else
+		fprintf(c->out, "error: %s\n", error);
+	fflush(c->out);
+}
+
+static void accept_client(void)
+{
+	int fd = accept(ctl.listen_fd, NULL, NULL), dupfd;
+	CONTROL_CLIENT *c = NULL;
+
+	if (fd < 0)
+		return;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (ctl.clients[i].fd < 0) {
+			c = &ctl.clients[i];
+			break;
+		}
+	}
+	if (c == NULL) {
+		fprintf(stderr, "NOTE: too many control clients; refusing another.\n");
+		close(fd);
+		return;
+	}
+
+	// Replies go through stdio; the socket stays blocking for them, and is
+	// read without blocking
+	c->fd = fd;
+	if ((dupfd = dup(fd)) < 0 || (c->out = fdopen(dupfd, "w")) == NULL ||
+			(c->script = script_new(c->out, "control")) == NULL) {
+		if (dupfd >= 0 && c->out == NULL)
+			close(dupfd);
+		client_close(c);
+		return;
+	}
+}
+
+/**
+ * @brief	Run one command line.
+ */
+static void run_command(CONTROL_CLIENT *c, KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse, const char *line)
+{
+	char buf[CONTROL_LINE_MAX], *argv[SCRIPT_MAX_ARGS];
+	int argc;
+
+	snprintf(buf, sizeof(buf), "%s", line);
+	if ((argc = script_split(buf, argv)) < 0) {
+		reply(c, "unterminated string");
+		return;
+	}
+	if (argc == 0)
+		return;
+
+	const char *cmd = argv[0];
+
+	if (strcmp(cmd, "load") == 0 && argc == 2) {
+		reply(c, state_load_floppy(argv[1]) ? NULL : "could not load floppy image");
+	} else if (strcmp(cmd, "eject") == 0 && argc == 1) {
+		state_unload_floppy();
+		reply(c, NULL);
+	} else if (strcmp(cmd, "pause") == 0 && argc == 1) {
+		ctl.paused = true;
+		ctl.step_ticks = 0;
+		reply(c, NULL);
+	} else if (strcmp(cmd, "resume") == 0 && argc == 1) {
+		ctl.paused = false;
+		ctl.step_ticks = 0;
+		reply(c, NULL);
+	} else if (strcmp(cmd, "step") == 0 && argc <= 2) {
+		int ticks = argc == 2 ? atoi(argv[1]) : 1;
+		if (ticks < 1) {
+			reply(c, "step needs a positive number of ticks");
+			return;
+		}
+		ctl.paused = false;
+		ctl.step_ticks = ticks;
+		c->stepping = true;
+	} else if (strcmp(cmd, "stats") == 0 && argc == 1) {
+		fprintf(c->out, "time %.6f s (%llu cycles)\n", state.cycles / 10e6, (unsigned long long)state.cycles);
+		fprintf(c->out, "state %s\n", ctl.paused ? "paused" : "running");
+		fprintf(c->out, "floppy %s\n", state.fdc_disc != NULL ? "loaded" : "empty");
+		fprintf(c->out, "hard disk read-ahead %llu hits, %llu misses\n",
+				(unsigned long long)state.hdc_ctx.ra_hits, (unsigned long long)state.hdc_ctx.ra_misses);
+		reply(c, NULL);
+	} else if (strcmp(cmd, "key") == 0 && argc >= 2) {
+		SDL_Keycode keys[SCRIPT_MAX_ARGS];
+
+		for (int i = 1; i < argc; i++) {
+			if ((keys[i] = SDL_GetKeyFromName(argv[i])) == SDLK_UNKNOWN) {
+				fprintf(c->out, "unknown key '%s'\n", argv[i]);
+				reply(c, "unknown key");
+				return;
+			}
+		}
+		// Queue all the presses and releases or none, so no key is left down
+		if (keyboard_inject_room(kbd) < 2 * (size_t)(argc - 1)) {
+			reply(c, "keyboard buffer full");
+			return;
+		}
+		for (int i = 1; i < argc; i++)
+			keyboard_inject(kbd, keys[i], 0, true);
+		for (int i = argc - 1; i >= 1; i--)
+			keyboard_inject(kbd, keys[i], 0, false);
+		reply(c, NULL);
+	} else if (strcmp(cmd, "screenshot") == 0 && argc <= 2) {
+		if (argc == 2)
+			reply(c, screenshot_write_png(argv[1], vram, reverse) ? NULL : "could not write screenshot");
+		else {
+			screenshot_request(NULL);
+			reply(c, NULL);
+		}
+	} else if (strcmp(cmd, "exit") == 0 && argc <= 2) {
+		ctl.exit_status = argc == 2 ? atoi(argv[1]) : 0;
+		ctl.exit_requested = true;
+		c->exiting = true;
+	} else {
+		// Over to the script interpreter
+		script_add(c->script, line);
+		c->busy = true;
+	}
+}
+
+/**
+ * @brief	Read what a client has sent, and run commands until one has to wait.
+ */
+static void client_service(CONTROL_CLIENT *c, KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse)
+{
+	ssize_t n;
+
+	// A step is over once its ticks have run, or another client has paused
+	// or resumed the machine
+	if (c->stepping && ctl.step_ticks == 0) {
+		c->stepping = false;
+		reply(c, NULL);
+	}
+
+	if (c->inlen < sizeof(c->in)) {
+		n = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			client_close(c);
+			return;
+		}
+		if (n > 0)
+			c->inlen += n;
+	}
+
+	while (!c->busy && !c->stepping && !c->exiting) {
+		char *nl = memchr(c->in, '\n', c->inlen);
+		if (nl == NULL) {
+			if (c->inlen == sizeof(c->in)) {
+				reply(c, "line too long");
+				c->inlen = 0;
+			}
+			break;
+		}
+		*nl = '\0';
+		if (nl > c->in && nl[-1] == '\r')
+			nl[-1] = '\0';
+
+		run_command(c, kbd, vram, reverse, c->in);
+
+		c->inlen -= nl + 1 - c->in;
+		memmove(c->in, nl + 1, c->inlen);
+	}
+}
+
+void control_init(void)
+{
+	const char *path = fbc_get_string("control", "socket");
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.listen_fd = -1;
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		ctl.clients[i].fd = -1;
+
+	if (path == NULL || path[0] == '\0')
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	// Replace a socket left behind by an earlier run, but nothing else
+	if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(addr.sun_path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 2) < 0) {
+		fprintf(stderr, "NOTE: could not listen on control socket '%s' (%s); control disabled.\n",
+				path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// A client going away mid-reply mustn't kill the emulator
+	signal(SIGPIPE, SIG_IGN);
+
+	ctl.listen_fd = fd;
+	ctl.path = strdup(addr.sun_path);
+	ctl.active = true;
+	printf("Control socket listening on '%s'.\n", path);
+}
+
+void control_done(void)
+{
+	if (!ctl.active)
+		return;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		CONTROL_CLIENT *c = &ctl.clients[i];
+		if (c->fd >= 0 && c->exiting)
+			reply(c, NULL);
+		client_close(c);
+	}
+	close(ctl.listen_fd);
+	unlink(ctl.path);
+	free(ctl.path);
+
+	ctl.active = false;
+}
+
+void control_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse)
+{
+	if (!ctl.active)
+		return;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		if (ctl.clients[i].fd >= 0)
+			client_service(&ctl.clients[i], kbd, vram, reverse);
+
+	// The listener doesn't block, so this only picks up clients waiting
+	accept_client();
+}
+
+void control_frame(KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty)
+{
+	if (!ctl.active)
+		return;
+
+	if (ctl.step_ticks > 0 && --ctl.step_ticks == 0)
+		ctl.paused = true;
+
+	for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		CONTROL_CLIENT *c = &ctl.clients[i];
+		if (c->fd < 0 || !c->busy)
+			continue;
+		script_run(c->script, kbd, vram, dirty);
+		if (script_finished(c->script)) {
+			c->busy = false;
+			reply(c, script_error(c->script));
+		}
+	}
+}
+
+bool control_paused(void)
+{
+	return ctl.paused;
+}
+
+bool control_exit_requested(int *status)
+{
+	if (status != NULL)
+		*status = ctl.exit_status;
+	return ctl.exit_requested;
+}
+
+#else
+
+// No Unix domain sockets; there's no control socket
+
+void control_init(void)
+{
+	const char *path = fbc_get_string("control", "socket");
+
+	if (path != NULL && path[0] != '\0')
+		fprintf(stderr, "NOTE: control socket not supported on this platform.\n");
+}
+
+void control_done(void)
+{
+}
+
+void control_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse)
+{
+}
+
+void control_frame(KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty)
+{
+}
+
+bool control_paused(void)
+{
+	return false;
+}
+
+bool control_exit_requested(int *status)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "keyboard.h"
+
+/**
+ * @brief	Control socket, for driving the emulator from other programs.
+ *
+ * When [control] socket is set, the emulator listens on a Unix domain
+ * socket at that path. Clients send commands one per line, quoted as in
+ * scripts (see script.h), and each command is answered with any output it
+ * has, then a line saying "ok" or "error: " and a reason. Commands run one
+ * at a time, in order.
+ *
+ *	load FILE
+ *		Load a floppy image, replacing any already in the drive.
+ *	eject
+ *		Unload the floppy image, writing back any changes.
+ *	pause
+ *		Stop running the emulated machine. The control socket and the
+ *		window's events are still served.
+ *	resume
+ *		Start running again.
+ *	step [TICKS]
+ *		Run for TICKS 60Hz ticks (default 1), then pause. Answered when
+ *		the machine has paused again.
+ *	stats
+ *		Print the emulated time, whether the machine is paused, and disc
+ *		statistics.
+ *	key NAME...
+ *		Press the named keys (SDL key names, e.g. "Return", "F1", "Left
+ *		Shift") in order, then release them in reverse order.
+ *	screenshot [FILE]
+ *		Save a screenshot. With a FILE it's written before the command is
+ *		answered, even while paused.
+ *	exit [STATUS]
+ *		Exit the emulator with STATUS (default 0). Answered once every disc
+ *		image has been written back and closed.
+ *
+ * Anything else is a script command -- type, wait, sleep, print, hash,
+ * learn, echo -- run by the script interpreter, and answered once it has
+ * finished. Script commands only make progress while the machine is running.
+ * A wait which times out is answered "error: timed out"; it doesn't exit
+ * the emulator, and neither does quit, which is only for the [script] file.
+ */
+
+/**
+ * @brief	Start listening, if [control] socket is set in the config.
+ */
+void control_init(void);
+
+/**
+ * @brief	Answer any exit command, disconnect all clients and stop listening.
+ *
+ * Call this after the disc images have been closed.
+ */
+void control_done(void);
+
+/**
+ * @brief	Accept clients and run their commands. Call this on every
+ *			timeslot, and while paused.
+ * @param	kbd			Keyboard to press keys on.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ */
+void control_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse);
+
+/**
+ * @brief	Run clients' script commands. Call this on every 60Hz tick.
+ * @param	kbd		Keyboard to type on.
+ * @param	vram	Video RAM contents.
+ * @param	dirty	Scanlines written since the last tick (VIDEO_DIRTY_WORDS).
+ */
+void control_frame(KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty);
+
+/**
+ * @brief	Check whether the machine is paused.
+ */
+bool control_paused(void);
+
+/**
+ * @brief	Check whether a client has asked the emulator to exit.
+ * @param	status	Receives the exit status, if not NULL.
+ */
+bool control_exit_requested(int *status);
+
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <unistd.h>
 #include "diskimg.h"
 
 //#define DISKIMD_DEBUG
@@ -21,48 +23,94 @@ typedef struct
 	uint8_t  secsz_code;  		// sector size code (secsz = 128 << secsz_code)
 } IMD_TRACK_HEADER;
 
+/*
+ * The whole image is decoded into memory when it's loaded: imdData holds every
+ * sector in LBA order, and imdComment and imdTracks keep the rest of the file
+ * so it can be written back out. Anything in the file after the tracks that
+ * are decoded is kept in imdTail, and written back after them. Reads and writes are then just copies, and
+ * any sector can be written whether or not it was compressed in the file.
+ * The image is re-encoded, compressing uniform sectors, when it's unloaded.
+ */
+
+static void free_imd(struct disk_image *ctx)
+{
+	free(ctx->imdComment);
+	free(ctx->imdTracks);
+	free(ctx->imdData);
+	free(ctx->imdTail);
+	ctx->imdComment = ctx->imdTracks = ctx->imdData = ctx->imdTail = NULL;
+	ctx->imdCommentLen = ctx->imdTailLen = 0;
+	ctx->imdTrackCount = 0;
+	ctx->imdDirty = false;
+}
+
 static int init_imd(struct disk_image *ctx, FILE *fp, int secsz, int heads, int tracks)
 {
-	uint8_t sdrType, track_sector_map[10], ch;
+	uint8_t sdrType, *track_rec, *data;
+	bool seen[256];
+	int ch;
+	long tailpos, endpos;
     IMD_TRACK_HEADER trackHeader;
-    size_t filepos;
-    
+    size_t filepos, recsz;
+
+	free_imd(ctx);
+
 	// write out and advance past comments
     fseek(fp, 0, SEEK_SET);
 	while (1) {
 		ch = fgetc(fp);
-		if (ch == IMD_END_OF_COMMENT || feof(fp))
+		if (ch == IMD_END_OF_COMMENT || ch == EOF)
 		   break;
 		else
 		   printf("%c", ch);
 	}
-	if (feof(fp)) return -1;
+	if (ch == EOF) return -1;
+
+	// keep the signature and comment, to write back
+	ctx->imdCommentLen = ftell(fp);
+	ctx->imdComment = malloc(ctx->imdCommentLen);
+	if (!ctx->imdComment) return -1;
+	fseek(fp, 0, SEEK_SET);
+	if (!fread(ctx->imdComment, ctx->imdCommentLen, 1, fp))
+	{
+		fprintf(stderr, "error reading IMD comment\n");
+		free_imd(ctx);
+		return -1;
+	}
 
 	// probe first track header to get spt
 	filepos = ftell(fp);
 	if (!fread(&trackHeader, sizeof(trackHeader), 1, fp))
 	{
 		fprintf(stderr, "error reading IMD track header\n");
+		free_imd(ctx);
 		return -1;
 	}
 	fseek(fp, filepos, SEEK_SET);
 	ctx->spt = trackHeader.spt;
-	
+
     ctx->fp = fp;
     ctx->secsz = secsz;
     ctx->heads = heads;
 
-	// allocate sectorMap
-	if (ctx->sectorMap) free(ctx->sectorMap);
-	ctx->sectorMap = malloc(tracks*heads*ctx->spt*sizeof(uint32_t));
-	if (!ctx->sectorMap) return -1;
-    	
-	// tracks start, build sector offset map, check for unexpected SDRs
-	for (int track_i=0; track_i < tracks*heads; track_i++)
-	{		
+	// allocate the track records and sector data
+	ctx->imdTrackCount = tracks*heads;
+	recsz = sizeof(IMD_TRACK_HEADER) + ctx->spt;
+	ctx->imdTracks = malloc(ctx->imdTrackCount * recsz);
+	ctx->imdData = malloc((size_t)ctx->imdTrackCount * ctx->spt * secsz);
+	if (!ctx->imdTracks || !ctx->imdData) {
+		free_imd(ctx);
+		return -1;
+	}
+
+	// tracks start, decode sector data, check for unexpected SDRs
+	for (int track_i=0; track_i < ctx->imdTrackCount; track_i++)
+	{
+		track_rec = ctx->imdTracks + (track_i * recsz);
 		if (!fread(&trackHeader, sizeof(trackHeader), 1, fp))
 		{
 			fprintf(stderr, "error reading IMD track header\n");
+			free_imd(ctx);
 			return -1;
 		}
 		// data mode 4 and 5 supported, secsz = 128 << secsz_code, head map & cylinder map flags unsupported
@@ -70,114 +118,155 @@ static int init_imd(struct disk_image *ctx, FILE *fp, int secsz, int heads, int
 			  trackHeader.secsz_code != 2 || (trackHeader.head & ~IMD_HEAD_MASK))
 		{
 			fprintf(stderr, "unexpected IMD track header data, track %i\n", track_i+1);
+			free_imd(ctx);
 			return -1;
 		}
-		if (!fread(track_sector_map, ctx->spt, 1, fp))
+		memcpy(track_rec, &trackHeader, sizeof(trackHeader));
+		if (!fread(track_rec + sizeof(trackHeader), ctx->spt, 1, fp))
 		{
 			fprintf(stderr, "error reading IMD track sector map\n");
+			free_imd(ctx);
 			return -1;
 		}
-		
+
+		memset(seen, 0, sizeof(seen));
 		for (int sect_i=0;  sect_i < ctx->spt; sect_i++)
 		{
-			ctx->sectorMap[(track_i*ctx->spt) + track_sector_map[sect_i] - 1] = ftell(fp);
+			int sect = track_rec[sizeof(trackHeader) + sect_i];
+			if (sect < 1 || sect > ctx->spt || seen[sect])
+			{
+				fprintf(stderr, "unexpected IMD sector number %i, track %i\n", sect, track_i+1);
+				free_imd(ctx);
+				return -1;
+			}
+			seen[sect] = true;
+			data = ctx->imdData + (((size_t)track_i*ctx->spt) + sect - 1) * secsz;
 			sdrType = fgetc(fp);
 			switch (sdrType) {
 				case IMD_SDR_DATA:
-					fseek(fp, secsz, SEEK_CUR);
+					if (!fread(data, secsz, 1, fp))
+					{
+						fprintf(stderr, "error reading IMD sector data, track %i\n", track_i+1);
+						free_imd(ctx);
+						return -1;
+					}
 					break;
 				case (IMD_SDR_DATA + IMD_SDR_COMPRESSED):
-					fgetc(fp);  // fill byte
+					memset(data, fgetc(fp), secsz);  // fill byte
 					break;
 				default:
 					fprintf(stderr, "unexpected IMD sector data record: %i\n", sdrType);
+					free_imd(ctx);
 					return -1;
 				}
 		}
 	}
-    LOG("IMD file size: %li", ftell(fp));
+
+	// keep any tracks beyond those decoded, to write back
+	tailpos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	endpos = ftell(fp);
+	if (endpos > tailpos) {
+		ctx->imdTailLen = endpos - tailpos;
+		ctx->imdTail = malloc(ctx->imdTailLen);
+		fseek(fp, tailpos, SEEK_SET);
+		if (!ctx->imdTail || !fread(ctx->imdTail, ctx->imdTailLen, 1, fp))
+		{
+			fprintf(stderr, "error reading IMD tracks after track %i\n", ctx->imdTrackCount);
+			free_imd(ctx);
+			return -1;
+		}
+	}
+    LOG("IMD file size: %li", endpos);
 	return ctx->spt;
 }
 
+/// Re-encode the image into its file
+static void write_imd(struct disk_image *ctx)
+{
+	FILE *fp = ctx->fp;
+	size_t recsz = sizeof(IMD_TRACK_HEADER) + ctx->spt;
+	uint8_t *track_rec, *data;
+	bool ok;
+
+	fseek(fp, 0, SEEK_SET);
+	ok = fwrite(ctx->imdComment, ctx->imdCommentLen, 1, fp) == 1;
+	for (int track_i=0; ok && track_i < ctx->imdTrackCount; track_i++)
+	{
+		track_rec = ctx->imdTracks + (track_i * recsz);
+		ok = fwrite(track_rec, recsz, 1, fp) == 1;
+
+		// sectors go in the order of the track's sector numbering map
+		for (int sect_i=0; ok && sect_i < ctx->spt; sect_i++)
+		{
+			int sect = track_rec[sizeof(IMD_TRACK_HEADER) + sect_i];
+			data = ctx->imdData + (((size_t)track_i*ctx->spt) + sect - 1) * ctx->secsz;
+			if (memcmp(data, data + 1, ctx->secsz - 1) == 0) {
+				ok = fputc(IMD_SDR_DATA + IMD_SDR_COMPRESSED, fp) != EOF && fputc(data[0], fp) != EOF;
+			} else {
+				ok = fputc(IMD_SDR_DATA, fp) != EOF && fwrite(data, ctx->secsz, 1, fp) == 1;
+			}
+		}
+	}
+	ok = ok && (ctx->imdTailLen == 0 || fwrite(ctx->imdTail, ctx->imdTailLen, 1, fp) == 1);
+	// the file shrinks if more sectors compress than before
+	ok = ok && fflush(fp) == 0 && ftruncate(fileno(fp), ftell(fp)) == 0;
+
+	if (!ok)
+		fprintf(stderr, "ERROR writing IMD floppy image: %s\n", strerror(errno));
+	else
+		LOG("IMD written, file size: %li", ftell(fp));
+}
+
 static void done_imd(struct disk_image *ctx)
 {
-	if (ctx->sectorMap) free(ctx->sectorMap);
-	ctx->sectorMap = NULL;
-	
+	if (ctx->imdDirty)
+		write_imd(ctx);
+	free_imd(ctx);
+
 	ctx->fp = NULL;
     ctx->secsz = 0;
     ctx->heads = 0;
     ctx->spt = 0;
 }
 
-static size_t read_sector_imd(struct disk_image *ctx, int cyl, int head, int sect, uint8_t *data)
+/// LBA of a sector, or -1 if it isn't in the image
+static int imd_lba(struct disk_image *ctx, int cyl, int head, int sect)
 {
-	size_t bytes_read;
-	uint8_t sdrType, fill;
 	int lba;
-	
-	// Calculate the LBA address of the required sector
+
+	if (cyl < 0 || head < 0 || head >= ctx->heads || sect < 1 || sect > ctx->spt)
+		return -1;
+
 	// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
 	lba = (cyl * ctx->heads * ctx->spt) + (head * ctx->spt) + sect - 1;
+	return (lba < ctx->imdTrackCount * ctx->spt) ? lba : -1;
+}
 
-	LOG("\tREAD(IMD), lba: %i, sectorMap offset: %i", lba, ctx->sectorMap[lba]);
-	fseek(ctx->fp, ctx->sectorMap[lba], SEEK_SET);
-	sdrType = fgetc(ctx->fp);
-	switch (sdrType) {
-		case IMD_SDR_DATA:
-			bytes_read = fread(data, 1, ctx->secsz, ctx->fp);
-			LOG("\tREAD(IMD) len=%lu, ssz=%d", bytes_read, ctx->secsz);			
-			break;
-		case (IMD_SDR_DATA + IMD_SDR_COMPRESSED):
-			fill = fgetc(ctx->fp);
-			memset(data, fill, ctx->secsz);
-			bytes_read = ctx->secsz;
-			LOG("\tREAD(IMD, compressed) len=%lu, ssz=%d", bytes_read, ctx->secsz);
-			break;
-		default:
-			fprintf(stderr, "unexpected sector data record: %i\n", sdrType);
-			return -1;
-		}
-	return bytes_read;
+static size_t read_sector_imd(struct disk_image *ctx, int cyl, int head, int sect, uint8_t *data)
+{
+	int lba;
+
+	// Calculate the LBA address of the required sector
+	if ((lba = imd_lba(ctx, cyl, head, sect)) < 0)
+		return 0;
+
+	LOG("\tREAD(IMD), lba: %i", lba);
+	memcpy(data, ctx->imdData + ((size_t)lba * ctx->secsz), ctx->secsz);
+	return ctx->secsz;
 }
 
 static void write_sector_imd(struct disk_image *ctx, int cyl, int head, int sect, uint8_t *data)
 {
-	uint8_t sdrType, fill;
 	int lba;
-	
+
 	// Calculate the LBA address of the required sector
-	// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
-	lba = (cyl * ctx->heads * ctx->spt) + (head * ctx->spt) + sect - 1;
+	if ((lba = imd_lba(ctx, cyl, head, sect)) < 0)
+		return;
 
-	LOG("IMD write sector, lba: %i, sectorMap offset: %i", lba, ctx->sectorMap[lba]);
-	
-	// IMD writes only supported if sector was uncompressed, or write data is also compressable
-	fseek(ctx->fp, ctx->sectorMap[lba], SEEK_SET);
-	sdrType = fgetc(ctx->fp);
-	switch (sdrType) {
-		case IMD_SDR_DATA:
-			fwrite(data, 1, ctx->secsz, ctx->fp);
-			fflush(ctx->fp);
-			LOG("WRITE(IMD), ssz=%i", ctx->secsz);
-			break;
-		case (IMD_SDR_DATA + IMD_SDR_COMPRESSED):
-			fill = data[0];
-			// confirm write data is all the same
-			for (int i=0; i < ctx->secsz; i++)
-			{
-			    if (data[i] != fill)
-			    {
-					fprintf(stderr, "**unsupported IMD sector write (can't expand compressed sector)**\n");
-					return;
-				}
-			}
-			fputc(fill, ctx->fp);
-			LOG("WRITE(IMD, compressed), ssz=%i", ctx->secsz);
-			break;
-		default:
-			fprintf(stderr, "**unsupported IMD sector write**\n");
-	}
+	LOG("IMD write sector, lba: %i", lba);
+	memcpy(ctx->imdData + ((size_t)lba * ctx->secsz), data, ctx->secsz);
+	ctx->imdDirty = true;
 }
 
 DISK_IMAGE imd_format = {
@@ -189,5 +278,5 @@ DISK_IMAGE imd_format = {
 	.secsz = 0,
 	.heads = 0,
 	.spt = 0,
-	.sectorMap = NULL
+	.imdData = NULL
 };
@@ -1,6 +1,7 @@
 #ifndef _DISKIMG_H
 #define _DISKIMG_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -15,8 +16,18 @@ typedef struct disk_image {
 	FILE *fp;
 	int secsz, heads, spt;
 
+	// raw specific
+	bool rawPunch;				// punch holes for sectors written as zeros
+
 	// IMD specific
-	uint32_t *sectorMap;  		// sector offset map
+	uint8_t *imdComment;		// signature and comment, up to and including the 0x1A
+	size_t imdCommentLen;
+	uint8_t *imdTracks;			// track headers and sector numbering maps, as in the file
+	int imdTrackCount;
+	uint8_t *imdTail;			// anything after the decoded tracks, kept as it was
+	size_t imdTailLen;
+	uint8_t *imdData;			// decoded sector data, in LBA order
+	bool imdDirty;				// sector data changed since the file was written
 } DISK_IMAGE;
 
 typedef enum {
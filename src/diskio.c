@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "SDL.h"
+#include "fbconfig.h"
+#include "sched.h"
+#include "diskio.h"
+
+static struct {
+	bool		async;
+	uint64_t	latency;		///< cycles from submit to completion
+	SDL_Thread	*thread;
+	SDL_mutex	*lock;
+	SDL_cond	*work_cond;		///< queue not empty
+	SDL_cond	*done_cond;		///< a request finished
+	DISKIO_REQ	*head, *tail;	///< work queue
+	bool		quit;
+
+	// Statistics
+	uint64_t	requests;
+	uint64_t	stalls;			///< completions which had to wait for the host
+	uint64_t	host_usec;
+} dio;
+
+static void do_work(DISKIO_REQ *req)
+{
+	Uint64 t0 = SDL_GetPerformanceCounter();
+
+	req->work(req);
+	req->host_usec = (SDL_GetPerformanceCounter() - t0) * 1000000 / SDL_GetPerformanceFrequency();
+}
+
+static int diskio_thread(void *arg)
+{
+	SDL_LockMutex(dio.lock);
+	for (;;) {
+		while (dio.head == NULL && !dio.quit)
+			SDL_CondWait(dio.work_cond, dio.lock);
+		if (dio.head == NULL)
+			break;
+
+		DISKIO_REQ *req = dio.head;
+		dio.head = req->next;
+		if (dio.head == NULL)
+			dio.tail = NULL;
+		SDL_UnlockMutex(dio.lock);
+
+		do_work(req);
+
+		SDL_LockMutex(dio.lock);
+		req->done = true;
+		SDL_CondBroadcast(dio.done_cond);
+	}
+	SDL_UnlockMutex(dio.lock);
+
+	return 0;
+}
+
+/// Completion event: runs on the emulation thread when the request is due
+static void deliver(void *arg)
+{
+	DISKIO_REQ *req = arg;
+
+	SDL_LockMutex(dio.lock);
+	if (!req->done) {
+		dio.stalls++;
+		while (!req->done)
+			SDL_CondWait(dio.done_cond, dio.lock);
+	}
+	SDL_UnlockMutex(dio.lock);
+
+	dio.host_usec += req->host_usec;
+	req->pending = false;
+	req->complete(req);
+}
+
+void diskio_init(void)
+{
+	memset(&dio, 0, sizeof(dio));
+
+	if (!fbc_get_bool("disk_io", "async"))
+		return;
+
+	dio.latency = SCHED_USEC(fbc_get_int("disk_io", "latency"));
+	dio.lock = SDL_CreateMutex();
+	dio.work_cond = SDL_CreateCond();
+	dio.done_cond = SDL_CreateCond();
+	if (dio.lock && dio.work_cond && dio.done_cond)
+		dio.thread = SDL_CreateThread(diskio_thread, "diskio", NULL);
+	if (!dio.thread) {
+		fprintf(stderr, "NOTE: could not start disk I/O thread (%s); disk I/O will be synchronous.\n", SDL_GetError());
+		return;
+	}
+	dio.async = true;
+}
+
+void diskio_done(void)
+{
+	if (!dio.async)
+		return;
+
+	// The worker finishes whatever is queued before it stops
+	SDL_LockMutex(dio.lock);
+	dio.quit = true;
+	SDL_CondSignal(dio.work_cond);
+	SDL_UnlockMutex(dio.lock);
+	SDL_WaitThread(dio.thread, NULL);
+	dio.thread = NULL;
+	dio.async = false;
+
+	if (dio.requests > 0) {
+		printf("Disk I/O: %llu requests, %llu waited for the host, %.1f ms average host time\n",
+				(unsigned long long)dio.requests, (unsigned long long)dio.stalls,
+				(double)dio.host_usec / dio.requests / 1000.0);
+	}
+}
+
+void diskio_submit(DISKIO_REQ *req)
+{
+	diskio_finish(req);
+	dio.requests++;
+	req->submitted = sched_now();
+
+	if (!dio.async) {
+		do_work(req);
+		dio.host_usec += req->host_usec;
+		req->complete(req);
+		return;
+	}
+
+	req->pending = true;
+	req->done = false;
+	req->next = NULL;
+	SDL_LockMutex(dio.lock);
+	if (dio.tail)
+		dio.tail->next = req;
+	else
+		dio.head = req;
+	dio.tail = req;
+	SDL_CondSignal(dio.work_cond);
+	SDL_UnlockMutex(dio.lock);
+
+	sched_add(dio.latency, deliver, req);
+}
+
+void diskio_finish(DISKIO_REQ *req)
+{
+	if (!req->pending)
+		return;
+	sched_cancel(deliver, req);
+	deliver(req);
+}
@@ -0,0 +1,72 @@
+#ifndef _DISKIO_H
+#define _DISKIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief	Disc image I/O, optionally on a worker thread.
+ *
+ * A disc controller puts the host I/O for a command in a DISKIO_REQ and
+ * submits it. The `work` routine does the image access; `complete` then
+ * updates the controller (DRQ, IRQ, status) on the emulation thread.
+ *
+ * With [disk_io] async = false both run immediately, inside the submit
+ * call, exactly as if the controller had done the I/O itself.
+ *
+ * With async = true, `work` runs on a worker thread while the guest carries
+ * on, and `complete` runs [disk_io] latency microseconds of emulated time
+ * after the submit. That time is fixed, so runs are reproducible: if the
+ * host is slower than that the emulation thread waits for it, and if it's
+ * quicker the result is held back until it's due.
+ *
+ * A request must not be resubmitted until it has completed; use
+ * diskio_finish() to force that.
+ */
+
+typedef struct diskio_req {
+	void				(*work)(struct diskio_req *req);		///< image access, on the worker thread
+	void				(*complete)(struct diskio_req *req);	///< controller update, on the emulation thread
+	void				*ctx;			///< controller context, for the routines above
+	uint32_t			host_usec;		///< how long `work` took on the host
+	uint64_t			submitted;		///< emulated time of the submit, in cycles
+
+	// Private to diskio
+	struct diskio_req	*next;
+	bool				pending;		///< submitted, not yet completed
+	bool				done;			///< `work` has finished
+} DISKIO_REQ;
+
+/**
+ * @brief	Start the I/O worker, as configured in [disk_io].
+ */
+void diskio_init(void);
+
+/**
+ * @brief	Wait for outstanding I/O, stop the worker and print statistics.
+ */
+void diskio_done(void);
+
+/**
+ * @brief	Submit a request.
+ * @param	req		Request, with `work`, `complete` and `ctx` filled in.
+ */
+void diskio_submit(DISKIO_REQ *req);
+
+/**
+ * @brief	Complete a request now, if it's still pending.
+ *
+ * Used when the controller is reset, given a new command or unloaded while
+ * a request is outstanding.
+ */
+void diskio_finish(DISKIO_REQ *req);
+
+/**
+ * @brief	Check whether a request is still pending.
+ */
+static inline bool diskio_pending(const DISKIO_REQ *req)
+{
+	return req->pending;
+}
+
+#endif
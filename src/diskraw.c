@@ -1,4 +1,13 @@
+#ifdef __linux__
+// needed for fallocate
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "diskimg.h"
+#include "fbconfig.h"
 
 //#define DISKRAW_DEBUG
 
@@ -22,6 +31,10 @@ static int init_raw(struct disk_image *ctx, FILE *fp, int secsz, int heads, int
 	
 	// Calculate sectors per track
 	ctx->spt = filesize / secsz / heads / tracks;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	ctx->rawPunch = fbc_get_bool("disk_io", "punch_holes");
+#endif
 	
 	return ctx->spt;
 }
@@ -29,6 +42,7 @@ static int init_raw(struct disk_image *ctx, FILE *fp, int secsz, int heads, int
 static void done_raw(struct disk_image *ctx)
 {
 	ctx->fp = NULL;
+	ctx->rawPunch = false;
     ctx->secsz = 0;
     ctx->heads = 0;
     ctx->spt = 0;
@@ -56,6 +70,37 @@ static size_t read_sector_raw(struct disk_image *ctx, int cyl, int head, int sec
 	return bytes_read;	
 }
 
+#ifdef FALLOC_FL_PUNCH_HOLE
+/// Host filesystem block size assumed when widening a hole
+#define HOLE_BLOCK		4096
+
+/**
+ * @brief	Punch a hole for one sector.
+ *
+ * A hole smaller than a host block frees nothing, so the whole block goes
+ * if the rest of it is zeros already.
+ */
+static int punch_sector(struct disk_image *ctx, long offset)
+{
+	uint8_t block[HOLE_BLOCK];
+	long start = offset;
+	size_t len = ctx->secsz;
+
+	if (ctx->secsz < HOLE_BLOCK) {
+		long bstart = offset & ~(long)(HOLE_BLOCK - 1);
+		memset(block, 0, sizeof(block));
+		if (pread(fileno(ctx->fp), block, HOLE_BLOCK, bstart) > 0) {
+			memset(block + (offset - bstart), 0, ctx->secsz);
+			if (buf_is_zero(block, HOLE_BLOCK)) {
+				start = bstart;
+				len = HOLE_BLOCK;
+			}
+		}
+	}
+	return fallocate(fileno(ctx->fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len);
+}
+#endif
+
 static void write_sector_raw(struct disk_image *ctx, int cyl, int head, int sect, uint8_t *data)
 {
 	int lba;
@@ -68,9 +113,20 @@ static void write_sector_raw(struct disk_image *ctx, int cyl, int head, int sect
 	// convert LBA to byte address
 	lba *= ctx->secsz;
 	
+#ifdef FALLOC_FL_PUNCH_HOLE
+	// An all-zero sector becomes a hole in the image file, if the host allows
+	if (ctx->rawPunch && buf_is_zero(data, ctx->secsz)) {
+		fflush(ctx->fp);
+		if (punch_sector(ctx, lba) == 0)
+			return;
+		fprintf(stderr, "NOTE: can't punch holes in the floppy image (%s); writing zeros instead.\n", strerror(errno));
+		ctx->rawPunch = false;
+	}
+#endif
+
+	// No flush here: the write-back cache (or closing the image) does that
 	fseek(ctx->fp, lba, SEEK_SET);
 	fwrite(data, 1, ctx->secsz, ctx->fp);
-	fflush(ctx->fp);
 }
 
 DISK_IMAGE raw_format = {
@@ -81,6 +137,5 @@ DISK_IMAGE raw_format = {
 	.fp = NULL,
 	.secsz = 0,
 	.heads = 0,
-	.spt = 0,
-	.sectorMap = NULL
+	.spt = 0
 };
@@ -0,0 +1,258 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fbconfig.h"
+#include "disktrace.h"
+
+/// Number of sequential run length classes: 1, 2-3, 4-7 ... 32768+ sectors
+#define RUN_CLASSES		16
+
+/// Width of the heatmap bars
+#define HEAT_WIDTH		40
+
+/// Per-drive statistics, covering the whole run
+typedef struct {
+	uint32_t	size;				///< sectors on the disc, 0 if not known
+	uint64_t	*reads, *writes;	///< sectors read and written, per heatmap bucket
+	uint32_t	next_lba;			///< sector following the last transfer
+	uint8_t		run_op;				///< op of the current sequential run
+	uint32_t	run_len;			///< length of the current run in sectors, 0 if none
+} DRIVE_STATS;
+
+static struct {
+	bool			enabled;
+	const char		*output;
+	DISKTRACE_REC	*ring;
+	uint32_t		entries;		///< ring size
+	uint32_t		head;			///< next slot to fill
+	uint64_t		logged;			///< records ever logged
+	int				buckets;		///< heatmap buckets per drive
+
+	DRIVE_STATS		drive[2][2];	///< [dev][drive]
+	uint64_t		runs[RUN_CLASSES];
+	uint64_t		cmds[4], sectors[4], host_usec[4];	///< per DISKTRACE_OP
+} dt;
+
+static const char *dev_names[2] = { "hard disk", "floppy" };
+
+void disktrace_init(void)
+{
+	memset(&dt, 0, sizeof(dt));
+
+	if (!fbc_get_bool("disk_trace", "enabled"))
+		return;
+
+	dt.output = fbc_get_string("disk_trace", "output");
+	dt.entries = fbc_get_int("disk_trace", "entries");
+	dt.buckets = fbc_get_int("disk_trace", "buckets");
+	if (dt.entries < 1)
+		dt.entries = 1;
+	if (dt.buckets < 1)
+		dt.buckets = 1;
+
+	bool ok = (dt.ring = calloc(dt.entries, sizeof(DISKTRACE_REC))) != NULL;
+	for (int i = 0; i < 4; i++) {
+		DRIVE_STATS *d = &dt.drive[i / 2][i % 2];
+		d->reads = calloc(dt.buckets, sizeof(uint64_t));
+		d->writes = calloc(dt.buckets, sizeof(uint64_t));
+		ok = ok && d->reads && d->writes;
+	}
+	if (!ok) {
+		free(dt.ring);
+		fprintf(stderr, "NOTE: not enough memory for the disk trace; not tracing.\n");
+		for (int i = 0; i < 4; i++) {
+			free(dt.drive[i / 2][i % 2].reads);
+			free(dt.drive[i / 2][i % 2].writes);
+		}
+		memset(&dt, 0, sizeof(dt));
+		return;
+	}
+
+	dt.enabled = true;
+}
+
+void disktrace_set_size(DISKTRACE_DEV dev, int drive, uint32_t sectors)
+{
+	dt.drive[dev][drive ? 1 : 0].size = sectors;
+}
+
+/// Account for the end of a sequential run
+static void end_run(DRIVE_STATS *d)
+{
+	int cls = 0;
+
+	if (d->run_len == 0)
+		return;
+	while (cls < RUN_CLASSES - 1 && (d->run_len >> (cls + 1)) != 0)
+		cls++;
+	dt.runs[cls]++;
+	d->run_len = 0;
+}
+
+void disktrace_log(DISKTRACE_DEV dev, int drive, DISKTRACE_OP op, uint8_t cmd,
+		int cyl, int head, int sector, uint32_t lba, uint32_t count,
+		uint64_t cycle, uint32_t host_usec)
+{
+	if (!dt.enabled)
+		return;
+
+	DISKTRACE_REC *r = &dt.ring[dt.head];
+	memset(r, 0, sizeof(*r));
+	r->cycle = cycle;
+	r->lba = lba;
+	r->host_usec = host_usec;
+	r->cyl = cyl;
+	r->count = count;
+	r->dev = dev;
+	r->drive = drive;
+	r->cmd = cmd;
+	r->op = op;
+	r->head = head;
+	r->sector = sector;
+	dt.head = (dt.head + 1) % dt.entries;
+	dt.logged++;
+
+	dt.cmds[op]++;
+	dt.sectors[op] += count;
+	dt.host_usec[op] += host_usec;
+
+	if (op != DISKTRACE_READ && op != DISKTRACE_WRITE)
+		return;
+
+	DRIVE_STATS *d = &dt.drive[dev][drive ? 1 : 0];
+
+	// Heatmap, by the first sector of the transfer
+	int b = dt.buckets - 1;
+	if (d->size > 0 && lba < d->size)
+		b = (int)((uint64_t)lba * dt.buckets / d->size);
+	if (op == DISKTRACE_READ)
+		d->reads[b] += count;
+	else
+		d->writes[b] += count;
+
+	// Sequential runs: a transfer continues the run if it starts where the
+	// last one on this drive ended and goes the same way
+	if (d->run_len == 0 || lba != d->next_lba || op != d->run_op) {
+		end_run(d);
+		d->run_op = op;
+	}
+	d->run_len += count;
+	d->next_lba = lba + count;
+}
+
+static void write_ring(void)
+{
+	FILE *fp;
+	uint32_t n = (dt.logged < dt.entries) ? (uint32_t)dt.logged : dt.entries;
+	uint32_t first = (dt.logged < dt.entries) ? 0 : dt.head;
+	uint32_t hdr[2] = { sizeof(DISKTRACE_REC), n };
+	bool ok;
+
+	if ((fp = fopen(dt.output, "wb")) == NULL) {
+		fprintf(stderr, "NOTE: could not open disk trace file '%s'; trace not saved.\n", dt.output);
+		return;
+	}
+
+	ok = fwrite("FBTRACE1", 8, 1, fp) == 1 && fwrite(hdr, sizeof(hdr), 1, fp) == 1;
+	// Oldest first: from the write pointer to the end, then from the start
+	if (ok && n > 0)
+		ok = fwrite(&dt.ring[first], sizeof(DISKTRACE_REC), n - first, fp) == n - first;
+	if (ok && first > 0)
+		ok = fwrite(dt.ring, sizeof(DISKTRACE_REC), first, fp) == first;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		fprintf(stderr, "NOTE: error writing disk trace file '%s'; trace may be truncated.\n", dt.output);
+}
+
+static void print_heatmap(int dev, int drive)
+{
+	DRIVE_STATS *d = &dt.drive[dev][drive];
+	uint64_t max = 0, total = 0;
+	uint32_t size = d->size;
+
+	for (int b = 0; b < dt.buckets; b++) {
+		uint64_t n = d->reads[b] + d->writes[b];
+		total += n;
+		if (n > max)
+			max = n;
+	}
+	if (total == 0)
+		return;
+
+	printf("Disk trace: %s %d heatmap, sectors read/written by LBA\n", dev_names[dev], drive);
+	for (int b = 0; b < dt.buckets; b++) {
+		uint64_t n = d->reads[b] + d->writes[b];
+		int bar = (int)((n * HEAT_WIDTH + max - 1) / max);
+		int rbar = n ? (int)(d->reads[b] * bar / n) : 0;
+		char line[HEAT_WIDTH + 1];
+
+		memset(line, 'r', rbar);
+		memset(line + rbar, 'w', bar - rbar);
+		line[bar] = '\0';
+		if (size > 0) {
+			printf("  %9lu-%-9lu %10llu %10llu |%s\n",
+					(unsigned long)((uint64_t)size * b / dt.buckets),
+					(unsigned long)((uint64_t)size * (b + 1) / dt.buckets - 1),
+					(unsigned long long)d->reads[b], (unsigned long long)d->writes[b], line);
+		} else {
+			printf("  bucket %-12d %10llu %10llu |%s\n", b,
+					(unsigned long long)d->reads[b], (unsigned long long)d->writes[b], line);
+		}
+	}
+}
+
+void disktrace_done(void)
+{
+	uint64_t rw_cmds, rw_sectors;
+
+	if (!dt.enabled)
+		return;
+
+	if (dt.output[0] != '\0')
+		write_ring();
+
+	printf("Disk trace: %llu commands: %llu reads (%llu sectors), %llu writes (%llu sectors), %llu formats, %llu seeks\n",
+			(unsigned long long)dt.logged,
+			(unsigned long long)dt.cmds[DISKTRACE_READ], (unsigned long long)dt.sectors[DISKTRACE_READ],
+			(unsigned long long)dt.cmds[DISKTRACE_WRITE], (unsigned long long)dt.sectors[DISKTRACE_WRITE],
+			(unsigned long long)dt.cmds[DISKTRACE_FORMAT], (unsigned long long)dt.cmds[DISKTRACE_SEEK]);
+
+	rw_cmds = dt.cmds[DISKTRACE_READ] + dt.cmds[DISKTRACE_WRITE];
+	rw_sectors = dt.sectors[DISKTRACE_READ] + dt.sectors[DISKTRACE_WRITE];
+	if (rw_cmds > 0) {
+		printf("Disk trace: %.0f%% reads by command, %.0f%% by sector; average host time %.3f ms per read, %.3f ms per write\n",
+				100.0 * dt.cmds[DISKTRACE_READ] / rw_cmds,
+				rw_sectors ? 100.0 * dt.sectors[DISKTRACE_READ] / rw_sectors : 0.0,
+				dt.cmds[DISKTRACE_READ] ? dt.host_usec[DISKTRACE_READ] / 1000.0 / dt.cmds[DISKTRACE_READ] : 0.0,
+				dt.cmds[DISKTRACE_WRITE] ? dt.host_usec[DISKTRACE_WRITE] / 1000.0 / dt.cmds[DISKTRACE_WRITE] : 0.0);
+
+		for (int dev = 0; dev < 2; dev++)
+			for (int drive = 0; drive < 2; drive++) {
+				end_run(&dt.drive[dev][drive]);
+				print_heatmap(dev, drive);
+			}
+
+		printf("Disk trace: sequential runs, by length in sectors:\n ");
+		for (int cls = 0; cls < RUN_CLASSES; cls++) {
+			if (dt.runs[cls] == 0)
+				continue;
+			if (cls == 0)
+				printf(" 1: %llu", (unsigned long long)dt.runs[cls]);
+			else if (cls == RUN_CLASSES - 1)
+				printf(" %u+: %llu", 1u << cls, (unsigned long long)dt.runs[cls]);
+			else
+				printf(" %u-%u: %llu", 1u << cls, (2u << cls) - 1, (unsigned long long)dt.runs[cls]);
+		}
+		printf("\n");
+	}
+
+	free(dt.ring);
+	for (int i = 0; i < 4; i++) {
+		free(dt.drive[i / 2][i % 2].reads);
+		free(dt.drive[i / 2][i % 2].writes);
+	}
+	memset(&dt, 0, sizeof(dt));
+}
@@ -0,0 +1,78 @@
+#ifndef _DISKTRACE_H
+#define _DISKTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief	Disc controller command trace.
+ *
+ * When [disk_trace] enabled = true, the WD2010 and WD2797 log every command
+ * they execute. The most recent [disk_trace] entries records are kept in a
+ * ring buffer, which is written to [disk_trace] output at exit. Summaries
+ * covering the whole run -- an LBA heatmap per drive, the lengths of
+ * sequential runs and the read/write mix -- are printed at exit.
+ */
+
+/// Which controller a command went to
+typedef enum {
+	DISKTRACE_HDD		= 0,		///< WD2010 hard disc controller
+	DISKTRACE_FDD		= 1			///< WD2797 floppy disc controller
+} DISKTRACE_DEV;
+
+/// What a command did
+typedef enum {
+	DISKTRACE_READ		= 0,
+	DISKTRACE_WRITE		= 1,
+	DISKTRACE_FORMAT	= 2,
+	DISKTRACE_SEEK		= 3			///< Seek, restore or step
+} DISKTRACE_OP;
+
+/**
+ * Trace record, as kept in the ring buffer and written to the output file.
+ *
+ * The file is a 16-byte header -- "FBTRACE1", then the record size and the
+ * number of records as uint32_t -- followed by the records, oldest first.
+ * Everything is in host byte order.
+ */
+typedef struct {
+	uint64_t	cycle;			///< emulated time of the command, in CPU cycles
+	uint32_t	lba;			///< first sector, counted from 0
+	uint32_t	host_usec;		///< host time taken by the image access
+	uint16_t	cyl;
+	uint16_t	count;			///< number of sectors; 0 for seeks
+	uint8_t		dev;			///< DISKTRACE_DEV
+	uint8_t		drive;
+	uint8_t		cmd;			///< command register value
+	uint8_t		op;				///< DISKTRACE_OP
+	uint8_t		head;
+	uint8_t		sector;
+	uint8_t		reserved[6];
+} DISKTRACE_REC;
+
+/**
+ * @brief	Set up tracing, as configured in [disk_trace].
+ */
+void disktrace_init(void);
+
+/**
+ * @brief	Write out the ring buffer, print the summaries and stop tracing.
+ */
+void disktrace_done(void);
+
+/**
+ * @brief	Tell the tracer how big a drive is, for the heatmap.
+ * @param	sectors		Number of sectors on the disc.
+ */
+void disktrace_set_size(DISKTRACE_DEV dev, int drive, uint32_t sectors);
+
+/**
+ * @brief	Log a command.
+ *
+ * Does nothing unless tracing is enabled.
+ */
+void disktrace_log(DISKTRACE_DEV dev, int drive, DISKTRACE_OP op, uint8_t cmd,
+		int cyl, int head, int sector, uint32_t lba, uint32_t count,
+		uint64_t cycle, uint32_t host_usec);
+
+#endif
@@ -63,10 +63,30 @@ get_default_string(const char *heading, const char *item)
 		{ "floppy", "disk", "floppy.img" },
 		{ "hard_disk", "disk1", "hd.img" },
 		{ "hard_disk", "disk2", "hd2.img" },
+		{ "hard_disk", "backend", "mmap" },
+		{ "hard_disk", "sync", "exit" },
+		{ "hard_disk", "overlay1", "" },
+		{ "hard_disk", "overlay2", "" },
+		{ "hard_disk", "overlay_mode", "keep" },
+		{ "hard_disk", "volatile1", "" },
+		{ "hard_disk", "volatile2", "" },
+		{ "hard_disk", "volatile_init", "zero" },
 		{ "roms", "rom_14c", "roms/14c.bin" },
 		{ "roms", "rom_15c", "roms/15c.bin" },
 		{ "serial", "symlink", "serial-pty" },
 		{ "display", "scale_quality", "linear" },
+		{ "recorder", "file", "" },
+		{ "disk_cache", "policy", "idle" },
+		{ "disk_trace", "output", "" },
+		{ "dma", "mode", "normal" },
+		{ "screenshot", "directory", "." },
+		{ "vramhash", "output", "" },
+		{ "vramhash", "stop_on_hash", "" },
+		{ "vnc", "listen", "" },
+		{ "shmfb", "name", "" },
+		{ "screentext", "font", "" },
+		{ "script", "file", "" },
+		{ "control", "socket", "" },
 		{ NULL, NULL, NULL }
 	};
 
@@ -92,6 +112,11 @@ get_default_double(const char *heading, const char *item)
 	} defaults[] = {
 		{ "display", "x_scale", 1.0 },
 		{ "display", "y_scale", 1.0 },
+		{ "disk_cache", "delay", 1.0 },
+		{ "dma", "rate", 2.0 },
+		{ "screenshot", "at_time", 0.0 },
+		{ "screenshot", "interval", 0.0 },
+		{ "script", "timeout", 300.0 },
 		{ NULL, NULL, 0.0 }
 	};
 
@@ -116,6 +141,9 @@ get_default_bool(const char *heading, const char *item)
 		bool value;
 	} defaults[] = {
 		{ "vidpal", "installed", true },
+		{ "disk_io", "async", false },
+		{ "disk_io", "punch_holes", true },
+		{ "disk_trace", "enabled", false },
 		{ NULL, NULL, false }
 	};
 
@@ -144,9 +172,22 @@ get_default_int(const char *heading, const char *item)
 		{ "display", "blue", 0x00 },
 		{ "hard_disk", "heads", 8 },
 		{ "hard_disk", "sectors_per_track", 17 },
+		{ "hard_disk", "chunk_cache", 8192 },
+		{ "hard_disk", "readahead", 1 },
 		{ "memory", "base_memory", 2048 },
 		{ "memory", "extended_memory", 2048 },
 		{ "beeper", "volume", 55 },
+		{ "disk_cache", "size", 4096 },
+		{ "disk_io", "latency", 250 },
+		{ "disk_trace", "entries", 65536 },
+		{ "disk_trace", "buckets", 32 },
+		{ "timing", "max_frameskip", 5 },
+		{ "timing", "max_lag", 100 },
+		{ "timing", "report_interval", 10 },
+		{ "screentext", "cell_width", 9 },
+		{ "screentext", "cell_height", 12 },
+		{ "screentext", "x_origin", 0 },
+		{ "screentext", "y_origin", 0 },
 		{ NULL, NULL, 0 }
 	};
 
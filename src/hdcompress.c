@@ -0,0 +1,428 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "fbconfig.h"
+#include "hdimg.h"
+#include "lz.h"
+
+/*
+ * Compressed image backend. The disk is split into fixed-size chunks, each
+ * stored as zeros (not at all), raw or LZ-compressed. Chunks are
+ * decompressed into a bounded LRU cache, where reads and writes are a
+ * memcpy; dirty chunks are recompressed when they're evicted or flushed,
+ * or straight after each write unless the sync policy is "exit".
+ *
+ * A rewritten chunk goes back over its old data when it fits, so the file
+ * doesn't grow without bound. That isn't crash-safe: a crash part way
+ * through can leave the chunk's old index entry pointing at new data.
+ */
+
+/// Index entry, in memory
+typedef struct {
+	uint64_t	offset;
+	uint32_t	length;
+	uint8_t		type;
+} CHUNK_INDEX;
+
+/// A decompressed chunk
+typedef struct chunk_buf {
+	struct chunk_buf	*prev, *next;	///< LRU list, most recently used first
+	uint32_t			chunk;
+	bool				dirty;
+	uint8_t				data[];
+} CHUNK_BUF;
+
+typedef struct {
+	uint32_t	chunk_size, nchunks;
+	uint64_t	index_offset;
+	uint64_t	file_end;		///< where to put chunks which don't fit where they were
+	CHUNK_INDEX	*index;
+	CHUNK_BUF	**map;			///< chunk number -> cached buffer, or NULL
+	CHUNK_BUF	*head, *tail;
+	size_t		ncached, max_cached;
+	uint8_t		*zbuf;			///< compressed data, lz_compress_bound(chunk_size) bytes
+	size_t		zbuf_size;
+} CMP_PRIV;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static bool pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+/// Number of bytes of disk a chunk covers
+static inline size_t chunk_len(HD_IMAGE *img, CMP_PRIV *p, uint32_t chunk)
+{
+	uint64_t start = (uint64_t)chunk * p->chunk_size;
+	return (img->size - start < p->chunk_size) ? (size_t)(img->size - start) : p->chunk_size;
+}
+
+static void lru_unlink(CMP_PRIV *p, CHUNK_BUF *cb)
+{
+	if (cb->prev) cb->prev->next = cb->next; else p->head = cb->next;
+	if (cb->next) cb->next->prev = cb->prev; else p->tail = cb->prev;
+	cb->prev = cb->next = NULL;
+}
+
+static void lru_push(CMP_PRIV *p, CHUNK_BUF *cb)
+{
+	cb->prev = NULL;
+	cb->next = p->head;
+	if (p->head) p->head->prev = cb; else p->tail = cb;
+	p->head = cb;
+}
+
+static bool all_zero(const uint8_t *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (buf[i])
+			return false;
+	return true;
+}
+
+/// Compress a dirty chunk and write it and its index entry back to the file
+static int store_chunk(HD_IMAGE *img, CMP_PRIV *p, CHUNK_BUF *cb)
+{
+	CHUNK_INDEX *ix = &p->index[cb->chunk];
+	size_t len = chunk_len(img, p, cb->chunk);
+	const uint8_t *data;
+	uint8_t entry[HDCMP_INDEX_ENTRY];
+	CHUNK_INDEX nx;
+
+	if (all_zero(cb->data, len)) {
+		nx.type = HDCMP_CHUNK_ZERO;
+		nx.length = 0;
+		nx.offset = 0;
+		data = NULL;
+	} else {
+		size_t clen = lz_compress(cb->data, len, p->zbuf, p->zbuf_size);
+		if (clen > 0 && clen < len) {
+			nx.type = HDCMP_CHUNK_LZ;
+			nx.length = clen;
+			data = p->zbuf;
+		} else {
+			nx.type = HDCMP_CHUNK_RAW;
+			nx.length = len;
+			data = cb->data;
+		}
+		// Reuse the old space if the chunk still fits in it
+		if (ix->type != HDCMP_CHUNK_ZERO && nx.length <= ix->length) {
+			nx.offset = ix->offset;
+		} else {
+			nx.offset = p->file_end;
+			p->file_end += nx.length;
+		}
+		if (!pwrite_all(img->fd, data, nx.length, nx.offset))
+			return -1;
+	}
+
+	memset(entry, 0, sizeof(entry));
+	put64(&entry[0], nx.offset);
+	put32(&entry[8], nx.length);
+	entry[12] = nx.type;
+	if (!pwrite_all(img->fd, entry, sizeof(entry), p->index_offset + (uint64_t)cb->chunk * HDCMP_INDEX_ENTRY))
+		return -1;
+
+	*ix = nx;
+	cb->dirty = false;
+	return 0;
+}
+
+/// Read and decompress a chunk from the file
+static int load_chunk(HD_IMAGE *img, CMP_PRIV *p, uint32_t chunk, uint8_t *buf)
+{
+	CHUNK_INDEX *ix = &p->index[chunk];
+	size_t len = chunk_len(img, p, chunk);
+
+	switch (ix->type) {
+		case HDCMP_CHUNK_ZERO:
+			memset(buf, 0, len);
+			return 0;
+		case HDCMP_CHUNK_RAW:
+			if (ix->length != len || !pread_all(img->fd, buf, len, ix->offset))
+				return -1;
+			return 0;
+		case HDCMP_CHUNK_LZ:
+			if (ix->length > p->zbuf_size || !pread_all(img->fd, p->zbuf, ix->length, ix->offset))
+				return -1;
+			if (lz_decompress(p->zbuf, ix->length, buf, len) != (long)len) {
+				fprintf(stderr, "NOTE: %s: chunk %u is corrupt.\n", img->filename, chunk);
+				return -1;
+			}
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/**
+ * @brief	Get a chunk into the cache.
+ * @return	The cached chunk, or NULL on error.
+ */
+static CHUNK_BUF *get_chunk(HD_IMAGE *img, CMP_PRIV *p, uint32_t chunk)
+{
+	CHUNK_BUF *cb = p->map[chunk];
+
+	if (cb != NULL) {
+		if (cb != p->head) {
+			lru_unlink(p, cb);
+			lru_push(p, cb);
+		}
+		return cb;
+	}
+
+	// Recycle the least recently used chunk if the cache is full
+	if (p->ncached >= p->max_cached && p->tail != NULL) {
+		cb = p->tail;
+		if (cb->dirty && store_chunk(img, p, cb) != 0) {
+			fprintf(stderr, "NOTE: %s: could not write chunk %u: %s\n", img->filename, cb->chunk, strerror(errno));
+			return NULL;
+		}
+		lru_unlink(p, cb);
+		p->map[cb->chunk] = NULL;
+	} else {
+		cb = malloc(sizeof(*cb) + p->chunk_size);
+		if (cb == NULL)
+			return NULL;
+		p->ncached++;
+	}
+
+	if (load_chunk(img, p, chunk, cb->data) != 0) {
+		free(cb);
+		p->ncached--;
+		return NULL;
+	}
+	cb->chunk = chunk;
+	cb->dirty = false;
+	p->map[chunk] = cb;
+	lru_push(p, cb);
+	return cb;
+}
+
+static ssize_t cmp_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	CMP_PRIV *p = img->priv;
+	size_t done = 0;
+
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint32_t chunk = pos / p->chunk_size;
+		size_t inchunk = pos % p->chunk_size;
+		size_t n = chunk_len(img, p, chunk) - inchunk;
+		if (n > len - done)
+			n = len - done;
+
+		if (p->map[chunk] == NULL && p->index[chunk].type == HDCMP_CHUNK_ZERO) {
+			// Empty chunks don't need caching
+			memset((uint8_t *)buf + done, 0, n);
+		} else {
+			CHUNK_BUF *cb = get_chunk(img, p, chunk);
+			if (cb == NULL)
+				return (done > 0) ? (ssize_t)done : -1;
+			memcpy((uint8_t *)buf + done, cb->data + inchunk, n);
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t cmp_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	CMP_PRIV *p = img->priv;
+	size_t done = 0;
+
+	if (img->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint32_t chunk = pos / p->chunk_size;
+		size_t inchunk = pos % p->chunk_size;
+		size_t n = chunk_len(img, p, chunk) - inchunk;
+		if (n > len - done)
+			n = len - done;
+
+		CHUNK_BUF *cb = get_chunk(img, p, chunk);
+		if (cb == NULL)
+			return (done > 0) ? (ssize_t)done : -1;
+		memcpy(cb->data + inchunk, (const uint8_t *)buf + done, n);
+		cb->dirty = true;
+		if (img->sync != HDIMG_SYNC_EXIT && store_chunk(img, p, cb) != 0)
+			return (done > 0) ? (ssize_t)done : -1;
+		done += n;
+	}
+	if (img->sync == HDIMG_SYNC_WRITE)
+		fdatasync(img->fd);
+	return done;
+}
+
+static int cmp_flush(HD_IMAGE *img)
+{
+	CMP_PRIV *p = img->priv;
+	int ret = 0;
+
+	if (img->readonly)
+		return 0;
+
+	for (CHUNK_BUF *cb = p->head; cb != NULL; cb = cb->next) {
+		if (cb->dirty && store_chunk(img, p, cb) != 0)
+			ret = -1;
+	}
+	if (fsync(img->fd) != 0)
+		ret = -1;
+	return ret;
+}
+
+static void cmp_close(HD_IMAGE *img)
+{
+	CMP_PRIV *p = img->priv;
+
+	while (p->head != NULL) {
+		CHUNK_BUF *cb = p->head;
+		p->head = cb->next;
+		free(cb);
+	}
+	free(p->map);
+	free(p->index);
+	free(p->zbuf);
+	free(p);
+	img->priv = NULL;
+	close(img->fd);
+	img->fd = -1;
+}
+
+int hdimg_attach_compressed(HD_IMAGE *img)
+{
+	uint8_t hdr[HDCMP_HEADER_SIZE];
+	uint8_t *raw = NULL;
+	CMP_PRIV *p;
+	uint64_t disk_size;
+	int cache_kb;
+
+	if (!pread_all(img->fd, hdr, sizeof(hdr), 0) || memcmp(hdr, HDCMP_MAGIC, 8) != 0)
+		return -1;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return -1;
+	p->chunk_size = get32(&hdr[12]);
+	disk_size = get64(&hdr[16]);
+	p->index_offset = get64(&hdr[24]);
+	p->nchunks = get32(&hdr[32]);
+
+	if (p->chunk_size < 512 || (p->chunk_size % 512) != 0 ||
+			p->nchunks != (disk_size + p->chunk_size - 1) / p->chunk_size) {
+		fprintf(stderr, "ERROR: '%s' has a bad compressed image header.\n", img->filename);
+		free(p);
+		return -1;
+	}
+
+	// Load the index
+	p->index = calloc(p->nchunks, sizeof(*p->index));
+	p->map = calloc(p->nchunks, sizeof(*p->map));
+	raw = malloc((size_t)p->nchunks * HDCMP_INDEX_ENTRY);
+	p->zbuf_size = lz_compress_bound(p->chunk_size);
+	p->zbuf = malloc(p->zbuf_size);
+	if (!p->index || !p->map || !raw || !p->zbuf ||
+			!pread_all(img->fd, raw, (size_t)p->nchunks * HDCMP_INDEX_ENTRY, p->index_offset)) {
+		fprintf(stderr, "ERROR: could not read the index of '%s'.\n", img->filename);
+		goto fail;
+	}
+	p->file_end = p->index_offset + (uint64_t)p->nchunks * HDCMP_INDEX_ENTRY;
+	for (uint32_t i = 0; i < p->nchunks; i++) {
+		const uint8_t *e = &raw[i * HDCMP_INDEX_ENTRY];
+		p->index[i].offset = get64(&e[0]);
+		p->index[i].length = get32(&e[8]);
+		p->index[i].type = e[12];
+		if (p->index[i].type > HDCMP_CHUNK_LZ) {
+			fprintf(stderr, "ERROR: '%s' chunk %u has unknown type %u.\n", img->filename, i, p->index[i].type);
+			goto fail;
+		}
+		if (p->index[i].type != HDCMP_CHUNK_ZERO && p->index[i].offset + p->index[i].length > p->file_end)
+			p->file_end = p->index[i].offset + p->index[i].length;
+	}
+	free(raw);
+
+	cache_kb = fbc_get_int("hard_disk", "chunk_cache");
+	p->max_cached = ((size_t)(cache_kb > 0 ? cache_kb : 1) * 1024) / p->chunk_size;
+	if (p->max_cached < 2)
+		p->max_cached = 2;
+
+	img->read = cmp_read;
+	img->write = cmp_write;
+	img->flush = cmp_flush;
+	img->close = cmp_close;
+	img->backend = "compressed";
+	img->size = disk_size;
+	img->map = NULL;
+	img->priv = p;
+	return 0;
+
+fail:
+	free(raw);
+	free(p->index);
+	free(p->map);
+	free(p->zbuf);
+	free(p);
+	return -1;
+}
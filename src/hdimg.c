@@ -0,0 +1,452 @@
+#ifdef __linux__
+// needed for fallocate
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hdimg.h"
+#include "wbcache.h"
+#include "fbconfig.h"
+#include "utils.h"
+
+/*
+ * Hole punching. Sectors written as all zeros are deallocated in the host
+ * file instead of written, so guest mkfs, swap initialisation and the like
+ * don't fill in a sparse image. A hole reads back as zeros, so the guest
+ * can't tell the difference.
+ */
+
+/// Granularity of zero detection
+#define ZERO_SECTOR		512
+
+/// Host filesystem block size assumed when widening a hole
+#define HOLE_BLOCK		4096
+
+/**
+ * @brief	Check that part of the image file reads as zeros.
+ */
+static bool file_is_zero(HD_IMAGE *img, uint64_t offset, size_t len)
+{
+	uint8_t buf[HOLE_BLOCK];
+
+	return len <= sizeof(buf) && pread(img->fd, buf, len, (off_t)offset) == (ssize_t)len && buf_is_zero(buf, len);
+}
+
+static int punch_hole(HD_IMAGE *img, uint64_t offset, size_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	uint64_t start = offset & ~(uint64_t)(HOLE_BLOCK - 1);
+	uint64_t end = (offset + len + HOLE_BLOCK - 1) & ~(uint64_t)(HOLE_BLOCK - 1);
+	int r;
+
+	// A hole smaller than a host block frees nothing, so take in the rest
+	// of the blocks at each end if they're zeros already
+	if (end > img->size)
+		end = img->size;
+	if (start < offset && !file_is_zero(img, start, offset - start))
+		start = offset;
+	if (end > offset + len && !file_is_zero(img, offset + len, end - (offset + len)))
+		end = offset + len;
+
+	r = fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start, (off_t)(end - start));
+	if (r == 0 && img->sync == HDIMG_SYNC_WRITE)
+		fdatasync(img->fd);
+	return r;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/**
+ * @brief	Write, punching holes for runs of all-zero sectors.
+ * @param	write	Backend write, for the sectors with data in them.
+ */
+static ssize_t punch_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset,
+		ssize_t (*write)(HD_IMAGE *, const void *, size_t, uint64_t))
+{
+	const uint8_t *src = buf;
+	size_t pos = 0, end;
+
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+	if ((offset % ZERO_SECTOR) != 0 || (len % ZERO_SECTOR) != 0)
+		return write(img, buf, len, offset);
+
+	while (pos < len) {
+		bool zero = buf_is_zero(src + pos, ZERO_SECTOR);
+
+		// Find the end of the run of sectors like this one
+		for (end = pos + ZERO_SECTOR; end < len && buf_is_zero(src + end, ZERO_SECTOR) == zero; end += ZERO_SECTOR)
+			;
+
+		if (zero && img->punch && punch_hole(img, offset + pos, end - pos) != 0) {
+			fprintf(stderr, "NOTE: can't punch holes in '%s' (%s); writing zeros instead.\n",
+					img->filename, strerror(errno));
+			img->punch = false;
+		}
+		if ((!zero || !img->punch) && write(img, src + pos, end - pos, offset + pos) != (ssize_t)(end - pos))
+			return -1;
+		pos = end;
+	}
+	return len;
+}
+
+/*
+ * File backend. Every transfer is one pread or pwrite; the host page cache
+ * does the rest.
+ */
+
+static ssize_t file_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(img->fd, (uint8_t *)buf + done, len - done, (off_t)(offset + done));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t file_write_data(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+
+	// Images never grow; the geometry was worked out from their size
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	while (done < len) {
+		ssize_t n = pwrite(img->fd, (const uint8_t *)buf + done, len - done, (off_t)(offset + done));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+
+	if (img->sync == HDIMG_SYNC_WRITE)
+		fdatasync(img->fd);
+	return done;
+}
+
+static ssize_t file_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	if (img->punch)
+		return punch_write(img, buf, len, offset, file_write_data);
+	return file_write_data(img, buf, len, offset);
+}
+
+static int file_flush(HD_IMAGE *img)
+{
+	return img->readonly ? 0 : fsync(img->fd);
+}
+
+static void file_close(HD_IMAGE *img)
+{
+	close(img->fd);
+	img->fd = -1;
+}
+
+/*
+ * mmap backend. The whole image is mapped shared, so guest writes land in
+ * the host page cache as soon as they're copied in; msync only decides when
+ * the kernel is made to write them back.
+ */
+
+static ssize_t mmap_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+	memcpy(buf, img->map + offset, len);
+	return len;
+}
+
+static ssize_t mmap_write_data(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+	memcpy(img->map + offset, buf, len);
+
+	if (img->sync != HDIMG_SYNC_EXIT) {
+		// msync wants a page-aligned start address
+		uint64_t pagemask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+		uint64_t start = offset & ~pagemask;
+		msync(img->map + start, (offset + len) - start,
+				(img->sync == HDIMG_SYNC_WRITE) ? MS_SYNC : MS_ASYNC);
+	}
+	return len;
+}
+
+static ssize_t mmap_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	// A punched hole drops the pages from the mapping too; it reads as zeros
+	if (img->punch)
+		return punch_write(img, buf, len, offset, mmap_write_data);
+	return mmap_write_data(img, buf, len, offset);
+}
+
+static int mmap_flush(HD_IMAGE *img)
+{
+	return img->readonly ? 0 : msync(img->map, img->size, MS_SYNC);
+}
+
+static ssize_t readonly_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	errno = EROFS;
+	return -1;
+}
+
+static void mmap_close(HD_IMAGE *img)
+{
+	munmap(img->map, img->size);
+	img->map = NULL;
+	close(img->fd);
+	img->fd = -1;
+}
+
+/*
+ * Write-back cache layer over another image. Sector-aligned transfers go
+ * through the cache; anything else writes the cache back first and goes
+ * straight to the image underneath.
+ */
+
+typedef struct {
+	HD_IMAGE	*lower;
+	WBCACHE		*cache;
+	size_t		secsz;
+} CACHE_PRIV;
+
+static int cache_lower_read(void *arg, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	CACHE_PRIV *p = arg;
+	ssize_t n = hdimg_read(p->lower, buf, count * p->secsz, (uint64_t)lba * p->secsz);
+	return (n < 0) ? -1 : (int)(n / p->secsz);
+}
+
+static bool cache_lower_write(void *arg, uint32_t lba, uint32_t count, const uint8_t *buf)
+{
+	CACHE_PRIV *p = arg;
+	return hdimg_write(p->lower, buf, count * p->secsz, (uint64_t)lba * p->secsz) == (ssize_t)(count * p->secsz);
+}
+
+static const WBCACHE_OPS cache_lower_ops = {
+	.read = cache_lower_read,
+	.write = cache_lower_write,
+	.sync = NULL
+};
+
+static ssize_t cache_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	CACHE_PRIV *p = img->priv;
+	int n;
+
+	if ((offset % p->secsz) != 0 || (len % p->secsz) != 0) {
+		wbcache_flush(p->cache);
+		return hdimg_read(p->lower, buf, len, offset);
+	}
+	n = wbcache_read(p->cache, offset / p->secsz, len / p->secsz, buf);
+	return (n < 0) ? -1 : (ssize_t)n * p->secsz;
+}
+
+static ssize_t cache_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	CACHE_PRIV *p = img->priv;
+
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+	if ((offset % p->secsz) != 0 || (len % p->secsz) != 0) {
+		wbcache_flush(p->cache);
+		return hdimg_write(p->lower, buf, len, offset);
+	}
+	wbcache_write(p->cache, offset / p->secsz, len / p->secsz, buf);
+	return len;
+}
+
+static int cache_flush(HD_IMAGE *img)
+{
+	CACHE_PRIV *p = img->priv;
+
+	wbcache_flush(p->cache);
+	return hdimg_flush(p->lower);
+}
+
+static void cache_close(HD_IMAGE *img)
+{
+	CACHE_PRIV *p = img->priv;
+
+	wbcache_free(p->cache);
+	hdimg_close(p->lower);
+	free(p);
+	img->priv = NULL;
+}
+
+HD_IMAGE *hdimg_cache(HD_IMAGE *lower, size_t secsz)
+{
+	CACHE_PRIV *p;
+	HD_IMAGE *img;
+
+	// Writes held back in a cache would defeat syncing after every write
+	if (lower->sync == HDIMG_SYNC_WRITE)
+		return lower;
+
+	p = calloc(1, sizeof(*p));
+	img = calloc(1, sizeof(*img));
+	if (p == NULL || img == NULL) {
+		free(p);
+		free(img);
+		return lower;
+	}
+	p->lower = lower;
+	p->secsz = secsz;
+	p->cache = wbcache_new(lower->filename, secsz, &cache_lower_ops, p);
+	if (p->cache == NULL) {
+		free(p);
+		free(img);
+		return lower;
+	}
+
+	img->read = cache_read;
+	img->write = cache_write;
+	img->flush = cache_flush;
+	img->close = cache_close;
+	img->backend = lower->backend;
+	img->filename = strdup(lower->filename);
+	img->size = lower->size;
+	img->sync = lower->sync;
+	img->fd = lower->fd;
+	img->map = NULL;
+	img->priv = p;
+	return img;
+}
+
+
+bool hdimg_parse_sync(const char *name, HDIMG_SYNC *sync)
+{
+	if (name == NULL || *name == '\0' || strcmp(name, "exit") == 0) {
+		*sync = HDIMG_SYNC_EXIT;
+	} else if (strcmp(name, "write") == 0) {
+		*sync = HDIMG_SYNC_WRITE;
+	} else if (strcmp(name, "async") == 0) {
+		*sync = HDIMG_SYNC_ASYNC;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static HD_IMAGE *open_image(const char *filename, const char *backend, HDIMG_SYNC sync, bool readonly)
+{
+	struct stat st;
+	HD_IMAGE *img;
+	char magic[8];
+	int fd;
+
+	if (backend == NULL || *backend == '\0')
+		backend = "mmap";
+	if (strcmp(backend, "mmap") != 0 && strcmp(backend, "file") != 0) {
+		fprintf(stderr, "NOTE: unknown hard disk backend '%s'; using 'file'.\n", backend);
+		backend = "file";
+	}
+
+	fd = open(filename, readonly ? O_RDONLY : O_RDWR);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		close(fd);
+		return NULL;
+	}
+	img->filename = strdup(filename);
+	img->size = st.st_size;
+	img->sync = sync;
+	img->fd = fd;
+	img->readonly = readonly;
+#ifdef FALLOC_FL_PUNCH_HOLE
+	img->punch = !readonly && fbc_get_bool("disk_io", "punch_holes");
+#endif
+
+	// Compressed images are recognised by their contents
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, HDCMP_MAGIC, sizeof(magic)) == 0) {
+		if (hdimg_attach_compressed(img) != 0) {
+			close(fd);
+			free(img->filename);
+			free(img);
+			return NULL;
+		}
+		return img;
+	}
+
+	if (strcmp(backend, "mmap") == 0 && img->size > 0) {
+		void *map = mmap(NULL, img->size, readonly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			img->map = map;
+			img->read = mmap_read;
+			img->write = readonly ? readonly_write : mmap_write;
+			img->flush = mmap_flush;
+			img->close = mmap_close;
+			img->backend = "mmap";
+			return img;
+		}
+		fprintf(stderr, "NOTE: could not map '%s' (%s); using the file backend.\n", filename, strerror(errno));
+	}
+
+	img->read = file_read;
+	img->write = readonly ? readonly_write : file_write;
+	img->flush = file_flush;
+	img->close = file_close;
+	img->backend = "file";
+	return img;
+}
+
+HD_IMAGE *hdimg_open(const char *filename, const char *backend, HDIMG_SYNC sync)
+{
+	return open_image(filename, backend, sync, false);
+}
+
+HD_IMAGE *hdimg_open_readonly(const char *filename, const char *backend)
+{
+	return open_image(filename, backend, HDIMG_SYNC_EXIT, true);
+}
+
+void hdimg_close(HD_IMAGE *img)
+{
+	if (img == NULL)
+		return;
+
+	if (img->flush(img) != 0)
+		fprintf(stderr, "NOTE: error flushing disc image '%s': %s\n", img->filename, strerror(errno));
+	img->close(img);
+	free(img->filename);
+	free(img);
+}
@@ -0,0 +1,212 @@
+#ifndef _HDIMG_H
+#define _HDIMG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief	Hard disk image backends.
+ *
+ * The WD2010 model addresses its drives as a flat array of bytes. An
+ * HD_IMAGE hides where those bytes actually live: a plain file accessed with
+ * pread/pwrite, or a file mapped into memory so a sector transfer is a
+ * memcpy with no system call at all.
+ *
+ * Backends are selected by name ("file" or "mmap"). Further layers, such as
+ * the write-back cache, are HD_IMAGEs stacked on top of another one.
+ */
+
+/**
+ * Overlay file format. All values are little-endian.
+ *
+ *   Header, HDOVL_HEADER_SIZE bytes:
+ *		char		magic[8]		HDOVL_MAGIC
+ *		uint32_t	header_size		HDOVL_HEADER_SIZE
+ *		uint32_t	block_size		bytes per overlay block, a multiple of 512
+ *		uint64_t	disk_size		size of the base image, in bytes
+ *		uint64_t	bitmap_offset	file offset of the block bitmap
+ *		uint64_t	data_offset		file offset of block 0's data
+ *		char		base[256]		base image name (informational), NUL-terminated
+ *		zero padding
+ *
+ *   Block bitmap: one bit per block, LSB first; set if the block is in the
+ *   overlay.
+ *
+ *   Block data: block N lives at data_offset + N * block_size. Blocks which
+ *   haven't been written are never touched, so the file stays sparse.
+ */
+#define HDOVL_MAGIC				"FBOVRLY1"
+#define HDOVL_HEADER_SIZE		512
+#define HDOVL_DEFAULT_BLOCK		4096
+
+/**
+ * Compressed image format. All values are little-endian.
+ *
+ *   Header, HDCMP_HEADER_SIZE bytes:
+ *		char		magic[8]		HDCMP_MAGIC
+ *		uint32_t	header_size		HDCMP_HEADER_SIZE
+ *		uint32_t	chunk_size		bytes of disk per chunk, a multiple of 512
+ *		uint64_t	disk_size		size of the disk, in bytes
+ *		uint64_t	index_offset	file offset of the chunk index
+ *		uint32_t	nchunks			number of index entries
+ *		zero padding
+ *
+ *   Chunk index, nchunks * HDCMP_INDEX_ENTRY bytes:
+ *		uint64_t	offset			file offset of the chunk's data
+ *		uint32_t	length			stored length, in bytes
+ *		uint8_t		type			HDCMP_CHUNK_xxx
+ *		uint8_t		pad[3]
+ *
+ *   Chunk data, anywhere after the index. An HDCMP_CHUNK_LZ chunk is one
+ *   lz_compress() block (see lz.h). The last chunk may cover less than
+ *   chunk_size bytes of disk.
+ *
+ * hdimg_open recognises these by their magic number, whatever backend is
+ * asked for. Rewritten chunks go back where they were if they fit, and to
+ * the end of the file if they don't. Rewriting in place isn't crash-safe: a
+ * crash part way through a write can leave a chunk that can't be decoded.
+ */
+#define HDCMP_MAGIC				"FBCMPRS1"
+#define HDCMP_HEADER_SIZE		512
+#define HDCMP_INDEX_ENTRY		16
+#define HDCMP_DEFAULT_CHUNK		65536
+
+enum {
+	HDCMP_CHUNK_ZERO	= 0,	///< not stored; reads as zeros
+	HDCMP_CHUNK_RAW		= 1,	///< stored uncompressed
+	HDCMP_CHUNK_LZ		= 2		///< stored compressed
+};
+
+/// When written data is pushed out to the host disk
+typedef enum {
+	HDIMG_SYNC_EXIT,		///< only when the image is flushed or closed
+	HDIMG_SYNC_WRITE,		///< after every write, waiting for the host disk
+	HDIMG_SYNC_ASYNC		///< after every write, without waiting
+} HDIMG_SYNC;
+
+typedef struct hd_image {
+	ssize_t (*read)(struct hd_image *img, void *buf, size_t len, uint64_t offset);
+	ssize_t (*write)(struct hd_image *img, const void *buf, size_t len, uint64_t offset);
+	int (*flush)(struct hd_image *img);
+	void (*close)(struct hd_image *img);
+
+	const char	*backend;		///< backend name, for messages
+	char		*filename;		///< image file name
+	uint64_t	size;			///< image size in bytes
+	HDIMG_SYNC	sync;			///< write durability policy
+	bool		readonly;		///< writes fail with EROFS
+	bool		punch;			///< punch holes for sectors written as zeros
+	int			fd;				///< host file descriptor, or -1
+	uint8_t		*map;			///< mapping of the whole image (mmap backend)
+	void		*priv;			///< backend private data
+} HD_IMAGE;
+
+/**
+ * @brief	Open a hard disk image.
+ * @param	filename	Image file name.
+ * @param	backend		Backend name: "file" or "mmap". NULL or "" picks the default.
+ * @param	sync		Write durability policy.
+ * @return	New image, or NULL if the file couldn't be opened read/write.
+ *
+ * If the mmap backend can't map the file, the file backend is used instead.
+ */
+HD_IMAGE *hdimg_open(const char *filename, const char *backend, HDIMG_SYNC sync);
+
+/**
+ * @brief	Open a hard disk image read-only.
+ * @param	filename	Image file name.
+ * @param	backend		Backend name, as for hdimg_open.
+ * @return	New image, or NULL if the file couldn't be opened.
+ */
+HD_IMAGE *hdimg_open_readonly(const char *filename, const char *backend);
+
+/**
+ * @brief	Open a copy-on-write overlay over a read-only base image.
+ * @param	filename	Overlay file name. Created if it doesn't exist.
+ * @param	basename	Base image file name; opened read-only.
+ * @param	backend		Backend name, as for hdimg_open.
+ * @param	sync		Write durability policy for the overlay.
+ * @param	discard		Start from an empty overlay, and delete it when closed.
+ * @return	New image, or NULL on error.
+ *
+ * Reads of blocks which have never been written come from the base image;
+ * everything else goes to the overlay. See HDOVL_MAGIC for the file format.
+ */
+HD_IMAGE *hdimg_open_overlay(const char *filename, const char *basename, const char *backend, HDIMG_SYNC sync, bool discard);
+
+/**
+ * @brief	Put a write-back cache (see wbcache.h) in front of an image.
+ * @param	lower	Image to cache. The cache takes ownership of it.
+ * @param	secsz	Sector size in bytes.
+ * @return	The cached image, or `lower` itself if caching is off or
+ *			`lower` syncs every write (HDIMG_SYNC_WRITE).
+ */
+HD_IMAGE *hdimg_cache(HD_IMAGE *lower, size_t secsz);
+
+/**
+ * @brief	Keep ranges of an image's sectors in host memory only.
+ * @param	lower	Image underneath. The new image takes ownership of it.
+ * @param	ranges	Comma-separated list of "FIRST-LAST" sector numbers
+ *					(inclusive, from 0), or "swap" for the swap partition
+ *					named in the volume home block.
+ * @param	copy	Start the ranges as a copy of the image; otherwise zeroed.
+ * @param	secsz	Sector size in bytes.
+ * @return	The new image, or `lower` itself if there are no ranges.
+ *
+ * Reads and writes inside the ranges are served from memory, and never
+ * reach `lower`; everything else passes through.
+ */
+HD_IMAGE *hdimg_volatile(HD_IMAGE *lower, const char *ranges, bool copy, size_t secsz);
+
+/**
+ * @brief	Set up an opened image file as a compressed image.
+ * @param	img		Image whose fd, filename and readonly flag are filled in.
+ * @return	0 on success, -1 if the file isn't a valid compressed image.
+ *
+ * Used by hdimg_open when it finds HDCMP_MAGIC.
+ */
+int hdimg_attach_compressed(HD_IMAGE *img);
+
+/**
+ * @brief	Parse a sync policy name ("exit", "write" or "async").
+ * @param	name	Policy name from the configuration.
+ * @param	sync	Receives the policy.
+ * @return	true if the name was recognised.
+ */
+bool hdimg_parse_sync(const char *name, HDIMG_SYNC *sync);
+
+/**
+ * @brief	Read from an image.
+ * @return	Number of bytes read; short at the end of the image, -1 on error.
+ */
+static inline ssize_t hdimg_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	return img->read(img, buf, len, offset);
+}
+
+/**
+ * @brief	Write to an image.
+ * @return	Number of bytes written; short at the end of the image, -1 on error.
+ */
+static inline ssize_t hdimg_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	return img->write(img, buf, len, offset);
+}
+
+/**
+ * @brief	Push any written data out to the host disk.
+ * @return	0 on success, -1 on error.
+ */
+static inline int hdimg_flush(HD_IMAGE *img)
+{
+	return img->flush(img);
+}
+
+/**
+ * @brief	Flush and close an image, and free it. NULL is ignored.
+ */
+void hdimg_close(HD_IMAGE *img);
+
+#endif
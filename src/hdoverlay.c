@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hdimg.h"
+
+/*
+ * Copy-on-write overlay over a read-only base image. The overlay file holds
+ * a bitmap of which blocks have been written, and those blocks' data at
+ * their natural offsets; everything else is read from the base.
+ */
+
+typedef struct {
+	HD_IMAGE	*base;			///< read-only base image
+	HD_IMAGE	*delta;			///< overlay file
+	uint32_t	block_size;
+	uint64_t	nblocks;
+	uint64_t	bitmap_offset, data_offset;
+	uint8_t		*bitmap;
+	uint8_t		*scratch;		///< one block, for partial writes to new blocks
+	bool		discard;
+} OVERLAY_PRIV;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static inline bool block_present(OVERLAY_PRIV *p, uint64_t blk)
+{
+	return (p->bitmap[blk >> 3] >> (blk & 7)) & 1;
+}
+
+/// Mark a block as being in the overlay. Called after its data is written.
+static int block_set(OVERLAY_PRIV *p, uint64_t blk)
+{
+	p->bitmap[blk >> 3] |= 1 << (blk & 7);
+	if (hdimg_write(p->delta, &p->bitmap[blk >> 3], 1, p->bitmap_offset + (blk >> 3)) != 1)
+		return -1;
+	return 0;
+}
+
+static ssize_t overlay_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	OVERLAY_PRIV *p = img->priv;
+	size_t done = 0;
+
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	// Read runs of blocks which all come from the same place
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint64_t blk = pos / p->block_size;
+		bool present = block_present(p, blk);
+		size_t run = p->block_size - (pos % p->block_size);
+		ssize_t n;
+
+		for (blk++; done + run < len && blk < p->nblocks && block_present(p, blk) == present; blk++)
+			run += p->block_size;
+		if (run > len - done)
+			run = len - done;
+
+		if (present)
+			n = hdimg_read(p->delta, (uint8_t *)buf + done, run, p->data_offset + pos);
+		else
+			n = hdimg_read(p->base, (uint8_t *)buf + done, run, pos);
+		if (n < 0)
+			return (done > 0) ? (ssize_t)done : -1;
+		done += n;
+		if ((size_t)n < run)
+			break;
+	}
+	return done;
+}
+
+static ssize_t overlay_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	OVERLAY_PRIV *p = img->priv;
+	const uint8_t *src = buf;
+	size_t done = 0;
+
+	if (offset >= img->size)
+		return 0;
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	while (done < len) {
+		uint64_t pos = offset + done;
+		uint64_t blk = pos / p->block_size;
+		uint32_t inblk = pos % p->block_size;
+		size_t n = p->block_size - inblk;
+		if (n > len - done)
+			n = len - done;
+
+		if (block_present(p, blk)) {
+			// Already copied up; just overwrite it
+			if (hdimg_write(p->delta, src + done, n, p->data_offset + pos) != (ssize_t)n)
+				return (done > 0) ? (ssize_t)done : -1;
+		} else {
+			// First write to this block: copy up the part of it which isn't
+			// being written, then write the whole block to the overlay
+			uint64_t blkpos = blk * p->block_size;
+			size_t blklen = p->block_size;
+			if (blklen > img->size - blkpos)
+				blklen = img->size - blkpos;
+			if (n < blklen) {
+				if (hdimg_read(p->base, p->scratch, blklen, blkpos) != (ssize_t)blklen)
+					return (done > 0) ? (ssize_t)done : -1;
+				memcpy(p->scratch + inblk, src + done, n);
+				if (hdimg_write(p->delta, p->scratch, blklen, p->data_offset + blkpos) != (ssize_t)blklen)
+					return (done > 0) ? (ssize_t)done : -1;
+			} else {
+				if (hdimg_write(p->delta, src + done, n, p->data_offset + pos) != (ssize_t)n)
+					return (done > 0) ? (ssize_t)done : -1;
+			}
+			if (block_set(p, blk) != 0)
+				return (done > 0) ? (ssize_t)done : -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static int overlay_flush(HD_IMAGE *img)
+{
+	OVERLAY_PRIV *p = img->priv;
+
+	// Nothing worth keeping if it's going to be deleted
+	if (p->discard)
+		return 0;
+	return hdimg_flush(p->delta);
+}
+
+static void overlay_close(HD_IMAGE *img)
+{
+	OVERLAY_PRIV *p = img->priv;
+	char *deltaname = strdup(p->delta->filename);
+
+	hdimg_close(p->delta);
+	hdimg_close(p->base);
+	if (p->discard && deltaname != NULL) {
+		if (unlink(deltaname) != 0)
+			fprintf(stderr, "NOTE: could not delete overlay '%s': %s\n", deltaname, strerror(errno));
+	}
+	free(deltaname);
+	free(p->bitmap);
+	free(p->scratch);
+	free(p);
+	img->priv = NULL;
+}
+
+/**
+ * @brief	Create an empty overlay file.
+ *
+ * Only the header is written; the bitmap and block data are left as a hole.
+ */
+static int create_overlay(const char *filename, const char *basename, uint64_t disk_size, uint32_t block_size)
+{
+	uint8_t hdr[HDOVL_HEADER_SIZE];
+	uint64_t nblocks = (disk_size + block_size - 1) / block_size;
+	uint64_t bitmap_offset = HDOVL_HEADER_SIZE;
+	uint64_t data_offset = ((bitmap_offset + (nblocks + 7) / 8 + block_size - 1) / block_size) * block_size;
+	int fd;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, HDOVL_MAGIC, 8);
+	put32(&hdr[8], HDOVL_HEADER_SIZE);
+	put32(&hdr[12], block_size);
+	put64(&hdr[16], disk_size);
+	put64(&hdr[24], bitmap_offset);
+	put64(&hdr[32], data_offset);
+	strncpy((char *)&hdr[40], basename, 255);
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+			ftruncate(fd, data_offset + nblocks * block_size) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+HD_IMAGE *hdimg_open_overlay(const char *filename, const char *basename, const char *backend, HDIMG_SYNC sync, bool discard)
+{
+	uint8_t hdr[HDOVL_HEADER_SIZE];
+	OVERLAY_PRIV *p;
+	HD_IMAGE *img, *base, *delta;
+
+	if ((base = hdimg_open_readonly(basename, backend)) == NULL) {
+		fprintf(stderr, "ERROR: could not open base image '%s': %s\n", basename, strerror(errno));
+		return NULL;
+	}
+
+	if (discard || access(filename, F_OK) != 0) {
+		if (create_overlay(filename, basename, base->size, HDOVL_DEFAULT_BLOCK) != 0) {
+			fprintf(stderr, "ERROR: could not create overlay '%s': %s\n", filename, strerror(errno));
+			hdimg_close(base);
+			return NULL;
+		}
+		printf("Created overlay '%s' over '%s'.\n", filename, basename);
+	}
+
+	if ((delta = hdimg_open(filename, backend, sync)) == NULL) {
+		fprintf(stderr, "ERROR: could not open overlay '%s': %s\n", filename, strerror(errno));
+		hdimg_close(base);
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	img = calloc(1, sizeof(*img));
+	if (p == NULL || img == NULL)
+		goto fail;
+	p->base = base;
+	p->delta = delta;
+	p->discard = discard;
+
+	// Check the header matches the base image
+	if (hdimg_read(delta, hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr, HDOVL_MAGIC, 8) != 0) {
+		fprintf(stderr, "ERROR: '%s' is not an overlay image.\n", filename);
+		goto fail;
+	}
+	p->block_size = get32(&hdr[12]);
+	p->bitmap_offset = get64(&hdr[24]);
+	p->data_offset = get64(&hdr[32]);
+	if (get64(&hdr[16]) != base->size) {
+		fprintf(stderr, "ERROR: overlay '%s' is for a %llu-byte disk, but '%s' is %llu bytes.\n",
+				filename, (unsigned long long)get64(&hdr[16]), basename, (unsigned long long)base->size);
+		goto fail;
+	}
+	if (p->block_size < 512 || (p->block_size % 512) != 0) {
+		fprintf(stderr, "ERROR: overlay '%s' has a bad block size (%u).\n", filename, p->block_size);
+		goto fail;
+	}
+	p->nblocks = (base->size + p->block_size - 1) / p->block_size;
+	if (p->data_offset + p->nblocks * p->block_size > delta->size ||
+			p->bitmap_offset + (p->nblocks + 7) / 8 > p->data_offset) {
+		fprintf(stderr, "ERROR: overlay '%s' is truncated.\n", filename);
+		goto fail;
+	}
+
+	// Load the block bitmap
+	p->bitmap = malloc((p->nblocks + 7) / 8);
+	p->scratch = malloc(p->block_size);
+	if (p->bitmap == NULL || p->scratch == NULL)
+		goto fail;
+	if (hdimg_read(delta, p->bitmap, (p->nblocks + 7) / 8, p->bitmap_offset) != (ssize_t)((p->nblocks + 7) / 8)) {
+		fprintf(stderr, "ERROR: could not read overlay '%s' bitmap.\n", filename);
+		goto fail;
+	}
+
+	img->read = overlay_read;
+	img->write = overlay_write;
+	img->flush = overlay_flush;
+	img->close = overlay_close;
+	img->backend = delta->backend;
+	img->filename = strdup(filename);
+	img->size = base->size;
+	img->sync = sync;
+	img->fd = -1;
+	img->priv = p;
+	return img;
+
+fail:
+	if (p != NULL) {
+		free(p->bitmap);
+		free(p->scratch);
+		free(p);
+	}
+	free(img);
+	hdimg_close(delta);
+	hdimg_close(base);
+	return NULL;
+}
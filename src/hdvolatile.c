@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "hdimg.h"
+
+/*
+ * Volatile sector ranges. Configured ranges of an image -- typically the
+ * swap partition -- are kept in host memory: reads and writes there are a
+ * memcpy, and nothing written to them ever reaches the image underneath.
+ * Everything else passes straight through.
+ */
+
+/// Most ranges per image
+#define MAX_RANGES		8
+
+/// Volume home block: the partition table follows the 26-byte disk label,
+/// as the starting track of each partition. Partition 1 is swap.
+#define VHB_PSECTRK		18
+#define VHB_PARTAB		26
+#define VHB_SWAP		1
+
+typedef struct {
+	uint64_t	start, end;		///< byte offsets, end exclusive
+	uint8_t		*data;
+} VOL_RANGE;
+
+typedef struct {
+	HD_IMAGE	*lower;
+	VOL_RANGE	range[MAX_RANGES];	///< in order, not overlapping
+	int			nranges;
+} VOLATILE_PRIV;
+
+static uint32_t get16be(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32be(const uint8_t *p)
+{
+	return (get16be(p) << 16) | get16be(p + 2);
+}
+
+/**
+ * @brief	Find how much of a transfer starting at pos lies on one side.
+ * @param	len		Length of the transfer; cut down to the piece's length.
+ * @return	The range holding pos, or NULL if pos is in the image.
+ */
+static VOL_RANGE *find_piece(VOLATILE_PRIV *p, uint64_t pos, size_t *len)
+{
+	for (int i = 0; i < p->nranges; i++) {
+		VOL_RANGE *r = &p->range[i];
+		if (pos < r->start) {
+			if (*len > r->start - pos)
+				*len = r->start - pos;
+			return NULL;
+		}
+		if (pos < r->end) {
+			if (*len > r->end - pos)
+				*len = r->end - pos;
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static ssize_t volatile_read(HD_IMAGE *img, void *buf, size_t len, uint64_t offset)
+{
+	VOLATILE_PRIV *p = img->priv;
+	uint8_t *dst = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t n = len - done;
+		VOL_RANGE *r = find_piece(p, offset + done, &n);
+
+		if (r != NULL) {
+			memcpy(dst + done, r->data + (offset + done - r->start), n);
+		} else {
+			ssize_t got = hdimg_read(p->lower, dst + done, n, offset + done);
+			if (got < 0)
+				return -1;
+			if ((size_t)got < n)
+				return done + got;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t volatile_write(HD_IMAGE *img, const void *buf, size_t len, uint64_t offset)
+{
+	VOLATILE_PRIV *p = img->priv;
+	const uint8_t *src = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t n = len - done;
+		VOL_RANGE *r = find_piece(p, offset + done, &n);
+
+		if (r != NULL) {
+			memcpy(r->data + (offset + done - r->start), src + done, n);
+		} else {
+			ssize_t put = hdimg_write(p->lower, src + done, n, offset + done);
+			if (put < 0)
+				return -1;
+			if ((size_t)put < n)
+				return done + put;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static int volatile_flush(HD_IMAGE *img)
+{
+	VOLATILE_PRIV *p = img->priv;
+
+	return hdimg_flush(p->lower);
+}
+
+static void volatile_close(HD_IMAGE *img)
+{
+	VOLATILE_PRIV *p = img->priv;
+
+	for (int i = 0; i < p->nranges; i++)
+		free(p->range[i].data);
+	hdimg_close(p->lower);
+	free(p);
+	img->priv = NULL;
+}
+
+/**
+ * @brief	Find the swap partition from the volume home block.
+ * @return	true if the image has a disk label with a swap partition.
+ */
+static bool find_swap(HD_IMAGE *lower, size_t secsz, uint64_t *start, uint64_t *end)
+{
+	uint8_t vhb[512];
+	uint32_t psectrk, first, next;
+
+	if (hdimg_read(lower, vhb, sizeof(vhb), 0) != sizeof(vhb) || memcmp(vhb, "UQVQ", 4) != 0)
+		return false;
+
+	psectrk = get16be(vhb + VHB_PSECTRK);
+	first = get32be(vhb + VHB_PARTAB + 4 * VHB_SWAP);
+	next = get32be(vhb + VHB_PARTAB + 4 * (VHB_SWAP + 1));
+	if (psectrk == 0 || first == 0 || next <= first)
+		return false;
+
+	*start = (uint64_t)first * psectrk * secsz;
+	*end = (uint64_t)next * psectrk * secsz;
+	return true;
+}
+
+/**
+ * @brief	Parse a range list into p->range, sorted.
+ * @return	false if it's malformed.
+ */
+static bool parse_ranges(VOLATILE_PRIV *p, const char *spec, size_t secsz)
+{
+	const char *s = spec;
+	uint64_t start, end;
+	char *e;
+
+	while (*s != '\0') {
+		while (*s == ',' || isspace((unsigned char)*s))
+			s++;
+		if (*s == '\0')
+			break;
+
+		if (strncmp(s, "swap", 4) == 0) {
+			if (!find_swap(p->lower, secsz, &start, &end)) {
+				fprintf(stderr, "NOTE: '%s' has no disk label with a swap partition; swap isn't volatile.\n",
+						p->lower->filename);
+				s += 4;
+				continue;
+			}
+			s += 4;
+		} else {
+			// FIRST-LAST, in sectors
+			start = strtoull(s, &e, 0);
+			if (e == s || *e != '-')
+				return false;
+			s = e + 1;
+			end = strtoull(s, &e, 0);
+			if (e == s || end < start)
+				return false;
+			s = e;
+			start *= secsz;
+			end = (end + 1) * secsz;
+		}
+		if (*s != '\0' && *s != ',' && !isspace((unsigned char)*s))
+			return false;
+
+		// Nothing past the end of the image
+		if (end > p->lower->size)
+			end = p->lower->size;
+		if (start >= end)
+			continue;
+
+		if (p->nranges == MAX_RANGES)
+			return false;
+
+		// Insert in order, refusing overlaps
+		int i = p->nranges;
+		while (i > 0 && p->range[i - 1].start >= end)
+			i--;
+		if (i > 0 && p->range[i - 1].end > start)
+			return false;
+		memmove(&p->range[i + 1], &p->range[i], (p->nranges - i) * sizeof(VOL_RANGE));
+		p->range[i].start = start;
+		p->range[i].end = end;
+		p->range[i].data = NULL;
+		p->nranges++;
+	}
+	return true;
+}
+
+HD_IMAGE *hdimg_volatile(HD_IMAGE *lower, const char *ranges, bool copy, size_t secsz)
+{
+	VOLATILE_PRIV *p;
+	HD_IMAGE *img;
+
+	if (ranges == NULL || ranges[0] == '\0')
+		return lower;
+
+	p = calloc(1, sizeof(*p));
+	img = calloc(1, sizeof(*img));
+	if (p == NULL || img == NULL)
+		goto fail;
+	p->lower = lower;
+
+	if (!parse_ranges(p, ranges, secsz)) {
+		fprintf(stderr, "NOTE: bad volatile sector ranges '%s' for '%s'; none used.\n", ranges, lower->filename);
+		goto fail;
+	}
+	if (p->nranges == 0)
+		goto fail;
+
+	for (int i = 0; i < p->nranges; i++) {
+		VOL_RANGE *r = &p->range[i];
+		size_t len = r->end - r->start;
+
+		if ((r->data = copy ? malloc(len) : calloc(1, len)) == NULL) {
+			fprintf(stderr, "NOTE: not enough memory for volatile sectors of '%s'; none used.\n", lower->filename);
+			goto fail;
+		}
+		if (copy && hdimg_read(lower, r->data, len, r->start) != (ssize_t)len) {
+			fprintf(stderr, "NOTE: could not read volatile sectors of '%s': %s; none used.\n",
+					lower->filename, strerror(errno));
+			goto fail;
+		}
+		printf("%s: sectors %llu-%llu kept in memory only (starting %s).\n", lower->filename,
+				(unsigned long long)(r->start / secsz), (unsigned long long)(r->end / secsz - 1),
+				copy ? "as a copy of the image" : "zeroed");
+	}
+
+	img->read = volatile_read;
+	img->write = volatile_write;
+	img->flush = volatile_flush;
+	img->close = volatile_close;
+	img->backend = lower->backend;
+	img->filename = strdup(lower->filename);
+	img->size = lower->size;
+	img->sync = lower->sync;
+	img->readonly = lower->readonly;
+	img->fd = lower->fd;
+	img->map = NULL;
+	img->priv = p;
+	return img;
+
+fail:
+	if (p != NULL)
+		for (int i = 0; i < p->nranges; i++)
+			free(p->range[i].data);
+	free(p);
+	free(img);
+	return lower;
+}
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <string.h>
 #include "SDL.h"
 #include "utils.h"
 #include "keyboard.h"
@@ -171,6 +172,8 @@ void keyboard_init(KEYBOARD_STATE *ks)
 
 	ks->mouse_enabled = 0;
 	ks->lastdata_mouse = 0;
+
+	ks->inject_readp = ks->inject_len = 0;
 }
 
 void keyboard_event(KEYBOARD_STATE *ks, SDL_Event *ev)
@@ -264,10 +267,93 @@ bool mouse_event(KEYBOARD_STATE *ks, int dx, int dy, int db)
 
 
 
+bool keyboard_inject(KEYBOARD_STATE *ks, SDL_Keycode key, uint16_t mod, bool down)
+{
+	if (ks->inject_len >= KEYBOARD_INJECT_SIZE)
+		return false;
+
+	SDL_Event *ev = &ks->inject[(ks->inject_readp + ks->inject_len) % KEYBOARD_INJECT_SIZE];
+	memset(ev, 0, sizeof(*ev));
+	ev->type = down ? SDL_KEYDOWN : SDL_KEYUP;
+	ev->key.keysym.sym = key;
+	ev->key.keysym.mod = mod;
+	ks->inject_len++;
+	return true;
+}
+
+size_t keyboard_inject_room(KEYBOARD_STATE *ks)
+{
+	return KEYBOARD_INJECT_SIZE - ks->inject_len;
+}
+
+bool keyboard_char_to_key(int ch, SDL_Keycode *key, bool *shift)
+{
+	// Shifted characters on a US keyboard, and the keys they're on
+	static const char shifted[] = "!@#$%^&*()_+{}|:\"<>?~";
+	static const char unshifted[] = "1234567890-=[]\\;',./`";
+	const char *p;
+
+	*shift = false;
+	if (ch >= 'A' && ch <= 'Z') {
+		*shift = true;
+		ch += 'a' - 'A';
+	} else if (ch != 0 && (p = strchr(shifted, ch)) != NULL) {
+		*shift = true;
+		ch = unshifted[p - shifted];
+	}
+
+	switch (ch) {
+		case '\b':	*key = SDLK_BACKSPACE;	return true;
+		case '\t':	*key = SDLK_TAB;		return true;
+		case '\n':
+		case '\r':	*key = SDLK_RETURN;		return true;
+		case 0x1b:	*key = SDLK_ESCAPE;		return true;
+		case 0x7f:	*key = SDLK_DELETE;		return true;
+	}
+
+	// SDL key codes for printable keys are their unshifted ASCII characters
+	if (ch >= ' ' && ch < 0x7f && !(ch >= 'A' && ch <= 'Z')) {
+		for (int i=0; i < sizeof(keymap)/sizeof(keymap[0]); i++) {
+			if (keymap[i].key == ch && !keymap[i].extended) {
+				*key = ch;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Apply injected key events, stopping at the first one whose key has already
+ * changed state during this scan.
+ */
+static void keyboard_apply_injected(KEYBOARD_STATE *ks)
+{
+	SDL_Keycode changed[KEYBOARD_INJECT_SIZE];
+	int nchanged = 0;
+
+	while (ks->inject_len > 0) {
+		SDL_Event *ev = &ks->inject[ks->inject_readp];
+
+		for (int i=0; i<nchanged; i++)
+			if (changed[i] == ev->key.keysym.sym)
+				return;
+		changed[nchanged++] = ev->key.keysym.sym;
+
+		keyboard_event(ks, ev);
+		ks->inject_readp = (ks->inject_readp + 1) % KEYBOARD_INJECT_SIZE;
+		ks->inject_len--;
+	}
+}
+
 void keyboard_scan(KEYBOARD_STATE *ks)
 {
 	int nkeys = 0;
 
+	// Pick up any key events injected since the last scan
+	keyboard_apply_injected(ks);
+
 	// Skip doing the scan if the keyboard hasn't changed state
 	if (!ks->update_flag) return;
 
@@ -6,6 +6,9 @@
 /// Keyboard buffer size in bytes
 #define KEYBOARD_BUFFER_SIZE 256
 
+/// Injected key event queue size
+#define KEYBOARD_INJECT_SIZE 64
+
 #define MOUSE_BUTTON_RIGHT 0x01
 #define MOUSE_BUTTON_MIDDLE 0x02
 #define MOUSE_BUTTON_LEFT 0x04
@@ -40,6 +43,12 @@ typedef struct {
 
 	/// Flag indicating whether last data sent was from the mouse
 	bool lastdata_mouse;
+
+	/// Key events injected from outside SDL, waiting for keyboard_scan()
+	SDL_Event inject[KEYBOARD_INJECT_SIZE];
+
+	/// Injected event queue read pointer and length
+	size_t inject_readp, inject_len;
 } KEYBOARD_STATE;
 
 /**
@@ -63,6 +72,36 @@ void keyboard_event(KEYBOARD_STATE *ks, SDL_Event *ev);
  */
 void keyboard_scan(KEYBOARD_STATE *ks);
 
+/**
+ * Queue a key press or release from a source other than the SDL window.
+ *
+ * The keyboard is a key matrix scanned at 60Hz, so a press and release of the
+ * same key in one scan period would never be seen. Injected events are
+ * applied by keyboard_scan(), which holds back an event until the next scan
+ * if its key has already changed state in this one.
+ *
+ * @param	key		SDL key code.
+ * @param	mod		SDL key modifiers (KMOD_ALT selects the extended keys).
+ * @param	down	true for a press, false for a release.
+ * @return	false if the queue is full and the event was dropped.
+ */
+bool keyboard_inject(KEYBOARD_STATE *ks, SDL_Keycode key, uint16_t mod, bool down);
+
+/**
+ * Find how many more key events keyboard_inject() can queue.
+ */
+size_t keyboard_inject_room(KEYBOARD_STATE *ks);
+
+/**
+ * Find the key which types an ASCII character, assuming a US keyboard layout.
+ *
+ * @param	ch		Character to look up.
+ * @param	key		Receives the SDL key code of the unshifted key.
+ * @param	shift	Receives true if Shift must be held to type ch.
+ * @return	false if the character can't be typed.
+ */
+bool keyboard_char_to_key(int ch, SDL_Keycode *key, bool *shift);
+
 bool keyboard_get_irq(KEYBOARD_STATE *ks);
 uint8_t keyboard_read(KEYBOARD_STATE *ks, uint8_t addr);
 void keyboard_write(KEYBOARD_STATE *ks, uint8_t addr, uint8_t val);
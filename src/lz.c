@@ -0,0 +1,175 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS	12
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+// The block format requires the last match to start at least 12 bytes
+// before the end, and the last 5 bytes to be literals.
+#define LZ_MF_LIMIT		12
+#define LZ_LAST_LITERALS	5
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline unsigned int hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/// Write an LZ4-style length continuation: 255s, then the remainder
+static uint8_t *put_length(uint8_t *op, size_t n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+/**
+ * @brief	Emit one sequence: literals, then (if mlen != 0) a match.
+ * @return	New output pointer, or NULL if it wouldn't fit.
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t litlen, size_t offset, size_t mlen)
+{
+	uint8_t *token = op++;
+	size_t need = 1 + litlen / 255 + 1 + litlen + (mlen ? 2 + mlen / 255 + 1 : 0);
+
+	if ((size_t)(oend - token) < need)
+		return NULL;
+
+	if (litlen >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, litlen - 15);
+	} else {
+		*token = litlen << 4;
+	}
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (mlen) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		mlen -= LZ_MIN_MATCH;
+		if (mlen >= 15) {
+			*token |= 15;
+			op = put_length(op, mlen - 15);
+		} else {
+			*token |= mlen;
+		}
+	}
+	return op;
+}
+
+size_t lz_compress_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	uint8_t *op = dst, *oend = dst + cap;
+	size_t ip = 0, anchor = 0;
+
+	// Positions are stored +1, so 0 means "nothing here yet"
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ_MF_LIMIT) {
+		size_t mflimit = len - LZ_MF_LIMIT;
+		size_t matchlimit = len - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(src + ip);
+			unsigned int h = hash32(seq);
+			size_t ref = table[h];
+			table[h] = ip + 1;
+
+			if (ref == 0 || (ip - (ref - 1)) > LZ_MAX_OFFSET || read32(src + ref - 1) != seq) {
+				ip++;
+				continue;
+			}
+			ref--;
+
+			size_t mlen = LZ_MIN_MATCH;
+			while (ip + mlen < matchlimit && src[ref + mlen] == src[ip + mlen])
+				mlen++;
+
+			op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+			if (op == NULL)
+				return 0;
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	// Whatever's left goes out as literals
+	op = put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+	return op - dst;
+}
+
+long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + len;
+	uint8_t *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t litlen = token >> 4;
+		size_t mlen, offset;
+		uint8_t b;
+
+		if (litlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen)
+			return -1;
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < mlen)
+			return -1;
+
+		// Matches may overlap the output, so copy a byte at a time
+		const uint8_t *match = op - offset;
+		while (mlen--)
+			*op++ = *match++;
+	}
+
+	return op - dst;
+}
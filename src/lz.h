@@ -0,0 +1,41 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief	Small, fast LZ77 codec for disk image chunks.
+ *
+ * The compressed data uses the LZ4 block layout: a sequence of tokens, each
+ * a run of literals followed by a back-reference of at least 4 bytes up to
+ * 64KiB back. It's greedy and single-pass, which is plenty for disk images
+ * that are mostly zeros, padding and repeated structures.
+ */
+
+/**
+ * @brief	Worst-case compressed size of `len` bytes.
+ */
+size_t lz_compress_bound(size_t len);
+
+/**
+ * @brief	Compress a block.
+ * @param	src		Data to compress.
+ * @param	len		Length of the data.
+ * @param	dst		Output buffer.
+ * @param	cap		Size of the output buffer.
+ * @return	Compressed length, or 0 if it wouldn't fit in `cap` bytes.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+/**
+ * @brief	Decompress a block.
+ * @param	src		Compressed data.
+ * @param	len		Length of the compressed data.
+ * @param	dst		Output buffer.
+ * @param	cap		Size of the output buffer.
+ * @return	Decompressed length, or -1 if the data is corrupt or doesn't fit.
+ */
+long lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+
+#endif
@@ -14,6 +14,19 @@
 #include "memory.h"
 #include "fbconfig.h"
 #include "utils.h"
+#include "video.h"
+#include "recorder.h"
+#include "screenshot.h"
+#include "vramhash.h"
+#include "vnc.h"
+#include "shmfb.h"
+#include "screentext.h"
+#include "script.h"
+#include "control.h"
+#include "hdimg.h"
+#include "sched.h"
+#include "diskio.h"
+#include "disktrace.h"
 
 #include "lightbar.c"
 #include "i8274.h"
@@ -28,24 +41,58 @@ void FAIL(char *err)
 	exit(EXIT_FAILURE);
 }
 
-static int load_fd()
+static bool load_fd(void)
 {
-	int writeable = 1;
+	return state_load_floppy(fbc_get_string("floppy", "disk"));
+}
 
-	const char *discim = fbc_get_string("floppy", "disk");
-	state.fdc_disc = fopen(discim, "r+b");
-	if (!state.fdc_disc){
-		writeable = 0;
-		state.fdc_disc = fopen(discim, "rb");
+/**
+ * @brief	Open the image for one hard disk drive, as configured.
+ * @param	drive	Drive number, 0 or 1.
+ * @param	disk	Image file name.
+ * @param	desc	Receives a description of how the image was opened.
+ */
+static HD_IMAGE *open_hd(int drive, const char *disk, const char **desc)
+{
+	const char *backend = fbc_get_string("hard_disk", "backend");
+	const char *overlay = fbc_get_string("hard_disk", drive ? "overlay2" : "overlay1");
+	const char *mode = fbc_get_string("hard_disk", "overlay_mode");
+	const char *ranges = fbc_get_string("hard_disk", drive ? "volatile2" : "volatile1");
+	const char *init = fbc_get_string("hard_disk", "volatile_init");
+	bool discard = false, copy = false;
+	HDIMG_SYNC sync;
+	HD_IMAGE *img;
+
+	if (!hdimg_parse_sync(fbc_get_string("hard_disk", "sync"), &sync)) {
+		fprintf(stderr, "NOTE: unknown hard disk sync policy '%s'; using 'exit'.\n", fbc_get_string("hard_disk", "sync"));
+		sync = HDIMG_SYNC_EXIT;
 	}
-	if (!state.fdc_disc){
-		fprintf(stderr, "ERROR loading floppy image '%s'.\n", discim);
-		state.fdc_disc = NULL;
-		return (0);
-	}else{
-		wd2797_load(&state.fdc_ctx, state.fdc_disc, 512, 2, 40, writeable);
-		return (1);
+
+	if (overlay != NULL && overlay[0] != '\0') {
+		// The configured disk is a read-only base; writes go to the overlay
+		if (strcmp(mode, "discard") == 0) {
+			discard = true;
+		} else if (strcmp(mode, "keep") != 0) {
+			fprintf(stderr, "NOTE: unknown overlay mode '%s'; keeping the overlay.\n", mode);
+		}
+		img = hdimg_open_overlay(overlay, disk, backend, sync, discard);
+		*desc = discard ? "overlay, discarded at exit" : "overlay";
+	} else {
+		img = hdimg_open(disk, backend, sync);
+		*desc = (img != NULL) ? img->backend : "";
+	}
+
+	if (img == NULL)
+		return NULL;
+
+	if (strcmp(init, "image") == 0) {
+		copy = true;
+	} else if (strcmp(init, "zero") != 0) {
+		fprintf(stderr, "NOTE: unknown volatile_init '%s'; starting volatile sectors zeroed.\n", init);
 	}
+
+	// bytes per sector is fixed at 512; see load_hd
+	return hdimg_volatile(hdimg_cache(img, 512), ranges, copy, 512);
 }
 
 static int load_hd()
@@ -58,15 +105,16 @@ static int load_hd()
 	// bytes per sector is fixed at 512, not configurable, all hard drives of the 3B1
 	// era used 512-byte sectors.
 	const int bytes_per_sector = 512;
+	const char *desc;
 
-	state.hdc_disc0 = fopen(disk1, "r+b");
+	state.hdc_disc0 = open_hd(0, disk1, &desc);
 	if (!state.hdc_disc0){
 		fprintf(stderr, "Drive 0: ERROR loading disc image '%s'.\n", disk1);
 		state.hdc_disc0 = NULL;
 		return (0);
 	} else {
 		if (wd2010_init(&state.hdc_ctx, state.hdc_disc0, 0, bytes_per_sector, sectors_per_track, heads) == WD2010_ERR_OK) {
-			printf("Drive 0: Disc image '%s' loaded.\n", disk1);
+			printf("Drive 0: Disc image '%s' loaded (%s).\n", disk1, desc);
 			ret = 1;
 		} else {
 			fprintf(stderr, "Drive 0: ERROR loading disc image '%s'.\n", disk1);
@@ -74,13 +122,13 @@ static int load_hd()
 		}
 	}
 
-	state.hdc_disc1 = fopen(disk2, "r+b");
+	state.hdc_disc1 = open_hd(1, disk2, &desc);
 	if (!state.hdc_disc1){
 		fprintf(stderr, "Drive 1: ERROR loading disc image '%s'.\n", disk2);
 		state.hdc_disc1 = NULL;
 	} else {
 		if (wd2010_init(&state.hdc_ctx, state.hdc_disc1, 1, bytes_per_sector, sectors_per_track, heads) == WD2010_ERR_OK) {
-			printf("Drive 1: Disc image '%s' loaded.\n", disk2);
+			printf("Drive 1: Disc image '%s' loaded (%s).\n", disk2, desc);
 		} else {
 			fprintf(stderr, "Drive 1: ERROR loading disc image '%s'.\n", disk2);
 		}
@@ -90,67 +138,18 @@ static int load_hd()
 
 
 
-/**
- * @brief Set the pixel at (x, y) to the given value
- * @note The surface must be locked before calling this!
- * @param	surface		SDL surface upon which to draw
- * @param	x			X co-ordinate
- * @param	y			Y co-ordinate
- * @param	pixel		Pixel value (from SDL_MapRGB)
- */
-static inline void putpixel(SDL_Surface *surface, int x, int y, Uint32 pixel)
-{
-	int bpp = surface->format->BytesPerPixel;
-	/* Here p is the address to the pixel we want to set */
-	Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
-
-	switch (bpp) {
-		case 1:
-			*p = pixel;
-			break;
-
-		case 2:
-			*(Uint16 *)p = pixel;
-			break;
-
-		case 3:
-			if (SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-				p[0] = (pixel >> 16) & 0xff;
-				p[1] = (pixel >> 8) & 0xff;
-				p[2] = pixel & 0xff;
-			}
-			else {
-				p[0] = pixel & 0xff;
-				p[1] = (pixel >> 8) & 0xff;
-				p[2] = (pixel >> 16) & 0xff;
-			}
-			break;
-
-		case 4:
-			*(Uint32 *)p = pixel;
-			break;
-
-		default:
-			break;           /* shouldn't happen, but avoids warnings */
-	} // switch
-}
-
-
 /**
  * @brief	Refresh the screen.
- * @param	surface		SDL surface upon which to draw.
  * @param	renderer	SDL renderer.
- * @param	texture		SDL texture to copy surface to.
+ * @param	texture		SDL streaming texture to draw into.
+ *
+ * VRAM is expanded straight into the texture's locked pixel buffer, so there
+ * is no intermediate surface to copy from.
  */
-void refreshScreen(SDL_Surface *s, SDL_Renderer *r, SDL_Texture *t)
+void refreshScreen(SDL_Renderer *r, SDL_Texture *t)
 {
-	// Lock the screen surface (if necessary)
-	if (SDL_MUSTLOCK(s)) {
-		if (SDL_LockSurface(s) < 0) {
-			fprintf(stderr, "ERROR: Unable to lock screen!\n");
-			exit(EXIT_FAILURE);
-		}
-	}
+	void *pixels;
+	int pitch;
 
 	static int red, green, blue;
 	static bool inited = false;
@@ -161,44 +160,31 @@ void refreshScreen(SDL_Surface *s, SDL_Renderer *r, SDL_Texture *t)
 		blue = fbc_get_int("display", "blue");
 	}
 
-	// Map the foreground and background colours
-//	Uint32 fg = SDL_MapRGB(s->format, 0xFF, 0xC1, 0x06);	// amber foreground
-//	Uint32 fg = SDL_MapRGB(s->format, 0xFF, 0xFF, 0xFF);	// white foreground
-//	Uint32 fg = SDL_MapRGB(s->format, 0x50, 0xFF, 0xA0);	// minty foreground (possibly closer to actual color?)
-//	Uint32 fg = SDL_MapRGB(s->format, 0x00, 0xFF, 0x00);	// green foreground
-	Uint32 fg = SDL_MapRGB(s->format, red, green, blue);
-	Uint32 bg = SDL_MapRGB(s->format, 0x00, 0x00, 0x00);	// black background
+	// Lock the framebuffer texture. The pitch may be wider than the screen.
+	if (SDL_LockTexture(t, NULL, &pixels, &pitch) < 0) {
+		fprintf(stderr, "ERROR: Unable to lock screen texture: %s\n", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
+
+	// Map the foreground and background colours. The texture is RGB888, so
+	// each pixel is 0x00RRGGBB regardless of host byte order.
+//	Uint32 fg = 0xFFC106;	// amber foreground
+//	Uint32 fg = 0xFFFFFF;	// white foreground
+//	Uint32 fg = 0x50FFA0;	// minty foreground (possibly closer to actual color?)
+//	Uint32 fg = 0x00FF00;	// green foreground
+	Uint32 fg = ((red & 0xFF) << 16) | ((green & 0xFF) << 8) | (blue & 0xFF);
+	Uint32 bg = 0x000000;	// black background
 
 	// Whole screen reverse video just swaps the two -- no need to touch VRAM
 	if (state.reverse_video) {
 		Uint32 t = fg; fg = bg; bg = t;
 	}
+	video_set_colours(fg, bg);
 
-	// Refresh the 3B1 screen area first. TODO: only do this if VRAM has actually changed!
-	uint32_t vram_address = 0;
-	for (int y=0; y<348; y++) {
-		for (int x=0; x<720; x+=16) {	// 720 pixels, monochrome, packed into 16bit words
-			// Get the pixel
-			uint16_t val = RD16(state.vram, vram_address, sizeof(state.vram)-1);
-			vram_address += 2;
-			// Now copy it to the video buffer
-			for (int px=0; px<16; px++) {
-				if (val & 1)
-					putpixel(s, x+px, y, fg);
-				else
-					putpixel(s, x+px, y, bg);
-				val >>= 1;
-			}
-		}
-	}
-
-	// Unlock the screen surface
-	if (SDL_MUSTLOCK(s)) {
-		SDL_UnlockSurface(s);
-	}
+	// Refresh the 3B1 screen area. 1bpp VRAM is expanded a byte at a time.
+	video_render(pixels, pitch, state.vram);
 
-	// Update framebuffer texture
-	SDL_UpdateTexture(t, NULL, s->pixels, s->pitch);
+	SDL_UnlockTexture(t);
 	SDL_RenderCopy(r, t, NULL, NULL);
 }
 
@@ -255,14 +241,15 @@ bool HandleSDLEvents(SDL_Window *window)
 						break;
 					case SDLK_F11:
 						if (state.fdc_disc) {
-							wd2797_unload(&state.fdc_ctx);
-							fclose(state.fdc_disc);
-							state.fdc_disc = NULL;
+							state_unload_floppy();
 							printf("Floppy image unloaded.\n");
 						} else {
 							load_fd();
 						}
 						break;
+					case SDLK_PRINTSCREEN:
+						screenshot_request(NULL);
+						break;
 					case SDLK_F12:
 						if (event.key.keysym.mod & (KMOD_LALT | KMOD_RALT))
 							// ALT-F12 pressed; exit emulator
@@ -358,6 +345,52 @@ void validate_memory(int base_memory, int extended_memory)
        printf("*WARNING*: 1MB or higher RAM recommended for UNIX 3.51.\n\n");
 }
 
+/**
+ * Frame pacing statistics.
+ *
+ * When the host can't keep up with realtime, rendering is skipped to give the
+ * CPU emulation more of the host's time, and lag beyond a limit is dropped
+ * rather than caught up. These counters let the user know it's happening.
+ */
+static struct {
+	uint32_t	frames;			///< 60Hz ticks
+	uint32_t	skipped;		///< ticks where rendering was skipped
+	uint32_t	late;			///< timeslots which fell further behind realtime
+	uint32_t	max_lateness;	///< furthest behind, in milliseconds
+	uint64_t	total_lateness;	///< sum of new lateness over late timeslots, ms
+	uint64_t	dropped;		///< time given up to bound the lag, ms
+} pacing, pacing_total;
+
+/**
+ * @brief	Print and reset the frame pacing statistics.
+ * @param	what	Description of the period covered.
+ */
+static void pacing_report(const char *what)
+{
+	if (pacing.late == 0 && pacing.skipped == 0)
+		return;
+
+	printf("[timing] %s: %u/%u frames skipped, %u late timeslots (avg %llu ms, max %u ms), %llu ms dropped\n",
+			what, pacing.skipped, pacing.frames, pacing.late,
+			(unsigned long long)(pacing.late ? pacing.total_lateness / pacing.late : 0),
+			pacing.max_lateness, (unsigned long long)pacing.dropped);
+}
+
+/**
+ * @brief	Fold the current pacing statistics into the run totals and reset them.
+ */
+static void pacing_accumulate(void)
+{
+	pacing_total.frames += pacing.frames;
+	pacing_total.skipped += pacing.skipped;
+	pacing_total.late += pacing.late;
+	pacing_total.total_lateness += pacing.total_lateness;
+	pacing_total.dropped += pacing.dropped;
+	if (pacing.max_lateness > pacing_total.max_lateness)
+		pacing_total.max_lateness = pacing.max_lateness;
+	memset(&pacing, 0, sizeof(pacing));
+}
+
 /****************************
  * blessed be thy main()...
  ****************************/
@@ -432,11 +465,6 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Error creating SDL FB texture: %s.\n", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
-    SDL_Surface *screen = SDL_CreateRGBSurface(0, 720, 348, 32, 0, 0, 0, 0);
-	if (!screen){
-		fprintf(stderr, "Error creating SDL FB surface: %s.\n", SDL_GetError());
-		exit(EXIT_FAILURE);
-	}
 	// Load in status LED sprites
     SDL_Surface *surf = SDL_CreateRGBSurfaceFrom((void*)lightbar.pixel_data, lightbar.width, lightbar.height,
 														lightbar.bytes_per_pixel*8, lightbar.bytes_per_pixel*lightbar.width,
@@ -449,11 +477,41 @@ int main(int argc, char *argv[])
 	SDL_Texture *lightbarTexture = SDL_CreateTextureFromSurface(renderer, surf);
 	SDL_FreeSurface(surf);
 
-	printf("Set %dx%d at %d bits-per-pixel mode\n\n", (int) ceilf(720*scalex), (int) ceilf(348*scaley), screen->format->BitsPerPixel);
+	printf("Set %dx%d at 32 bits-per-pixel mode\n\n", (int) ceilf(720*scalex), (int) ceilf(348*scaley));
 
 	// Set up the dialer's tone output (the system beep comes through it)
 	dialer_init();
 
+	// Start the screen recorder, if one is configured
+	recorder_init();
+
+	// Start the screenshot writer
+	screenshot_init();
+
+	// Start hashing frames, if asked to
+	vramhash_init();
+
+	// Start the VNC server, if one is configured
+	vnc_init();
+
+	// Export the screen in shared memory, if asked to
+	shmfb_init();
+
+	// Set up screen text extraction
+	screentext_init();
+
+	// Load the automation script, if there is one
+	script_init();
+
+	// Listen for control clients, if asked to
+	control_init();
+
+	// Start the disc I/O worker, if asked to
+	diskio_init();
+
+	// Start tracing disc commands, if asked to
+	disktrace_init();
+
 	// Load a disc image
 	load_fd();
 
@@ -474,24 +532,79 @@ int main(int argc, char *argv[])
 	bool exitEmu = false;
 	uint8_t last_leds = 255;
 
+	/***
+	 * Frame pacing. If the host falls behind realtime, up to MAX_FRAMESKIP
+	 * consecutive frames go unrendered so the CPU can catch up. If we get more
+	 * than MAX_LAG milliseconds behind, the excess is dropped -- the guest
+	 * runs slow rather than trying to burst through a backlog.
+	 */
+	const int MAX_FRAMESKIP = fbc_get_int("timing", "max_frameskip");
+	const uint32_t MAX_LAG = fbc_get_int("timing", "max_lag");
+	const uint32_t REPORT_INTERVAL = fbc_get_int("timing", "report_interval") * 1000;
+	uint32_t next_report = SDL_GetTicks() + REPORT_INTERVAL;
+	uint32_t behind = 0;		// lateness already counted, ms
+	int frames_skipped = 0;
+
+	/***
+	 * Disc DMA speed. "normal" moves up to 21 words per CPU slice, as this
+	 * emulator always has. "fast" moves as much as the controller has ready
+	 * at once, so a whole transfer finishes (and the controller interrupts)
+	 * in the slice after it's started. "rate" moves dma.rate bytes per
+	 * microsecond of emulated time.
+	 */
+	enum { DMA_NORMAL, DMA_FAST, DMA_RATE } dma_mode = DMA_NORMAL;
+	const char *dma_mode_name = fbc_get_string("dma", "mode");
+	const double DMA_WORDS_PER_CYCLE = fbc_get_double("dma", "rate") / 2 / SCHED_CYCLES_PER_USEC;
+	double dma_credit = 0;		// words the rate allows, not yet used
+	if (strcmp(dma_mode_name, "fast") == 0) {
+		dma_mode = DMA_FAST;
+	} else if (strcmp(dma_mode_name, "rate") == 0 && DMA_WORDS_PER_CYCLE > 0) {
+		dma_mode = DMA_RATE;
+	} else if (strcmp(dma_mode_name, "normal") != 0) {
+		fprintf(stderr, "NOTE: unknown DMA mode '%s' (or rate not above 0); using 'normal'.\n", dma_mode_name);
+	}
+
 	/*bool lastirq_fdc = false;*/
 	for (;;) {
+		// Paused by a control client: keep serving it and the window, but
+		// run nothing
+		if (control_paused()) {
+			control_poll(&state.kbd, state.vram, state.reverse_video);
+			if (HandleSDLEvents(window) || control_exit_requested(NULL))
+				break;
+			SDL_Delay(MILLISECS_PER_TIMESLOT);
+			next_timeslot = SDL_GetTicks() + MILLISECS_PER_TIMESLOT;
+			behind = 0;
+			continue;
+		}
+
 		for (i = 0; i < CYCLES_PER_TIMESLOT; i += cycles_run){
 			// Run the CPU for however many cycles we need to. CPU core clock is
 			// 10MHz, and we're running at 240Hz/timeslot. Thus: 10e6/240 or
 			// 41667 cycles per timeslot.
 			cycles_run = m68k_execute(CYCLES_PER_TIMESLOT / NUM_CPU_TIMESLOTS);
 			clock_cycles += cycles_run;
+			state.cycles += cycles_run;
+			// Run any device events which are now due
+			sched_run(state.cycles);
 
 			// Run the DMA engine
 			if (state.dmaen) {
 				// DMA ready to go -- so do it.
-				size_t num = 0;
+				size_t num = 0, max_num;
+				if (dma_mode == DMA_FAST) {
+					max_num = SIZE_MAX;
+				} else if (dma_mode == DMA_RATE) {
+					dma_credit += cycles_run * DMA_WORDS_PER_CYCLE;
+					max_num = (size_t)dma_credit;
+				} else {
+					max_num = (1e6/TIMESLOT_FREQUENCY / NUM_CPU_TIMESLOTS) + 1;
+				}
 				while (state.dma_count < 0x4000) {
 					uint16_t d = 0;
 
-					// num tells us how many words we've copied. If this is greater than the per-timeslot DMA maximum, bail out!
-					if (num > (1e6/TIMESLOT_FREQUENCY / NUM_CPU_TIMESLOTS)) break;
+					// num tells us how many words we've copied. If this reaches the per-slice DMA maximum, bail out!
+					if (num >= max_num) break;
 
 					// Evidently we have more words to copy. Copy them.
 					if (state.dma_dev == DMA_DEV_FD){
@@ -559,6 +672,13 @@ int main(int argc, char *argv[])
 					num++; state.dma_count++;
 				}
 
+				// Unused credit doesn't carry over once the transfer stops for
+				// some other reason (no data ready, or finished)
+				if (num < max_num)
+					dma_credit = 0;
+				else
+					dma_credit -= num;
+
 				// Turn off DMA engine if we finished this cycle
 				if (state.dma_count >= 0x4000) {
 					// FIXME? apparently this isn't required... or is it?
@@ -596,16 +716,33 @@ int main(int argc, char *argv[])
 		}
 		// Is it time to run the 60Hz periodic interrupt yet?
 		if (clock_cycles > CLOCKS_PER_60HZ) {
-			// Refresh the screen if VRAM has been changed
-			if (state.vram_updated){
-				refreshScreen(screen, renderer, fbTexture);
-			}
-			if (state.vram_updated || last_leds != state.leds){
-				refreshStatusBar(renderer, lightbarTexture);
-				last_leds = state.leds;
+			// Record every frame, even ones which don't get rendered
+			recorder_frame(state.vram, state.reverse_video);
+			screenshot_frame(state.vram, state.reverse_video);
+			if (vramhash_frame(state.vram, state.vram_updated, state.cycles))
+				exitEmu = true;
+
+			// If we're running behind, skip rendering this frame to give the
+			// time to the CPU instead. VRAM changes stay pending until the
+			// next frame which is drawn.
+			pacing.frames++;
+			if (SDL_TICKS_PASSED(SDL_GetTicks(), next_timeslot) && (frames_skipped < MAX_FRAMESKIP)) {
+				frames_skipped++;
+				pacing.skipped++;
+			} else {
+				frames_skipped = 0;
+
+				// Refresh the screen if VRAM has been changed
+				if (state.vram_updated){
+					refreshScreen(renderer, fbTexture);
+				}
+				if (state.vram_updated || last_leds != state.leds){
+					refreshStatusBar(renderer, lightbarTexture);
+					last_leds = state.leds;
+				}
+				state.vram_updated = false;
+				SDL_RenderPresent(renderer);
 			}
-			state.vram_updated = false;
-			SDL_RenderPresent(renderer);
 
 			// Latch the 60Hz interrupt. If CLRSINT- is being held low the
 			// clear input is asserted, so the latch can't set and this tick
@@ -613,10 +750,24 @@ int main(int argc, char *argv[])
 			if (state.timer_clrsint) {
 				state.timer_int_latch = true;
 			}
+			// serve VNC viewers, and take their keyboard and mouse input
+			vnc_poll(&state.kbd, state.vram, state.reverse_video, state.vram_dirty);
+			// publish changed scanlines to shared memory readers
+			shmfb_frame(state.vram, state.reverse_video, state.vram_dirty, state.cycles);
+			// note which text cells need matching again
+			screentext_frame(state.vram, state.vram_dirty);
+			// run the automation script until it has to wait
+			script_frame(&state.kbd, state.vram, state.vram_dirty);
+			if (script_exit_requested(NULL))
+				exitEmu = true;
+			// run control clients' script commands, and count down steps
+			control_frame(&state.kbd, state.vram, state.vram_dirty);
 			// scan the keyboard
 			keyboard_scan(&state.kbd);
 			// scan the serial pty for new data
 			i8274_scan_incoming(&state.serial_ctx, CHAN_A);
+			// everything interested in VRAM changes has seen them now
+			memset(state.vram_dirty, 0, sizeof(state.vram_dirty));
 			// decrement clock cycle counter, we've handled the intr.
 			clock_cycles -= CLOCKS_PER_60HZ;
 		}
@@ -625,17 +776,46 @@ int main(int argc, char *argv[])
 		if (HandleSDLEvents(window))
 			exitEmu = true;
 
+		// run commands from control clients
+		control_poll(&state.kbd, state.vram, state.reverse_video);
+		if (control_exit_requested(NULL))
+			exitEmu = true;
+
 		// make sure frame rate is equal to real time
 		uint32_t now = SDL_GetTicks();
 		if (now < next_timeslot) {
 			// timeslot finished early -- eat up some time
 			SDL_Delay(next_timeslot - now);
+			behind = 0;
+		} else if (now > next_timeslot) {
+			// timeslot finished late. Carry on without delay to catch up, but
+			// if we're too far behind, give up on the excess. The timeslots
+			// run while catching up are late too, but only lateness on top of
+			// what's already been counted is new.
+			uint32_t lateness = now - next_timeslot;
+			if (lateness > behind) {
+				pacing.late++;
+				pacing.total_lateness += lateness - behind;
+			}
+			if (lateness > pacing.max_lateness)
+				pacing.max_lateness = lateness;
+			if (lateness > MAX_LAG) {
+				pacing.dropped += lateness - MAX_LAG;
+				next_timeslot = now - MAX_LAG;
+				lateness = MAX_LAG;
+			}
+			behind = lateness;
 		} else {
-			// timeslot finished late -- skip ahead to gain time
-			// TODO: if this happens a lot, we should let the user know
-			// that their PC might not be fast enough...
-			next_timeslot = now;
+			behind = 0;
+		}
+
+		// let the user know if their PC isn't keeping up
+		if (REPORT_INTERVAL && SDL_TICKS_PASSED(now, next_report)) {
+			pacing_report("last interval");
+			pacing_accumulate();
+			next_report = now + REPORT_INTERVAL;
 		}
+
 		// advance to the next timeslot
 		next_timeslot += MILLISECS_PER_TIMESLOT;
 
@@ -643,18 +823,32 @@ int main(int argc, char *argv[])
 		if (exitEmu) break;
 	}
 
-	// Close the disc images before exiting
-	wd2797_unload(&state.fdc_ctx);
+	// Pacing summary for the whole run
+	pacing_accumulate();
+	pacing = pacing_total;
+	pacing_report("run total");
 
-	if (state.fdc_disc != NULL) {
-		fclose(state.fdc_disc);
-	}
+	// Close the disc images before exiting
+	state_unload_floppy();
 
 	dialer_done();
 
+	recorder_done();
+
+	screenshot_done();
+
+	vramhash_done();
+
+	vnc_done();
+
+	shmfb_done();
+
+	script_done();
+
+	screentext_done();
+
 	// Clean up SDL
 	SDL_DestroyTexture(lightbarTexture);
-	SDL_FreeSurface(screen);
 	SDL_DestroyTexture(fbTexture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
@@ -662,5 +856,11 @@ int main(int argc, char *argv[])
     	// clean up all hardware state
 	state_done();
 
-	return 0;
+	// tell a control client which asked to exit that the images are closed
+	control_done();
+
+	// a control client or a script can ask for a particular exit status
+	if (!control_exit_requested(&i))
+		script_exit_requested(&i);
+	return i;
 }
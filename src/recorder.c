@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "recorder.h"
+#include "video.h"
+#include "fbconfig.h"
+
+/// Most frame records allowed to wait for the writer thread. If the writer
+/// falls this far behind, frames are dropped rather than slowing the CPU loop.
+#define MAX_QUEUED	256
+
+/// A frame record waiting to be written
+typedef struct record {
+	struct record	*next;
+	size_t			len;
+	uint8_t			data[];
+} RECORD;
+
+static struct {
+	bool		active;
+	FILE		*fp;
+	uint32_t	frame;			///< current 60Hz tick number
+	uint8_t		last[VIDEO_HEIGHT * VIDEO_STRIDE];	///< last frame queued
+	uint8_t		last_flags;
+	bool		have_last;		///< false until the first frame is queued
+	uint32_t	written;		///< records queued
+	uint32_t	dropped;		///< records dropped because the queue was full
+
+	// Writer thread and its queue
+	SDL_Thread	*thread;
+	SDL_mutex	*lock;
+	SDL_cond	*cond;
+	RECORD		*head, *tail;
+	int			queued;
+	bool		stopping;
+} rec;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+static int recorder_thread(void *arg)
+{
+	(void)arg;
+
+	SDL_LockMutex(rec.lock);
+	for (;;) {
+		while (rec.head == NULL && !rec.stopping)
+			SDL_CondWait(rec.cond, rec.lock);
+		if (rec.head == NULL)
+			break;
+
+		// Take the whole queue, and write it out without holding the lock
+		RECORD *r = rec.head;
+		rec.head = rec.tail = NULL;
+		rec.queued = 0;
+		SDL_UnlockMutex(rec.lock);
+
+		while (r != NULL) {
+			RECORD *next = r->next;
+			if (fwrite(r->data, 1, r->len, rec.fp) != r->len) {
+				fprintf(stderr, "recorder: write error, recording may be truncated\n");
+			}
+			free(r);
+			r = next;
+		}
+
+		SDL_LockMutex(rec.lock);
+	}
+	SDL_UnlockMutex(rec.lock);
+
+	return 0;
+}
+
+/**
+ * @brief	Queue a record for the writer thread.
+ * @param	r		Record to queue. Ownership passes to the writer if queued.
+ * @param	force	Queue the record even if the queue is full.
+ * @return	false if the queue is full and the record was not queued.
+ */
+static bool queue_record(RECORD *r, bool force)
+{
+	bool ok = false;
+
+	r->next = NULL;
+	SDL_LockMutex(rec.lock);
+	if (force || rec.queued < MAX_QUEUED) {
+		if (rec.tail)
+			rec.tail->next = r;
+		else
+			rec.head = r;
+		rec.tail = r;
+		rec.queued++;
+		ok = true;
+		SDL_CondSignal(rec.cond);
+	}
+	SDL_UnlockMutex(rec.lock);
+
+	return ok;
+}
+
+void recorder_init(void)
+{
+	uint8_t hdr[FBV_HEADER_SIZE];
+	const char *filename = fbc_get_string("recorder", "file");
+
+	memset(&rec, 0, sizeof(rec));
+	if (filename == NULL || filename[0] == '\0')
+		return;
+
+	if ((rec.fp = fopen(filename, "wb")) == NULL) {
+		fprintf(stderr, "NOTE: could not open recording file '%s'; not recording.\n", filename);
+		return;
+	}
+
+	memcpy(hdr, FBV_MAGIC, 4);
+	put16(&hdr[4], VIDEO_WIDTH);
+	put16(&hdr[6], VIDEO_HEIGHT);
+	put16(&hdr[8], VIDEO_STRIDE);
+	put16(&hdr[10], 60);
+	hdr[12] = fbc_get_int("display", "red");
+	hdr[13] = fbc_get_int("display", "green");
+	hdr[14] = fbc_get_int("display", "blue");
+	hdr[15] = 0;
+	if (fwrite(hdr, 1, sizeof(hdr), rec.fp) != sizeof(hdr)) {
+		fprintf(stderr, "NOTE: could not write recording file '%s'; not recording.\n", filename);
+		fclose(rec.fp);
+		return;
+	}
+
+	rec.lock = SDL_CreateMutex();
+	rec.cond = SDL_CreateCond();
+	rec.thread = SDL_CreateThread(recorder_thread, "recorder", NULL);
+	if (!rec.lock || !rec.cond || !rec.thread) {
+		fprintf(stderr, "NOTE: could not start recorder thread (%s); not recording.\n", SDL_GetError());
+		fclose(rec.fp);
+		return;
+	}
+
+	rec.active = true;
+	printf("Recording screen to '%s'.\n", filename);
+}
+
+void recorder_frame(const uint8_t *vram, bool reverse)
+{
+	uint8_t flags = reverse ? FBV_FLAG_REVERSE : 0;
+	int changed[VIDEO_HEIGHT];
+	int nlines = 0;
+
+	if (!rec.active)
+		return;
+
+	// Find the scanlines which changed since the last frame that was queued.
+	// If a frame gets dropped, the next one is still diffed against what the
+	// file has, so nothing is lost except the timing of the dropped frame.
+	for (int y = 0; y < VIDEO_HEIGHT; y++) {
+		if (!rec.have_last || memcmp(&vram[y * VIDEO_STRIDE], &rec.last[y * VIDEO_STRIDE], VIDEO_STRIDE) != 0)
+			changed[nlines++] = y;
+	}
+
+	if (nlines > 0 || flags != rec.last_flags || !rec.have_last) {
+		RECORD *r = malloc(sizeof(RECORD) + FBV_RECORD_SIZE + nlines * (2 + VIDEO_STRIDE));
+		if (r == NULL) {
+			rec.dropped++;
+		} else {
+			uint8_t *p = r->data;
+			put32(p, rec.frame);
+			p[4] = flags;
+			put16(&p[5], nlines);
+			p += FBV_RECORD_SIZE;
+			for (int i = 0; i < nlines; i++) {
+				put16(p, changed[i]);
+				memcpy(p + 2, &vram[changed[i] * VIDEO_STRIDE], VIDEO_STRIDE);
+				p += 2 + VIDEO_STRIDE;
+			}
+			r->len = p - r->data;
+
+			if (queue_record(r, false)) {
+				for (int i = 0; i < nlines; i++)
+					memcpy(&rec.last[changed[i] * VIDEO_STRIDE], &vram[changed[i] * VIDEO_STRIDE], VIDEO_STRIDE);
+				rec.last_flags = flags;
+				rec.have_last = true;
+				rec.written++;
+			} else {
+				free(r);
+				rec.dropped++;
+			}
+		}
+	}
+
+	rec.frame++;
+}
+
+void recorder_done(void)
+{
+	if (!rec.active)
+		return;
+
+	// Mark the end of the recording with an empty record
+	RECORD *r = malloc(sizeof(RECORD) + FBV_RECORD_SIZE);
+	if (r != NULL) {
+		put32(r->data, rec.frame);
+		r->data[4] = rec.last_flags | FBV_FLAG_END;
+		put16(&r->data[5], 0);
+		r->len = FBV_RECORD_SIZE;
+		queue_record(r, true);
+	}
+
+	// Let the writer drain the queue and exit
+	SDL_LockMutex(rec.lock);
+	rec.stopping = true;
+	SDL_CondSignal(rec.cond);
+	SDL_UnlockMutex(rec.lock);
+	SDL_WaitThread(rec.thread, NULL);
+
+	fclose(rec.fp);
+	SDL_DestroyCond(rec.cond);
+	SDL_DestroyMutex(rec.lock);
+
+	printf("Recording stopped: %u frames, %u changed", rec.frame, rec.written);
+	if (rec.dropped)
+		printf(", %u dropped (writer couldn't keep up)", rec.dropped);
+	printf(".\n");
+
+	rec.active = false;
+}
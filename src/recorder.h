@@ -0,0 +1,66 @@
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief	Screen recorder -- captures VRAM to a compact 1bpp delta stream.
+ *
+ * File format (all multi-byte values little-endian):
+ *
+ *   Header, 16 bytes:
+ *		char		magic[4]		"FBV1"
+ *		uint16_t	width			pixels (720)
+ *		uint16_t	height			scanlines (348)
+ *		uint16_t	stride			bytes per scanline (90)
+ *		uint16_t	rate			frames per second (60)
+ *		uint8_t		fg[3]			foreground colour, R/G/B
+ *		uint8_t		reserved
+ *
+ *   Then one record per frame which differs from the one before it:
+ *		uint32_t	frame			60Hz tick number, counted from 0
+ *		uint8_t		flags			FBV_FLAG_xxx
+ *		uint16_t	nlines			number of changed scanlines which follow
+ *		nlines * {
+ *			uint16_t	line		scanline number
+ *			uint8_t		data[stride]	scanline VRAM, as stored in VRAM
+ *		}
+ *
+ * Frames which aren't recorded are identical to the last one that was. The
+ * first record always carries every scanline, and a final record with no
+ * scanlines and FBV_FLAG_END set marks the frame on which recording stopped.
+ *
+ * VRAM data is stored exactly as the 3B1 has it: 16-bit big-endian words,
+ * leftmost pixel in the LSB of the word, 1 = foreground.
+ */
+
+#define FBV_MAGIC			"FBV1"
+#define FBV_HEADER_SIZE		16
+#define FBV_RECORD_SIZE		7		///< frame record header size, in bytes
+#define FBV_FLAG_REVERSE	0x01	///< whole screen reverse video
+#define FBV_FLAG_END		0x80	///< end of recording; this frame is not shown
+
+/**
+ * @brief	Start recording, if a recording file is set in the config.
+ *
+ * Failure to open the file is reported but not fatal.
+ */
+void recorder_init(void);
+
+/**
+ * @brief	Stop recording, flush everything queued and close the file.
+ */
+void recorder_done(void);
+
+/**
+ * @brief	Feed a frame to the recorder. Call this on every 60Hz tick.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ *
+ * This only compares the frame against the last one and queues what changed;
+ * the file is written by a background thread.
+ */
+void recorder_frame(const uint8_t *vram, bool reverse);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sched.h"
+
+/// Maximum number of pending events. Each device only ever has a few.
+#define SCHED_MAX_EVENTS	32
+
+typedef struct {
+	uint64_t	when;
+	SCHED_FN	fn;
+	void		*arg;
+} SCHED_EVENT;
+
+static struct {
+	SCHED_EVENT	ev[SCHED_MAX_EVENTS];	///< pending events, soonest first
+	int			count;
+	uint64_t	now;
+} sched;
+
+static int find_event(SCHED_FN fn, void *arg)
+{
+	for (int i = 0; i < sched.count; i++)
+		if (sched.ev[i].fn == fn && sched.ev[i].arg == arg)
+			return i;
+	return -1;
+}
+
+static void remove_event(int i)
+{
+	for (; i < sched.count - 1; i++)
+		sched.ev[i] = sched.ev[i + 1];
+	sched.count--;
+}
+
+bool sched_add(uint64_t delay, SCHED_FN fn, void *arg)
+{
+	uint64_t when = sched.now + delay;
+	int i;
+
+	if ((i = find_event(fn, arg)) >= 0)
+		remove_event(i);
+
+	if (sched.count == SCHED_MAX_EVENTS) {
+		fprintf(stderr, "NOTE: emulated event queue full; running event early.\n");
+		fn(arg);
+		return false;
+	}
+
+	// Insert after any events due at the same time, so they run in order
+	for (i = sched.count; i > 0 && sched.ev[i - 1].when > when; i--)
+		sched.ev[i] = sched.ev[i - 1];
+	sched.ev[i].when = when;
+	sched.ev[i].fn = fn;
+	sched.ev[i].arg = arg;
+	sched.count++;
+	return true;
+}
+
+bool sched_cancel(SCHED_FN fn, void *arg)
+{
+	int i = find_event(fn, arg);
+
+	if (i < 0)
+		return false;
+	remove_event(i);
+	return true;
+}
+
+bool sched_pending(SCHED_FN fn, void *arg)
+{
+	return find_event(fn, arg) >= 0;
+}
+
+void sched_run(uint64_t now)
+{
+	sched.now = now;
+
+	// Handlers may add or cancel events, so take them one at a time
+	while (sched.count > 0 && sched.ev[0].when <= now) {
+		SCHED_EVENT ev = sched.ev[0];
+		remove_event(0);
+		ev.fn(ev.arg);
+	}
+}
+
+uint64_t sched_now(void)
+{
+	return sched.now;
+}
@@ -0,0 +1,64 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief	Emulated-time event queue.
+ *
+ * Device models use this to make something happen a set amount of emulated
+ * time from now -- a seek finishing, data arriving from the disc -- rather
+ * than after a wall-clock delay on another thread. Events run on the
+ * emulation thread, in order of due time (and in the order they were added,
+ * for events due at the same time), from sched_run() in the main loop.
+ *
+ * Time is counted in CPU clock cycles, the same as state.cycles.
+ */
+
+/// CPU clock cycles per microsecond of emulated time
+#define SCHED_CYCLES_PER_USEC	10
+
+/// Convert microseconds of emulated time to cycles
+#define SCHED_USEC(us)		((uint64_t)(us) * SCHED_CYCLES_PER_USEC)
+/// Convert milliseconds of emulated time to cycles
+#define SCHED_MSEC(ms)		((uint64_t)(ms) * 1000 * SCHED_CYCLES_PER_USEC)
+
+/// Event handler
+typedef void (*SCHED_FN)(void *arg);
+
+/**
+ * @brief	Schedule an event.
+ * @param	delay	Cycles from now.
+ * @param	fn		Handler.
+ * @param	arg		Passed to the handler.
+ * @return	false if the queue is full (the handler is then run immediately).
+ *
+ * If the same handler and argument are already scheduled, that event is
+ * moved rather than a second one being added.
+ */
+bool sched_add(uint64_t delay, SCHED_FN fn, void *arg);
+
+/**
+ * @brief	Cancel an event.
+ * @return	true if the event was pending.
+ */
+bool sched_cancel(SCHED_FN fn, void *arg);
+
+/**
+ * @brief	Check whether an event is pending.
+ */
+bool sched_pending(SCHED_FN fn, void *arg);
+
+/**
+ * @brief	Advance emulated time and run every event which is now due.
+ * @param	now		Current emulated time, in cycles.
+ */
+void sched_run(uint64_t now);
+
+/**
+ * @brief	Current emulated time, as of the last sched_run().
+ */
+uint64_t sched_now(void);
+
+#endif
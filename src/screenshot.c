@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "screenshot.h"
+#include "video.h"
+#include "fbconfig.h"
+
+/// Most screenshots allowed to wait for the writer thread
+#define MAX_QUEUED	16
+
+/// Most screenshot requests allowed to wait for the next 60Hz tick
+#define MAX_PENDING	8
+
+/// A captured screen waiting to be written
+typedef struct job {
+	struct job	*next;
+	char		*filename;
+	bool		reverse;
+	uint8_t		vram[VIDEO_HEIGHT * VIDEO_STRIDE];
+} JOB;
+
+static struct {
+	bool		active;
+	const char	*directory;
+	uint8_t		fg[3];			///< foreground colour, R/G/B
+	uint32_t	frame;			///< current 60Hz tick number
+	uint32_t	at_frame;		///< take one screenshot at this tick (0 = off)
+	uint32_t	interval;		///< take one every this many ticks (0 = off)
+	char		*pending[MAX_PENDING];	///< requests for the next tick
+	int			npending;
+	uint32_t	dropped;
+
+	// Writer thread and its queue
+	SDL_Thread	*thread;
+	SDL_mutex	*lock;
+	SDL_cond	*cond;
+	JOB			*head, *tail;
+	int			queued;
+	bool		stopping;
+} sc;
+
+/// Table for CRC-32 (ISO 3309, as used by PNG)
+static uint32_t crc_table[256];
+/// Bit-reversed bytes, to turn VRAM's LSB-first pixels into PNG's MSB-first
+static uint8_t bitrev[256];
+static bool tables_made = false;
+
+static void make_tables(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+
+		bitrev[n] = 0;
+		for (int b = 0; b < 8; b++)
+			if (n & (1 << b))
+				bitrev[n] |= 0x80 >> b;
+	}
+	tables_made = true;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put32be(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/**
+ * @brief	Write a PNG chunk.
+ * @return	true on success.
+ */
+static bool write_chunk(FILE *fp, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t hdr[8], trailer[4];
+
+	put32be(hdr, len);
+	memcpy(&hdr[4], type, 4);
+	put32be(trailer, crc32_update(crc32_update(0, &hdr[4], 4), data, len));
+
+	return fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+		(len == 0 || fwrite(data, 1, len, fp) == len) &&
+		fwrite(trailer, 1, sizeof(trailer), fp) == sizeof(trailer);
+}
+
+bool screenshot_write_png(const char *filename, const uint8_t *vram, bool reverse)
+{
+	// Each PNG row is a filter type byte (0, none) then 1bpp pixels, MSB first
+	const size_t ROWLEN = 1 + VIDEO_STRIDE;
+	const size_t RAWLEN = VIDEO_HEIGHT * ROWLEN;
+	// The image data goes in uncompressed ("stored") deflate blocks of at most
+	// 65535 bytes, each with a 5-byte header, inside a zlib wrapper.
+	const size_t NBLOCKS = (RAWLEN + 65534) / 65535;
+	const size_t ZLEN = 2 + RAWLEN + NBLOCKS * 5 + 4;
+	uint8_t *raw, *z, *p;
+	uint8_t ihdr[13], plte[6];
+	bool ok;
+
+	if (!tables_made)
+		make_tables();
+
+	raw = malloc(RAWLEN);
+	z = malloc(ZLEN);
+	if (raw == NULL || z == NULL) {
+		free(raw);
+		free(z);
+		return false;
+	}
+
+	// VRAM words are big-endian with the leftmost pixel in the LSB, so each
+	// byte pair is swapped and bit-reversed to get PNG's pixel order.
+	p = raw;
+	for (int y = 0; y < VIDEO_HEIGHT; y++) {
+		const uint8_t *v = &vram[y * VIDEO_STRIDE];
+		*p++ = 0;
+		for (int x = 0; x < VIDEO_STRIDE; x += 2) {
+			*p++ = bitrev[v[x+1]];
+			*p++ = bitrev[v[x]];
+		}
+	}
+
+	// zlib wrapper: deflate, 32K window, no dictionary, check bits
+	p = z;
+	*p++ = 0x78;
+	*p++ = 0x01;
+	uint32_t s1 = 1, s2 = 0;
+	for (size_t i = 0; i < RAWLEN; i++) {
+		s1 = (s1 + raw[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	for (size_t off = 0; off < RAWLEN; off += 65535) {
+		size_t n = RAWLEN - off > 65535 ? 65535 : RAWLEN - off;
+		*p++ = (off + n == RAWLEN) ? 1 : 0;	// BFINAL, BTYPE=00
+		*p++ = n & 0xff;
+		*p++ = n >> 8;
+		*p++ = ~n & 0xff;
+		*p++ = (~n >> 8) & 0xff;
+		memcpy(p, &raw[off], n);
+		p += n;
+	}
+	put32be(p, (s2 << 16) | s1);
+
+	// 1-bit palettised: index 0 is the background (black), 1 the foreground.
+	// Reverse video just swaps the palette entries.
+	put32be(&ihdr[0], VIDEO_WIDTH);
+	put32be(&ihdr[4], VIDEO_HEIGHT);
+	ihdr[8] = 1;		// bit depth
+	ihdr[9] = 3;		// colour type: palette
+	ihdr[10] = 0;		// compression: deflate
+	ihdr[11] = 0;		// filter method
+	ihdr[12] = 0;		// no interlace
+	memset(&plte[reverse ? 3 : 0], 0, 3);
+	memcpy(&plte[reverse ? 0 : 3], sc.fg, 3);
+
+	FILE *fp = fopen(filename, "wb");
+	ok = fp != NULL &&
+		fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp) == 8 &&
+		write_chunk(fp, "IHDR", ihdr, sizeof(ihdr)) &&
+		write_chunk(fp, "PLTE", plte, sizeof(plte)) &&
+		write_chunk(fp, "IDAT", z, ZLEN) &&
+		write_chunk(fp, "IEND", NULL, 0);
+	if (fp != NULL && fclose(fp) != 0)
+		ok = false;
+
+	free(raw);
+	free(z);
+	return ok;
+}
+
+static int screenshot_thread(void *arg)
+{
+	(void)arg;
+
+	SDL_LockMutex(sc.lock);
+	for (;;) {
+		while (sc.head == NULL && !sc.stopping)
+			SDL_CondWait(sc.cond, sc.lock);
+		if (sc.head == NULL)
+			break;
+
+		JOB *j = sc.head;
+		sc.head = j->next;
+		if (sc.head == NULL)
+			sc.tail = NULL;
+		sc.queued--;
+		SDL_UnlockMutex(sc.lock);
+
+		if (screenshot_write_png(j->filename, j->vram, j->reverse))
+			printf("Screenshot saved to '%s'.\n", j->filename);
+		else
+			fprintf(stderr, "screenshot: could not write '%s'\n", j->filename);
+		free(j->filename);
+		free(j);
+
+		SDL_LockMutex(sc.lock);
+	}
+	SDL_UnlockMutex(sc.lock);
+
+	return 0;
+}
+
+void screenshot_init(void)
+{
+	double at_time = fbc_get_double("screenshot", "at_time");
+	double interval = fbc_get_double("screenshot", "interval");
+
+	memset(&sc, 0, sizeof(sc));
+	make_tables();
+	sc.directory = fbc_get_string("screenshot", "directory");
+	sc.fg[0] = fbc_get_int("display", "red");
+	sc.fg[1] = fbc_get_int("display", "green");
+	sc.fg[2] = fbc_get_int("display", "blue");
+	sc.at_frame = at_time > 0 ? (uint32_t)(at_time * 60 + 0.5) : 0;
+	sc.interval = interval > 0 ? (uint32_t)(interval * 60 + 0.5) : 0;
+	if (interval > 0 && sc.interval == 0)
+		sc.interval = 1;
+
+	sc.lock = SDL_CreateMutex();
+	sc.cond = SDL_CreateCond();
+	sc.thread = SDL_CreateThread(screenshot_thread, "screenshot", NULL);
+	if (!sc.lock || !sc.cond || !sc.thread) {
+		fprintf(stderr, "NOTE: could not start screenshot thread (%s); screenshots disabled.\n", SDL_GetError());
+		return;
+	}
+
+	sc.active = true;
+}
+
+void screenshot_request(const char *filename)
+{
+	char *name;
+
+	if (!sc.active)
+		return;
+
+	if (sc.npending >= MAX_PENDING) {
+		sc.dropped++;
+		return;
+	}
+
+	if (filename != NULL) {
+		name = strdup(filename);
+	} else {
+		// Name it after the emulated time it will be taken at, so names are
+		// unique within a run and sort in order.
+		size_t len = strlen(sc.directory) + 32;
+		if ((name = malloc(len)) != NULL)
+			snprintf(name, len, "%s/freebee-%08u.png", sc.directory, sc.frame);
+	}
+
+	if (name != NULL)
+		sc.pending[sc.npending++] = name;
+}
+
+void screenshot_frame(const uint8_t *vram, bool reverse)
+{
+	if (!sc.active)
+		return;
+
+	if ((sc.at_frame && sc.frame == sc.at_frame) ||
+			(sc.interval && sc.frame && (sc.frame % sc.interval) == 0))
+		screenshot_request(NULL);
+
+	for (int i = 0; i < sc.npending; i++) {
+		JOB *j = NULL;
+
+		SDL_LockMutex(sc.lock);
+		if (sc.queued < MAX_QUEUED && (j = malloc(sizeof(JOB))) != NULL) {
+			j->next = NULL;
+			j->filename = sc.pending[i];
+			j->reverse = reverse;
+			memcpy(j->vram, vram, sizeof(j->vram));
+			if (sc.tail)
+				sc.tail->next = j;
+			else
+				sc.head = j;
+			sc.tail = j;
+			sc.queued++;
+			SDL_CondSignal(sc.cond);
+		}
+		SDL_UnlockMutex(sc.lock);
+
+		if (j == NULL) {
+			free(sc.pending[i]);
+			sc.dropped++;
+		}
+	}
+	sc.npending = 0;
+
+	sc.frame++;
+}
+
+void screenshot_done(void)
+{
+	if (!sc.active)
+		return;
+
+	for (int i = 0; i < sc.npending; i++)
+		free(sc.pending[i]);
+	sc.npending = 0;
+
+	// Let the writer finish what's queued and exit
+	SDL_LockMutex(sc.lock);
+	sc.stopping = true;
+	SDL_CondSignal(sc.cond);
+	SDL_UnlockMutex(sc.lock);
+	SDL_WaitThread(sc.thread, NULL);
+
+	SDL_DestroyCond(sc.cond);
+	SDL_DestroyMutex(sc.lock);
+
+	if (sc.dropped)
+		printf("%u screenshot(s) dropped (writer couldn't keep up).\n", sc.dropped);
+
+	sc.active = false;
+}
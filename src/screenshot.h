@@ -0,0 +1,53 @@
+#ifndef _SCREENSHOT_H
+#define _SCREENSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief	Screenshot capture -- saves VRAM as a 1-bit palettised PNG.
+ *
+ * A capture only copies VRAM on the emulation thread. The PNG is encoded
+ * and written by a background thread, so taking one never costs a 60Hz tick.
+ *
+ * Screenshots can be requested from the hotkey (or anything else) with
+ * screenshot_request(), or taken automatically at a given emulated time and
+ * at a regular emulated-time interval, set in the [screenshot] config section.
+ */
+
+/**
+ * @brief	Read the screenshot config and start the writer thread.
+ */
+void screenshot_init(void);
+
+/**
+ * @brief	Write out any screenshots still queued and stop the writer thread.
+ */
+void screenshot_done(void);
+
+/**
+ * @brief	Ask for a screenshot to be taken on the next 60Hz tick.
+ * @param	filename	File to save to, or NULL to generate a name in the
+ *						configured screenshot directory.
+ */
+void screenshot_request(const char *filename);
+
+/**
+ * @brief	Take any screenshots which are due. Call this on every 60Hz tick.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ */
+void screenshot_frame(const uint8_t *vram, bool reverse);
+
+/**
+ * @brief	Encode a screen image as PNG and write it to a file.
+ * @param	filename	File to write.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ * @return	true on success.
+ *
+ * This is the synchronous encoder the writer thread uses.
+ */
+bool screenshot_write_png(const char *filename, const uint8_t *vram, bool reverse);
+
+#endif
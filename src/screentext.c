@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screentext.h"
+#include "video.h"
+#include "vramhash.h"
+#include "fbconfig.h"
+
+/// Glyph table size. Must be a power of two, and comfortably bigger than the
+/// number of glyphs it holds so probe chains stay short.
+#define GLYPH_TABLE_SIZE	2048
+#define MAX_GLYPHS			(GLYPH_TABLE_SIZE / 2)
+
+/// A learned glyph: one row of pixel bits per scanline, leftmost pixel in bit 0
+typedef struct {
+	bool		used;
+	uint8_t		ch;
+	uint8_t		attr;
+	uint16_t	bits[SCREENTEXT_MAX_CELL_HEIGHT];
+} GLYPH;
+
+static struct {
+	int			cw, ch;			///< cell size, pixels
+	int			x0, y0;			///< top left of the grid, pixels
+	int			rows, cols;
+
+	GLYPH		*glyphs;		///< open-addressed on the bitmap hash
+	int			nglyphs;
+	bool		learned;		///< font changed since it was loaded
+	const char	*font_file;
+
+	char		*text;			///< rows * (cols + 1), NUL-terminated rows
+	uint8_t		*attrs;			///< rows * cols
+	uint32_t	generation;
+
+	const uint8_t	*vram;
+	uint32_t	stale[VIDEO_DIRTY_WORDS];	///< scanlines not yet re-matched
+	bool		any_stale;
+} st;
+
+/**
+ * @brief	Read one scanline of a cell as bits, leftmost pixel in bit 0.
+ */
+static uint16_t cell_row_bits(const uint8_t *vram, int x, int y)
+{
+	const uint8_t *line = &vram[y * VIDEO_STRIDE];
+	uint16_t bits = 0;
+
+	for (int i = 0; i < st.cw; i++, x++) {
+		// Big-endian words, leftmost pixel in the LSB: pixels 0-7 of a word
+		// are in its second byte, 8-15 in its first.
+		int b = x & 15;
+		uint8_t byte = line[(x >> 4) * 2 + (b < 8 ? 1 : 0)];
+		bits |= ((byte >> (b & 7)) & 1) << i;
+	}
+
+	return bits;
+}
+
+static void cell_bits(const uint8_t *vram, int row, int col, uint16_t *bits)
+{
+	int x = st.x0 + col * st.cw;
+	int y = st.y0 + row * st.ch;
+
+	for (int i = 0; i < st.ch; i++)
+		bits[i] = cell_row_bits(vram, x, y + i);
+}
+
+static uint32_t glyph_hash(const uint16_t *bits)
+{
+	return xxh64(bits, st.ch * sizeof(uint16_t), 0) & (GLYPH_TABLE_SIZE - 1);
+}
+
+/**
+ * @brief	Find the table slot for a bitmap.
+ * @return	The glyph's slot if it's known, otherwise the free slot it would go in.
+ */
+static GLYPH *glyph_slot(const uint16_t *bits)
+{
+	uint32_t h = glyph_hash(bits);
+
+	for (;;) {
+		GLYPH *g = &st.glyphs[h];
+		if (!g->used || memcmp(g->bits, bits, st.ch * sizeof(uint16_t)) == 0)
+			return g;
+		h = (h + 1) & (GLYPH_TABLE_SIZE - 1);
+	}
+}
+
+static bool glyph_add(const uint16_t *bits, uint8_t ch, uint8_t attr)
+{
+	GLYPH *g = glyph_slot(bits);
+
+	if (g->used || st.nglyphs >= MAX_GLYPHS)
+		return false;
+
+	g->used = true;
+	g->ch = ch;
+	g->attr = attr;
+	memset(g->bits, 0, sizeof(g->bits));
+	memcpy(g->bits, bits, st.ch * sizeof(uint16_t));
+	st.nglyphs++;
+	return true;
+}
+
+/**
+ * @brief	Work out which character a cell holds.
+ */
+static void match_cell(const uint16_t *bits, char *ch, uint8_t *attr)
+{
+	const uint16_t mask = (1u << st.cw) - 1;
+	uint16_t inv[SCREENTEXT_MAX_CELL_HEIGHT];
+	bool blank = true, solid = true;
+	GLYPH *g;
+
+	for (int i = 0; i < st.ch; i++) {
+		inv[i] = ~bits[i] & mask;
+		blank = blank && bits[i] == 0;
+		solid = solid && bits[i] == mask;
+	}
+
+	if (blank || solid) {
+		*ch = ' ';
+		*attr = solid ? SCREENTEXT_ATTR_REVERSE : 0;
+	} else if ((g = glyph_slot(bits))->used) {
+		*ch = g->ch;
+		*attr = g->attr;
+	} else if ((g = glyph_slot(inv))->used) {
+		*ch = g->ch;
+		*attr = g->attr ^ SCREENTEXT_ATTR_REVERSE;
+	} else {
+		*ch = SCREENTEXT_UNKNOWN;
+		*attr = 0;
+	}
+}
+
+/**
+ * @brief	Re-match every cell row which has a changed scanline.
+ */
+static void sync(void)
+{
+	uint16_t bits[SCREENTEXT_MAX_CELL_HEIGHT];
+
+	if (!st.any_stale || st.vram == NULL)
+		return;
+
+	for (int row = 0; row < st.rows; row++) {
+		bool stale = false;
+		for (int y = st.y0 + row * st.ch; y < st.y0 + (row + 1) * st.ch && !stale; y++)
+			stale = video_line_dirty(st.stale, y);
+		if (!stale)
+			continue;
+
+		for (int col = 0; col < st.cols; col++) {
+			char *ch = &st.text[row * (st.cols + 1) + col];
+			uint8_t *attr = &st.attrs[row * st.cols + col];
+			char nch;
+			uint8_t nattr;
+
+			cell_bits(st.vram, row, col, bits);
+			match_cell(bits, &nch, &nattr);
+			if (nch != *ch || nattr != *attr) {
+				*ch = nch;
+				*attr = nattr;
+				st.generation++;
+			}
+		}
+	}
+
+	memset(st.stale, 0, sizeof(st.stale));
+	st.any_stale = false;
+}
+
+/**
+ * @brief	Mark every cell for re-matching, e.g. after learning new glyphs.
+ */
+static void mark_all_stale(void)
+{
+	memset(st.stale, 0xff, sizeof(st.stale));
+	st.any_stale = true;
+}
+
+/********************
+ * Font files
+ *
+ * Text, one glyph per line:
+ *		<character code, hex> <attributes, hex> <row bits, hex> ...
+ * after a first line giving the cell size:
+ *		cell <width> <height>
+ * Lines starting with '#' are comments.
+ ********************/
+
+static bool load_font(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	char line[1024];
+	int w, h, lineno = 0;
+
+	if (fp == NULL)
+		return false;
+
+	if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "cell %d %d", &w, &h) != 2 ||
+			w != st.cw || h != st.ch) {
+		fprintf(stderr, "NOTE: font '%s' is not for %dx%d cells; ignored.\n", filename, st.cw, st.ch);
+		fclose(fp);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint16_t bits[SCREENTEXT_MAX_CELL_HEIGHT];
+		unsigned ch, attr;
+		char *p = line, *end;
+		int i;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		ch = strtoul(p, &end, 16);
+		attr = strtoul(end, &end, 16);
+		for (i = 0; i < st.ch; i++) {
+			p = end;
+			bits[i] = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+		}
+		if (i < st.ch || ch > 0xff) {
+			fprintf(stderr, "NOTE: font '%s' line %d is malformed; skipped.\n", filename, lineno + 1);
+			continue;
+		}
+		glyph_add(bits, ch, attr);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+bool screentext_save(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+
+	if (fp == NULL)
+		return false;
+
+	fprintf(fp, "cell %d %d\n", st.cw, st.ch);
+	fprintf(fp, "# char attr rows... -- freebee screen font, %d glyphs\n", st.nglyphs);
+	for (int i = 0; i < GLYPH_TABLE_SIZE; i++) {
+		GLYPH *g = &st.glyphs[i];
+		if (!g->used)
+			continue;
+		fprintf(fp, "%02x %x", g->ch, g->attr);
+		for (int j = 0; j < st.ch; j++)
+			fprintf(fp, " %x", g->bits[j]);
+		fprintf(fp, "\n");
+	}
+
+	return fclose(fp) == 0;
+}
+
+/********************
+ * Public interface
+ ********************/
+
+void screentext_init(void)
+{
+	memset(&st, 0, sizeof(st));
+	st.cw = fbc_get_int("screentext", "cell_width");
+	st.ch = fbc_get_int("screentext", "cell_height");
+	st.x0 = fbc_get_int("screentext", "x_origin");
+	st.y0 = fbc_get_int("screentext", "y_origin");
+	st.font_file = fbc_get_string("screentext", "font");
+
+	if (st.cw < 1 || st.cw > SCREENTEXT_MAX_CELL_WIDTH || st.ch < 1 || st.ch > SCREENTEXT_MAX_CELL_HEIGHT ||
+			st.x0 < 0 || st.y0 < 0 || st.x0 + st.cw > VIDEO_WIDTH || st.y0 + st.ch > VIDEO_HEIGHT) {
+		fprintf(stderr, "NOTE: bad screentext cell geometry; using 9x12 at 0,0.\n");
+		st.cw = 9;
+		st.ch = 12;
+		st.x0 = st.y0 = 0;
+	}
+	st.cols = (VIDEO_WIDTH - st.x0) / st.cw;
+	st.rows = (VIDEO_HEIGHT - st.y0) / st.ch;
+
+	st.glyphs = calloc(GLYPH_TABLE_SIZE, sizeof(GLYPH));
+	st.text = malloc(st.rows * (st.cols + 1));
+	st.attrs = calloc(st.rows * st.cols, 1);
+	if (st.glyphs == NULL || st.text == NULL || st.attrs == NULL) {
+		fprintf(stderr, "ERROR: out of memory setting up screen text extraction.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int row = 0; row < st.rows; row++) {
+		memset(&st.text[row * (st.cols + 1)], ' ', st.cols);
+		st.text[row * (st.cols + 1) + st.cols] = '\0';
+	}
+
+	if (st.font_file != NULL && st.font_file[0] != '\0' && load_font(st.font_file))
+		printf("Screen font '%s' loaded: %d glyphs.\n", st.font_file, st.nglyphs);
+}
+
+void screentext_done(void)
+{
+	if (st.learned && st.font_file != NULL && st.font_file[0] != '\0') {
+		if (screentext_save(st.font_file))
+			printf("Screen font saved to '%s' (%d glyphs).\n", st.font_file, st.nglyphs);
+		else
+			fprintf(stderr, "NOTE: could not save screen font to '%s'.\n", st.font_file);
+	}
+
+	free(st.glyphs);
+	free(st.text);
+	free(st.attrs);
+	memset(&st, 0, sizeof(st));
+}
+
+void screentext_frame(const uint8_t *vram, const uint32_t *dirty)
+{
+	if (st.vram != vram) {
+		st.vram = vram;
+		mark_all_stale();
+	}
+
+	for (int w = 0; w < VIDEO_DIRTY_WORDS; w++) {
+		st.stale[w] |= dirty[w];
+		if (dirty[w])
+			st.any_stale = true;
+	}
+}
+
+int screentext_rows(void)
+{
+	return st.rows;
+}
+
+int screentext_cols(void)
+{
+	return st.cols;
+}
+
+void screentext_row_lines(int row, int *first, int *count)
+{
+	*first = st.y0 + row * st.ch;
+	*count = st.ch;
+}
+
+const char *screentext_row(int row)
+{
+	if (row < 0 || row >= st.rows)
+		return NULL;
+	sync();
+	return &st.text[row * (st.cols + 1)];
+}
+
+const uint8_t *screentext_attrs(int row)
+{
+	if (row < 0 || row >= st.rows)
+		return NULL;
+	sync();
+	return &st.attrs[row * st.cols];
+}
+
+uint32_t screentext_generation(void)
+{
+	sync();
+	return st.generation;
+}
+
+bool screentext_find(const char *s, int *row, int *col)
+{
+	sync();
+	for (int r = 0; r < st.rows; r++) {
+		const char *p = strstr(&st.text[r * (st.cols + 1)], s);
+		if (p != NULL) {
+			if (row != NULL)
+				*row = r;
+			if (col != NULL)
+				*col = p - &st.text[r * (st.cols + 1)];
+			return true;
+		}
+	}
+	return false;
+}
+
+int screentext_learn(const uint8_t *vram, int row, int col, const char *text, uint8_t attr)
+{
+	uint16_t bits[SCREENTEXT_MAX_CELL_HEIGHT];
+	int learned = 0;
+
+	if (row < 0 || row >= st.rows || col < 0 || col + (int)strlen(text) > st.cols)
+		return -1;
+
+	for (; *text; text++, col++) {
+		if (*text == ' ')
+			continue;
+		cell_bits(vram, row, col, bits);
+		if (glyph_add(bits, *text, attr))
+			learned++;
+	}
+
+	if (learned) {
+		st.learned = true;
+		mark_all_stale();
+	}
+	return learned;
+}
+
+void screentext_dump(FILE *fp)
+{
+	sync();
+	for (int r = 0; r < st.rows; r++)
+		fprintf(fp, "%s\n", &st.text[r * (st.cols + 1)]);
+}
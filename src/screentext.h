@@ -0,0 +1,125 @@
+#ifndef _SCREENTEXT_H
+#define _SCREENTEXT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief	Screen text extraction.
+ *
+ * Reads the text on screen by matching fixed-size character cells in VRAM
+ * against a table of known glyph bitmaps -- exact matches only, no OCR. The
+ * glyph table (the "font") is learned from a screen whose text is known, and
+ * can be saved to and loaded from a file.
+ *
+ * The text grid is cached. Each 60Hz tick only notes which scanlines were
+ * written; cells on those scanlines are re-matched the next time anyone asks
+ * for the text, so reading the screen costs nothing while it isn't changing.
+ *
+ * A cell which is the inverse of a known glyph reads as that character with
+ * SCREENTEXT_ATTR_REVERSE toggled. Blank and solid cells always read as a
+ * space. Cells matching nothing read as SCREENTEXT_UNKNOWN.
+ */
+
+/// Character returned for a cell which matches no known glyph
+#define SCREENTEXT_UNKNOWN		0x1A
+
+/// Cell attributes
+#define SCREENTEXT_ATTR_REVERSE		0x01	///< inverse video
+#define SCREENTEXT_ATTR_UNDERLINE	0x02	///< underlined (as learned)
+#define SCREENTEXT_ATTR_BOLD		0x04	///< bold (as learned)
+
+/// Largest supported character cell
+#define SCREENTEXT_MAX_CELL_WIDTH	16
+#define SCREENTEXT_MAX_CELL_HEIGHT	32
+
+/**
+ * @brief	Set up the cell grid from the config and load the font file.
+ */
+void screentext_init(void);
+
+/**
+ * @brief	Save the font if new glyphs were learned, and free everything.
+ */
+void screentext_done(void);
+
+/**
+ * @brief	Note which scanlines changed. Call this on every 60Hz tick.
+ * @param	vram	Video RAM contents. Must stay valid; it's read later.
+ * @param	dirty	Scanlines written since the last tick (VIDEO_DIRTY_WORDS).
+ */
+void screentext_frame(const uint8_t *vram, const uint32_t *dirty);
+
+/**
+ * @brief	Get the size of the text grid.
+ */
+int screentext_rows(void);
+int screentext_cols(void);
+
+/**
+ * @brief	Get the scanlines a text row covers.
+ * @param	row		Row number.
+ * @param	first	Receives the first scanline.
+ * @param	count	Receives the number of scanlines.
+ */
+void screentext_row_lines(int row, int *first, int *count);
+
+/**
+ * @brief	Get the text of one row of the screen.
+ * @param	row		Row number, from 0 at the top.
+ * @return	NUL-terminated row text, screentext_cols() characters long, or
+ *			NULL if the row is out of range. Valid until the next call to
+ *			any screentext function.
+ */
+const char *screentext_row(int row);
+
+/**
+ * @brief	Get the attributes of one row of the screen.
+ * @return	screentext_cols() SCREENTEXT_ATTR_xxx values, or NULL.
+ */
+const uint8_t *screentext_attrs(int row);
+
+/**
+ * @brief	Count of text changes so far.
+ *
+ * Goes up whenever re-matching changes any cell. Cheap to poll; matching
+ * happens here if scanlines have changed since the last call.
+ */
+uint32_t screentext_generation(void);
+
+/**
+ * @brief	Search the screen for a string.
+ * @param	s		String to look for. Matches don't span rows.
+ * @param	row		Receives the row of the first match, if not NULL.
+ * @param	col		Receives the column of the first match, if not NULL.
+ * @return	true if found.
+ */
+bool screentext_find(const char *s, int *row, int *col);
+
+/**
+ * @brief	Learn glyphs from text known to be on screen.
+ * @param	vram	Video RAM contents.
+ * @param	row		Row the text starts on.
+ * @param	col		Column the text starts at.
+ * @param	text	The text. Spaces are skipped.
+ * @param	attr	SCREENTEXT_ATTR_xxx the text is drawn with.
+ * @return	Number of new glyphs learned, or -1 if the text doesn't fit on
+ *			the screen.
+ *
+ * A bitmap which is already known keeps its first meaning.
+ */
+int screentext_learn(const uint8_t *vram, int row, int col, const char *text, uint8_t attr);
+
+/**
+ * @brief	Write the font to a file.
+ * @return	true on success.
+ */
+bool screentext_save(const char *filename);
+
+/**
+ * @brief	Print the whole text grid, one row per line.
+ */
+void screentext_dump(FILE *fp);
+
+#endif
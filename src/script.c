@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL.h"
+
+#include "script.h"
+#include "video.h"
+#include "vramhash.h"
+#include "screentext.h"
+#include "screenshot.h"
+#include "fbconfig.h"
+
+/// What a script is blocked on
+typedef enum {
+	WAIT_NONE,
+	WAIT_SLEEP,			///< until the deadline
+	WAIT_TEXT,			///< until text is (or isn't) on screen
+	WAIT_HASH,			///< until a region hashes (or doesn't) to a value
+	WAIT_TYPE			///< until everything has been typed
+} SCRIPT_WAIT;
+
+struct script {
+	FILE		*out;
+	char		*name;
+
+	char		**lines;
+	int			nlines, maxlines;
+	int			pc;				///< next line to run
+
+	bool		can_exit;		///< quit and timeouts exit the emulator
+	const char	*error;			///< why the script stopped, or NULL
+
+	uint32_t	frame;			///< 60Hz ticks since the script started
+
+	// Current wait
+	SCRIPT_WAIT	wait;
+	int			wait_line;		///< line number the wait is on, for messages
+	uint32_t	deadline;		///< frame the wait times out on
+	bool		negate;			///< wait for the match to go away
+	bool		check;			///< region has changed; look at it again
+	uint32_t	dirty[VIDEO_DIRTY_WORDS];	///< scanlines written during the wait
+	int			y0, y1;			///< scanlines the wait is interested in
+	int			x, w;			///< WAIT_HASH: pixel columns
+	uint64_t	hash;			///< WAIT_HASH: hash to wait for
+	int			row0, row1;		///< WAIT_TEXT: text rows to search
+	char		*text;			///< WAIT_TEXT: text, WAIT_TYPE: what's left to type
+	const char	*typep;
+	int			type_phase;		///< WAIT_TYPE: step within the current character
+};
+
+static bool exit_requested = false;
+static int exit_status = 0;
+
+/// Default wait timeout, in seconds of emulated time
+static double default_timeout = 0;
+
+/// The script named in the config
+static SCRIPT *config_script = NULL;
+
+static uint32_t secs_to_frames(double secs)
+{
+	return secs <= 0 ? 0 : (uint32_t)(secs * 60 + 0.5);
+}
+
+SCRIPT *script_new(FILE *out, const char *name)
+{
+	SCRIPT *s = calloc(1, sizeof(SCRIPT));
+
+	if (s == NULL)
+		return NULL;
+	s->out = out;
+	s->name = strdup(name);
+	if (default_timeout <= 0)
+		default_timeout = fbc_get_double("script", "timeout");
+	return s;
+}
+
+void script_add(SCRIPT *s, const char *line)
+{
+	if (s->nlines == s->maxlines) {
+		int n = s->maxlines ? s->maxlines * 2 : 64;
+		char **p = realloc(s->lines, n * sizeof(char *));
+		if (p == NULL)
+			return;
+		s->lines = p;
+		s->maxlines = n;
+	}
+	s->lines[s->nlines++] = strdup(line);
+}
+
+SCRIPT *script_load(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	char line[1024];
+	SCRIPT *s;
+
+	if (fp == NULL)
+		return NULL;
+	if ((s = script_new(stdout, filename)) == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		script_add(s, line);
+	}
+	fclose(fp);
+	return s;
+}
+
+bool script_finished(SCRIPT *s)
+{
+	return s->wait == WAIT_NONE && s->pc >= s->nlines;
+}
+
+void script_free(SCRIPT *s)
+{
+	if (s == NULL)
+		return;
+	for (int i = 0; i < s->nlines; i++)
+		free(s->lines[i]);
+	free(s->lines);
+	free(s->text);
+	free(s->name);
+	free(s);
+}
+
+const char *script_error(SCRIPT *s)
+{
+	const char *error = s->error;
+
+	s->error = NULL;
+	return error;
+}
+
+bool script_exit_requested(int *status)
+{
+	if (status != NULL)
+		*status = exit_status;
+	return exit_requested;
+}
+
+int script_split(char *p, char **argv)
+{
+	int argc = 0;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0' || *p == '#' || argc == SCRIPT_MAX_ARGS)
+			break;
+
+		if (*p == '"') {
+			char *d = ++p;
+			argv[argc++] = d;
+			while (*p != '"') {
+				if (*p == '\0')
+					return -1;
+				if (*p == '\\' && p[1] != '\0') {
+					p++;
+					switch (*p) {
+						case 'n':	*d++ = '\n';	break;
+						case 't':	*d++ = '\t';	break;
+						case 'e':	*d++ = 0x1b;	break;
+						default:	*d++ = *p;		break;
+					}
+					p++;
+				} else {
+					*d++ = *p++;
+				}
+			}
+			p++;
+			*d = '\0';
+		} else {
+			argv[argc++] = p;
+			while (*p != '\0' && *p != ' ' && *p != '\t')
+				p++;
+			if (*p != '\0')
+				*p++ = '\0';
+		}
+	}
+
+	return argc;
+}
+
+/**
+ * @brief	Hash a rectangle of the screen.
+ *
+ * The pixels are packed a scanline at a time, leftmost first, so the hash
+ * doesn't depend on how the rectangle lines up with VRAM words.
+ */
+static uint64_t region_hash(const uint8_t *vram, int x, int y, int w, int h)
+{
+	uint8_t buf[VIDEO_HEIGHT * VIDEO_STRIDE];
+	int rowbytes = (w + 7) / 8;
+
+	memset(buf, 0, rowbytes * h);
+	for (int j = 0; j < h; j++) {
+		const uint8_t *line = &vram[(y + j) * VIDEO_STRIDE];
+		for (int i = 0; i < w; i++) {
+			int px = x + i, b = px & 15;
+			if ((line[(px >> 4) * 2 + (b < 8 ? 1 : 0)] >> (b & 7)) & 1)
+				buf[j * rowbytes + i / 8] |= 1 << (i & 7);
+		}
+	}
+
+	return xxh64(buf, rowbytes * h, 0);
+}
+
+static bool parse_rect(char **argv, int *x, int *y, int *w, int *h)
+{
+	*x = atoi(argv[0]);
+	*y = atoi(argv[1]);
+	*w = atoi(argv[2]);
+	*h = atoi(argv[3]);
+	return *x >= 0 && *y >= 0 && *w > 0 && *h > 0 && *x + *w <= VIDEO_WIDTH && *y + *h <= VIDEO_HEIGHT;
+}
+
+/**
+ * @brief	Check whether the current wait is satisfied.
+ */
+static bool wait_satisfied(SCRIPT *s, const uint8_t *vram)
+{
+	bool match = false;
+
+	switch (s->wait) {
+		case WAIT_HASH:
+			match = region_hash(vram, s->x, s->y0, s->w, s->y1 - s->y0) == s->hash;
+			break;
+		case WAIT_TEXT:
+			for (int r = s->row0; r <= s->row1 && !match; r++)
+				match = strstr(screentext_row(r), s->text) != NULL;
+			break;
+		default:
+			break;
+	}
+
+	return match != s->negate;
+}
+
+/**
+ * @brief	Feed the next part of a "type" command to the keyboard.
+ * @return	true once everything has been typed.
+ */
+static bool type_more(SCRIPT *s, KEYBOARD_STATE *kbd)
+{
+	while (*s->typep != '\0') {
+		SDL_Keycode key;
+		bool shift;
+
+		if (!keyboard_char_to_key((unsigned char)*s->typep, &key, &shift)) {
+			fprintf(s->out, "%s:%d: can't type character 0x%02x; skipped\n",
+					s->name, s->wait_line, (unsigned char)*s->typep);
+			s->typep++;
+			continue;
+		}
+
+		// Shift down, key down, key up, shift up -- one step at a time, so
+		// a full queue just picks up where it left off on the next tick.
+		for (; s->type_phase < 4; s->type_phase++) {
+			bool ok = true;
+			switch (s->type_phase) {
+				case 0: if (shift) ok = keyboard_inject(kbd, SDLK_LSHIFT, 0, true); break;
+				case 1: ok = keyboard_inject(kbd, key, 0, true); break;
+				case 2: ok = keyboard_inject(kbd, key, 0, false); break;
+				case 3: if (shift) ok = keyboard_inject(kbd, SDLK_LSHIFT, 0, false); break;
+			}
+			if (!ok)
+				return false;
+		}
+		s->type_phase = 0;
+		s->typep++;
+	}
+
+	return true;
+}
+
+/**
+ * @brief	Parse "timeout SECS" from the end of a wait command.
+ * @return	false if the arguments are malformed.
+ */
+static bool parse_timeout(SCRIPT *s, int argc, char **argv, int first)
+{
+	double timeout = default_timeout;
+
+	if (argc == first + 2 && strcmp(argv[first], "timeout") == 0)
+		timeout = atof(argv[first + 1]);
+	else if (argc != first)
+		return false;
+
+	s->deadline = timeout > 0 ? s->frame + secs_to_frames(timeout) : 0;
+	return true;
+}
+
+/**
+ * @brief	Run one command.
+ * @return	false on a syntax error.
+ */
+static bool run_command(SCRIPT *s, KEYBOARD_STATE *kbd, const uint8_t *vram, int argc, char **argv)
+{
+	const char *cmd = argv[0];
+	int x, y, w, h;
+
+	if (strcmp(cmd, "wait") == 0) {
+		int a = 1;
+
+		s->negate = argc > a && strcmp(argv[a], "gone") == 0;
+		if (s->negate)
+			a++;
+		if (argc <= a)
+			return false;
+
+		if (strcmp(argv[a], "text") == 0 && argc > a + 1) {
+			free(s->text);
+			s->text = strdup(argv[a + 1]);
+			s->row0 = 0;
+			s->row1 = screentext_rows() - 1;
+			a += 2;
+			if (argc >= a + 3 && strcmp(argv[a], "rows") == 0) {
+				s->row0 = atoi(argv[a + 1]);
+				s->row1 = atoi(argv[a + 2]);
+				if (s->row0 < 0 || s->row1 >= screentext_rows() || s->row0 > s->row1)
+					return false;
+				a += 3;
+			}
+			int first, count;
+			screentext_row_lines(s->row0, &first, &count);
+			s->y0 = first;
+			screentext_row_lines(s->row1, &first, &count);
+			s->y1 = first + count;
+			s->wait = WAIT_TEXT;
+		} else if (strcmp(argv[a], "hash") == 0 && argc >= a + 6) {
+			if (!parse_rect(&argv[a + 1], &x, &y, &w, &h))
+				return false;
+			s->x = x;
+			s->w = w;
+			s->y0 = y;
+			s->y1 = y + h;
+			s->hash = strtoull(argv[a + 5], NULL, 16);
+			s->wait = WAIT_HASH;
+			a += 6;
+		} else {
+			return false;
+		}
+
+		if (!parse_timeout(s, argc, argv, a)) {
+			s->wait = WAIT_NONE;
+			return false;
+		}
+		memset(s->dirty, 0, sizeof(s->dirty));
+		s->check = true;
+	} else if (strcmp(cmd, "hash") == 0 && argc == 5) {
+		if (!parse_rect(&argv[1], &x, &y, &w, &h))
+			return false;
+		fprintf(s->out, "%016llx\n", (unsigned long long)region_hash(vram, x, y, w, h));
+	} else if (strcmp(cmd, "type") == 0 && argc == 2) {
+		free(s->text);
+		s->text = strdup(argv[1]);
+		s->typep = s->text;
+		s->type_phase = 0;
+		s->deadline = 0;
+		s->wait = WAIT_TYPE;
+	} else if (strcmp(cmd, "sleep") == 0 && argc == 2) {
+		s->deadline = s->frame + secs_to_frames(atof(argv[1]));
+		s->wait = WAIT_SLEEP;
+	} else if (strcmp(cmd, "screenshot") == 0 && argc <= 2) {
+		screenshot_request(argc == 2 ? argv[1] : NULL);
+	} else if (strcmp(cmd, "learn") == 0 && (argc == 4 || argc == 5)) {
+		int n = screentext_learn(vram, atoi(argv[1]), atoi(argv[2]), argv[3],
+				argc == 5 ? strtoul(argv[4], NULL, 16) : 0);
+		if (n < 0)
+			return false;
+		fprintf(s->out, "learned %d new glyphs\n", n);
+	} else if (strcmp(cmd, "print") == 0 && argc == 1) {
+		screentext_dump(s->out);
+	} else if (strcmp(cmd, "echo") == 0 && argc == 2) {
+		fprintf(s->out, "%s\n", argv[1]);
+	} else if (strcmp(cmd, "quit") == 0 && argc <= 2 && s->can_exit) {
+		exit_status = argc == 2 ? atoi(argv[1]) : 0;
+		exit_requested = true;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+void script_run(SCRIPT *s, KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty)
+{
+	char buf[1024];
+	char *argv[SCRIPT_MAX_ARGS];
+
+	for (int i = 0; i < VIDEO_DIRTY_WORDS; i++)
+		s->dirty[i] |= dirty[i];
+
+	while (!exit_requested) {
+		// Blocked on something?
+		if (s->wait != WAIT_NONE) {
+			bool done = false;
+
+			if (s->wait == WAIT_TYPE) {
+				done = type_more(s, kbd);
+			} else if (s->wait == WAIT_SLEEP) {
+				done = s->frame >= s->deadline;
+			} else {
+				// Only look at the screen if the region has been written to
+				for (int y = s->y0; y < s->y1 && !s->check; y++)
+					s->check = video_line_dirty(s->dirty, y);
+				if (s->check) {
+					done = wait_satisfied(s, vram);
+					s->check = false;
+				}
+				memset(s->dirty, 0, sizeof(s->dirty));
+
+				if (!done && s->deadline && s->frame >= s->deadline) {
+					fprintf(s->out, "%s:%d: timed out\n", s->name, s->wait_line);
+					s->wait = WAIT_NONE;
+					s->pc = s->nlines;
+					s->error = "timed out";
+					if (s->can_exit) {
+						exit_status = 1;
+						exit_requested = true;
+					}
+					break;
+				}
+			}
+
+			if (!done)
+				break;
+			s->wait = WAIT_NONE;
+		}
+
+		if (s->pc >= s->nlines)
+			break;
+
+		// Run the next command
+		s->wait_line = s->pc + 1;
+		snprintf(buf, sizeof(buf), "%s", s->lines[s->pc++]);
+		int argc = script_split(buf, argv);
+		if (argc == 0)
+			continue;
+		if (argc < 0 || !run_command(s, kbd, vram, argc, argv)) {
+			fprintf(s->out, "%s:%d: bad command '%s'\n", s->name, s->wait_line, s->lines[s->pc - 1]);
+			s->error = "bad command";
+		}
+	}
+
+	s->frame++;
+	fflush(s->out);
+}
+
+void script_init(void)
+{
+	const char *filename = fbc_get_string("script", "file");
+
+	if (filename == NULL || filename[0] == '\0')
+		return;
+
+	if ((config_script = script_load(filename)) == NULL) {
+		fprintf(stderr, "NOTE: could not read script '%s'; not running it.\n", filename);
+	} else {
+		// Only the configured script decides when the emulator exits
+		config_script->can_exit = true;
+		printf("Running script '%s'.\n", filename);
+	}
+}
+
+void script_frame(KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty)
+{
+	if (config_script != NULL)
+		script_run(config_script, kbd, vram, dirty);
+}
+
+void script_done(void)
+{
+	script_free(config_script);
+	config_script = NULL;
+}
@@ -0,0 +1,128 @@
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "keyboard.h"
+
+/**
+ * @brief	Automation scripts, driven by what's on screen rather than by
+ *			wall-clock sleeps.
+ *
+ * A script is a list of commands, one per line ('#' starts a comment).
+ * Arguments with spaces go in double quotes, which understand \n, \t, \e
+ * (Escape), \" and \\. Times are seconds of emulated time.
+ *
+ *	wait text "STRING" [rows FIRST LAST] [timeout SECS]
+ *		Wait until STRING is on screen (in the given text rows, if set).
+ *	wait hash X Y W H HASH [timeout SECS]
+ *		Wait until the pixel rectangle hashes to HASH (see "hash").
+ *	wait gone text ... | wait gone hash ...
+ *		Wait until the text or region match goes away.
+ *	hash X Y W H
+ *		Print the current hash of a pixel rectangle.
+ *	type "STRING"
+ *		Type STRING on the keyboard (US layout); waits until it's all sent.
+ *	sleep SECS
+ *		Let the emulator run for SECS.
+ *	screenshot [FILE]
+ *		Save a screenshot.
+ *	learn ROW COL "STRING" [ATTR]
+ *		Teach screen text extraction the glyphs of STRING, which is on
+ *		screen at ROW, COL.
+ *	print
+ *		Print the screen as text.
+ *	echo "MESSAGE"
+ *		Print MESSAGE.
+ *	quit [STATUS]
+ *		Exit the emulator with STATUS (default 0). Only in the [script]
+ *		file script.
+ *
+ * A wait only looks at the screen when scanlines in its region have been
+ * written, so a waiting script costs almost nothing. A wait which times out
+ * stops the script; in the [script] file script it also exits the emulator
+ * with status 1.
+ */
+
+/// Most words a command line can have
+#define SCRIPT_MAX_ARGS	12
+
+/// Opaque script state
+typedef struct script SCRIPT;
+
+/**
+ * @brief	Create an empty script.
+ * @param	out		Where the script's output goes.
+ * @param	name	Name to use in messages.
+ */
+SCRIPT *script_new(FILE *out, const char *name);
+
+/**
+ * @brief	Load a script from a file.
+ * @return	The script, or NULL if the file can't be read.
+ */
+SCRIPT *script_load(const char *filename);
+
+/**
+ * @brief	Add a command line to the end of a script.
+ */
+void script_add(SCRIPT *s, const char *line);
+
+/**
+ * @brief	Split a command line into words, in place, as scripts do.
+ * @param	line	Command line; it's overwritten.
+ * @param	argv	Receives up to SCRIPT_MAX_ARGS words.
+ * @return	Number of words, or -1 for an unterminated string.
+ */
+int script_split(char *line, char **argv);
+
+/**
+ * @brief	Check whether a script has run every command it has.
+ */
+bool script_finished(SCRIPT *s);
+
+/**
+ * @brief	Free a script.
+ */
+void script_free(SCRIPT *s);
+
+/**
+ * @brief	Run a script for one 60Hz tick.
+ * @param	s		Script.
+ * @param	kbd		Keyboard to type on.
+ * @param	vram	Video RAM contents.
+ * @param	dirty	Scanlines written since the last tick (VIDEO_DIRTY_WORDS).
+ *
+ * Runs commands until one has to wait, or the script runs out.
+ */
+void script_run(SCRIPT *s, KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty);
+
+/**
+ * @brief	Find out why a script stopped or failed, and forget it.
+ * @return	"timed out", "bad command", or NULL if nothing went wrong.
+ */
+const char *script_error(SCRIPT *s);
+
+/**
+ * @brief	Check whether a script has asked the emulator to exit.
+ * @param	status	Receives the exit status, if not NULL.
+ */
+bool script_exit_requested(int *status);
+
+/**
+ * @brief	Load the script named in [script] file, if any.
+ */
+void script_init(void);
+
+/**
+ * @brief	Run the configured script. Call this on every 60Hz tick.
+ */
+void script_frame(KEYBOARD_STATE *kbd, const uint8_t *vram, const uint32_t *dirty);
+
+/**
+ * @brief	Free the configured script.
+ */
+void script_done(void);
+
+#endif
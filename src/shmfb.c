@@ -0,0 +1,176 @@
+#ifdef __linux__
+// needed for memfd_create
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "shmfb.h"
+#include "fbconfig.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct {
+	bool			active;
+	uint8_t			*base;			///< mapped segment
+	size_t			size;
+	SHMFB_HEADER	*hdr;
+	uint8_t			*pixels;
+	char			*name;			///< shm object to unlink at exit, or NULL
+	int				fd;				///< memfd, kept open so readers can find it
+	uint64_t		frame;
+	bool			first;			///< nothing published yet
+} shm;
+
+void shmfb_init(void)
+{
+	const char *name = fbc_get_string("shmfb", "name");
+	int fd;
+
+	memset(&shm, 0, sizeof(shm));
+	shm.fd = -1;
+	if (name == NULL || name[0] == '\0')
+		return;
+
+	shm.size = sizeof(SHMFB_HEADER) + VIDEO_HEIGHT * VIDEO_STRIDE;
+
+	if (strcmp(name, "memfd") == 0) {
+#ifdef __linux__
+		// Anonymous; readers open /proc/<pid>/fd/<fd>
+		fd = memfd_create("freebee-fb", MFD_CLOEXEC);
+#else
+		errno = ENOTSUP;
+		fd = -1;
+#endif
+	} else {
+		// shm_open() wants exactly one leading slash
+		size_t len = strlen(name) + 2;
+		if ((shm.name = malloc(len)) == NULL)
+			return;
+		snprintf(shm.name, len, "/%s", name[0] == '/' ? name + 1 : name);
+		fd = shm_open(shm.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (fd < 0 || ftruncate(fd, shm.size) < 0 ||
+			(shm.base = mmap(NULL, shm.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "NOTE: could not create shared framebuffer '%s' (%s); not exporting the screen.\n",
+				name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		if (shm.name != NULL) {
+			shm_unlink(shm.name);
+			free(shm.name);
+			shm.name = NULL;
+		}
+		shm.base = NULL;
+		return;
+	}
+
+	shm.hdr = (SHMFB_HEADER *)shm.base;
+	shm.pixels = shm.base + sizeof(SHMFB_HEADER);
+	memset(shm.base, 0, shm.size);
+	memcpy(shm.hdr->magic, SHMFB_MAGIC, sizeof(SHMFB_MAGIC));
+	shm.hdr->version = SHMFB_VERSION;
+	shm.hdr->header_size = sizeof(SHMFB_HEADER);
+	shm.hdr->width = VIDEO_WIDTH;
+	shm.hdr->height = VIDEO_HEIGHT;
+	shm.hdr->stride = VIDEO_STRIDE;
+	shm.hdr->format = SHMFB_FORMAT_1BPP;
+	shm.hdr->fg_rgb = ((fbc_get_int("display", "red") & 0xFF) << 16) |
+		((fbc_get_int("display", "green") & 0xFF) << 8) | (fbc_get_int("display", "blue") & 0xFF);
+
+	if (shm.name != NULL) {
+		close(fd);
+		printf("Exporting the screen in shared memory object '%s'.\n", shm.name);
+	} else {
+		shm.fd = fd;
+		printf("Exporting the screen in /proc/%d/fd/%d.\n", (int)getpid(), fd);
+	}
+
+	shm.first = true;
+	shm.active = true;
+}
+
+void shmfb_done(void)
+{
+	if (!shm.active)
+		return;
+
+	munmap(shm.base, shm.size);
+	if (shm.name != NULL) {
+		shm_unlink(shm.name);
+		free(shm.name);
+	}
+	if (shm.fd >= 0)
+		close(shm.fd);
+
+	shm.active = false;
+}
+
+void shmfb_frame(const uint8_t *vram, bool reverse, const uint32_t *dirty, uint64_t cycles)
+{
+	SHMFB_HEADER *h = shm.hdr;
+	bool any = false;
+
+	if (!shm.active)
+		return;
+
+	shm.frame++;
+
+	for (int w = 0; w < VIDEO_DIRTY_WORDS && !any; w++)
+		any = dirty[w] != 0;
+	if (!any && !shm.first && (uint32_t)reverse == h->reverse)
+		return;
+
+	// Odd seq tells readers to keep out. The fences stop the compiler and
+	// CPU moving the data writes outside the seq writes.
+	uint32_t seq = h->seq + 1;
+	__atomic_store_n(&h->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (int y = 0; y < VIDEO_HEIGHT; y++) {
+		if (shm.first || video_line_dirty(dirty, y)) {
+			memcpy(&shm.pixels[y * VIDEO_STRIDE], &vram[y * VIDEO_STRIDE], VIDEO_STRIDE);
+			h->line_seq[y] = seq + 1;
+		}
+	}
+	if (shm.first)
+		memset(h->dirty, 0xff, sizeof(h->dirty));
+	else
+		memcpy(h->dirty, dirty, sizeof(h->dirty));
+	h->reverse = reverse;
+	h->frame = shm.frame;
+	h->cycles = cycles;
+
+	__atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELEASE);
+	shm.first = false;
+}
+
+#else
+
+// No POSIX shared memory; the export is unavailable
+
+void shmfb_init(void)
+{
+	const char *name = fbc_get_string("shmfb", "name");
+
+	if (name != NULL && name[0] != '\0')
+		fprintf(stderr, "NOTE: shared framebuffer export not supported on this platform.\n");
+}
+
+void shmfb_done(void)
+{
+}
+
+void shmfb_frame(const uint8_t *vram, bool reverse, const uint32_t *dirty, uint64_t cycles)
+{
+}
+
+#endif
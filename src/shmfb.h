@@ -0,0 +1,71 @@
+#ifndef _SHMFB_H
+#define _SHMFB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "video.h"
+
+/**
+ * @brief	Shared memory framebuffer export.
+ *
+ * Publishes the screen in a POSIX shared memory object (or a memfd), so any
+ * number of local processes can watch it without going through SDL or a
+ * socket. The emulator only ever writes the scanlines which changed, and
+ * readers never need to take a lock.
+ *
+ * The segment is an SHMFB_HEADER followed by VRAM, exactly as the 3B1 has it
+ * (16-bit big-endian words, leftmost pixel in the LSB, 1 = foreground). All
+ * header fields are in host byte order.
+ *
+ * Reading, seqlock style:
+ *	1. s1 = seq; if s1 is odd, an update is in progress -- try again later.
+ *	2. Read the header fields and scanlines you need.
+ *	3. s2 = seq; if s2 != s1, what you read may be torn -- go back to 1.
+ *
+ * To find what changed since you last looked, keep the seq you last read and
+ * look for scanlines whose line_seq[] is newer. dirty[] lists only the lines
+ * changed by the most recent update, which is enough for a reader that never
+ * misses one.
+ */
+
+#define SHMFB_MAGIC			"FBSHM1"
+#define SHMFB_VERSION		1
+#define SHMFB_FORMAT_1BPP	0		///< VRAM as stored, VIDEO_STRIDE bytes/line
+
+typedef struct {
+	char				magic[8];			///< SHMFB_MAGIC, NUL padded
+	uint32_t			version;			///< SHMFB_VERSION
+	uint32_t			header_size;		///< offset of the pixel data
+	uint32_t			width, height;		///< pixels
+	uint32_t			stride;				///< bytes per scanline
+	uint32_t			format;				///< SHMFB_FORMAT_xxx
+	uint32_t			fg_rgb;				///< foreground colour, 0x00RRGGBB
+	volatile uint32_t	seq;				///< update counter, odd while updating
+	uint32_t			reverse;			///< 1 if whole screen reverse video is on
+	uint32_t			reserved;			///< keeps the 64-bit fields aligned
+	uint64_t			frame;				///< 60Hz tick of the last update
+	uint64_t			cycles;				///< emulated CPU cycle of the last update
+	uint32_t			dirty[VIDEO_DIRTY_WORDS];	///< lines changed by the last update
+	uint32_t			line_seq[VIDEO_HEIGHT];		///< seq at which each line last changed
+} SHMFB_HEADER;
+
+/**
+ * @brief	Create the shared memory segment, if [shmfb] name is set.
+ */
+void shmfb_init(void);
+
+/**
+ * @brief	Remove the shared memory segment.
+ */
+void shmfb_done(void);
+
+/**
+ * @brief	Publish changed scanlines. Call this on every 60Hz tick.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ * @param	dirty		Scanlines written since the last tick (VIDEO_DIRTY_WORDS).
+ * @param	cycles		Emulated CPU cycles since startup.
+ */
+void shmfb_frame(const uint8_t *vram, bool reverse, const uint32_t *dirty, uint64_t cycles);
+
+#endif
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include "wd279x.h"
 #include "wd2010.h"
+#include "hdimg.h"
+#include "diskio.h"
+#include "disktrace.h"
 #include "keyboard.h"
 #include "state.h"
 #include "i8274.h"
@@ -153,11 +156,53 @@ void state_done()
 		state.exp_ram = NULL;
 	}
 
+	// Finish any disc I/O in flight and stop the worker
+	diskio_done();
+
+	// Unload the floppy, writing back anything still cached
+	state_unload_floppy();
+
 	// Deinitialise the disc controller
 	wd2797_done(&state.fdc_ctx);
 	wd2010_done(&state.hdc_ctx);
+	// Save the disc command trace, and print its summaries
+	disktrace_done();
+	// Close the hard disc images, writing back anything still pending
+	hdimg_close(state.hdc_disc0);
+	hdimg_close(state.hdc_disc1);
+	state.hdc_disc0 = state.hdc_disc1 = NULL;
 	// Deinitialise the serial controller
 	i8274_done(&state.serial_ctx);
 }
 
+bool state_load_floppy(const char *filename)
+{
+	bool writeable = true;
+
+	state_unload_floppy();
 
+	state.fdc_disc = fopen(filename, "r+b");
+	if (!state.fdc_disc) {
+		writeable = false;
+		state.fdc_disc = fopen(filename, "rb");
+	}
+	if (!state.fdc_disc) {
+		fprintf(stderr, "ERROR loading floppy image '%s'.\n", filename);
+		return false;
+	}
+	if (wd2797_load(&state.fdc_ctx, state.fdc_disc, 512, 2, 40, writeable) != WD2797_ERR_OK) {
+		fprintf(stderr, "ERROR loading floppy image '%s': bad format or geometry.\n", filename);
+		state_unload_floppy();
+		return false;
+	}
+	return true;
+}
+
+void state_unload_floppy(void)
+{
+	if (state.fdc_disc == NULL)
+		return;
+	wd2797_unload(&state.fdc_ctx);
+	fclose(state.fdc_disc);
+	state.fdc_disc = NULL;
+}
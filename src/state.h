@@ -9,6 +9,7 @@
 #include "keyboard.h"
 #include "tc8250.h"
 #include "i8274.h"
+#include "video.h"
 
 
 // Maximum size of the Boot PROMs. Must be a binary power of two.
@@ -106,8 +107,9 @@ typedef struct {
 
 	/// Hard disc controller context
 	WD2010_CTX  hdc_ctx;
-	FILE *hdc_disc0;
-	FILE *hdc_disc1;
+	/// Hard disc images
+	HD_IMAGE *hdc_disc0;
+	HD_IMAGE *hdc_disc1;
 
 	/// Keyboard controller context
 	KEYBOARD_STATE	kbd;
@@ -124,12 +126,20 @@ typedef struct {
 	/// Update screen only when VRAM has been changed
 	bool vram_updated;
 
+	/// Scanlines written since the last 60Hz tick. Anything which wants to
+	/// know what changed on screen accumulates these into its own bitmap at
+	/// the tick; the main loop then clears this one.
+	uint32_t vram_dirty[VIDEO_DIRTY_WORDS];
+
 	/// Whole screen reverse video (GCR bit-addressable register at 0xE47000).
 	/// Not in the TRM; the diagnostics use it to flag a failure visually.
 	bool reverse_video;
 
 	/// MCR2 mirror bit for P5.1 hardware detection
 	bool mcr2mirror;
+
+	/// Emulated time: CPU clock cycles run since startup
+	uint64_t cycles;
 } S_state;
 
 // Global emulator state. Yes, I know global variables are evil, please don't
@@ -158,4 +168,19 @@ int state_init(size_t base_ram_size, size_t exp_ram_size);
  */
 void state_done();
 
+/**
+ * @brief	Load a floppy image into the drive, unloading any already there.
+ * @param	filename	Image file. It's opened read-only if it can't be
+ *						opened for writing.
+ * @return	true on success.
+ */
+bool state_load_floppy(const char *filename);
+
+/**
+ * @brief	Unload the floppy image, writing back anything not yet written.
+ *
+ * Does nothing if the drive is empty.
+ */
+void state_unload_floppy(void);
+
 #endif
@@ -1,7 +1,11 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifndef NDEBUG
 /// Log a message to stderr
@@ -20,4 +24,26 @@
 /// Get the number of elements in an array
 #define NELEMS(x) (sizeof(x)/sizeof(x[0]))
 
+/**
+ * Check whether a buffer is all zeros.
+ *
+ * Goes 64 bytes at a time, ORing eight words together with no branch until
+ * the end of each block, which compilers turn into vector code.
+ */
+static inline bool buf_is_zero(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t w[8];
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(w, p, sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return false;
+	}
+	while (len-- > 0)
+		if (*p++ != 0)
+			return false;
+	return true;
+}
+
 #endif // _H_UTILS
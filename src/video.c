@@ -0,0 +1,48 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "video.h"
+
+/**
+ * Byte-to-pixel expansion table.
+ *
+ * Each VRAM byte holds eight pixels, leftmost in the LSB. Indexing this with
+ * the byte gives the eight 32-bit pixels it expands to, so a whole byte can be
+ * copied out in one go instead of testing and plotting each bit.
+ */
+static uint32_t expand[256][8];
+static uint32_t expand_fg, expand_bg;
+static bool expand_valid = false;
+
+void video_set_colours(uint32_t fg, uint32_t bg)
+{
+	if (expand_valid && fg == expand_fg && bg == expand_bg)
+		return;
+
+	for (int b = 0; b < 256; b++) {
+		for (int px = 0; px < 8; px++) {
+			expand[b][px] = (b & (1 << px)) ? fg : bg;
+		}
+	}
+
+	expand_fg = fg;
+	expand_bg = bg;
+	expand_valid = true;
+}
+
+void video_render(void *dst, size_t pitch, const uint8_t *vram)
+{
+	for (int y = 0; y < VIDEO_HEIGHT; y++) {
+		uint32_t *p = (uint32_t *)((uint8_t *)dst + (y * pitch));
+		const uint8_t *v = &vram[y * VIDEO_STRIDE];
+
+		// VRAM words are big-endian, and the leftmost pixel is the LSB of the
+		// word -- so the second byte in memory holds pixels 0-7, and the first
+		// holds pixels 8-15.
+		for (int x = 0; x < VIDEO_STRIDE; x += 2) {
+			memcpy(&p[0], expand[v[x+1]], sizeof(expand[0]));
+			memcpy(&p[8], expand[v[x]], sizeof(expand[0]));
+			p += 16;
+		}
+	}
+}
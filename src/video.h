@@ -0,0 +1,60 @@
+#ifndef _VIDEO_H
+#define _VIDEO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/// Visible screen area, in pixels
+#define VIDEO_WIDTH		720
+#define VIDEO_HEIGHT	348
+/// Bytes of VRAM per scanline (720 pixels, 1bpp, packed into 16-bit words)
+#define VIDEO_STRIDE	(VIDEO_WIDTH / 8)
+
+/// Size of a scanline dirty bitmap -- one bit per visible scanline
+#define VIDEO_DIRTY_WORDS	((VIDEO_HEIGHT + 31) / 32)
+
+/**
+ * @brief	Mark the scanlines covered by a VRAM write as dirty.
+ * @param	map		Scanline dirty bitmap, VIDEO_DIRTY_WORDS long.
+ * @param	offset	Offset of the write into VRAM.
+ * @param	len		Length of the write in bytes.
+ *
+ * Writes past the visible area are ignored.
+ */
+static inline void video_mark_dirty(uint32_t *map, uint32_t offset, uint32_t len)
+{
+	uint32_t first = offset / VIDEO_STRIDE;
+	uint32_t last = (offset + len - 1) / VIDEO_STRIDE;
+
+	for (uint32_t line = first; line <= last && line < VIDEO_HEIGHT; line++)
+		map[line / 32] |= 1u << (line % 32);
+}
+
+/**
+ * @brief	Check whether a scanline is marked dirty.
+ */
+static inline bool video_line_dirty(const uint32_t *map, int line)
+{
+	return (map[line / 32] >> (line % 32)) & 1;
+}
+
+/**
+ * @brief	Set the colours used to expand VRAM into 32-bit pixels.
+ * @param	fg		Pixel value for a set VRAM bit.
+ * @param	bg		Pixel value for a clear VRAM bit.
+ *
+ * The expansion table is only rebuilt if the colours have actually changed,
+ * so it's cheap to call this once per frame.
+ */
+void video_set_colours(uint32_t fg, uint32_t bg);
+
+/**
+ * @brief	Expand the visible area of VRAM into a 32bpp pixel buffer.
+ * @param	dst		Destination buffer, at least VIDEO_HEIGHT rows long.
+ * @param	pitch	Length of a destination row in bytes.
+ * @param	vram	Video RAM contents.
+ */
+void video_render(void *dst, size_t pitch, const uint8_t *vram);
+
+#endif
@@ -0,0 +1,806 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "SDL.h"
+
+#include "vnc.h"
+#include "video.h"
+#include "fbconfig.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/// Most viewers connected at once
+#define VNC_MAX_CLIENTS		4
+
+/// Client to server message buffer size. Big enough for any message except
+/// ClientCutText, whose text is skipped rather than buffered.
+#define VNC_INBUF_SIZE		1024
+
+/// Name sent to viewers in the ServerInit message
+#define VNC_DESKTOP_NAME	"FreeBee 3B1"
+
+// RFB message types
+enum {
+	RFB_SET_PIXEL_FORMAT		= 0,
+	RFB_SET_ENCODINGS			= 2,
+	RFB_FB_UPDATE_REQUEST		= 3,
+	RFB_KEY_EVENT				= 4,
+	RFB_POINTER_EVENT			= 5,
+	RFB_CLIENT_CUT_TEXT			= 6,
+
+	RFB_FB_UPDATE				= 0,
+	RFB_SET_COLOUR_MAP_ENTRIES	= 1,
+};
+
+typedef enum {
+	PHASE_VERSION,			///< waiting for the viewer's ProtocolVersion
+	PHASE_SECURITY,			///< waiting for the viewer's security type
+	PHASE_INIT,				///< waiting for ClientInit
+	PHASE_NORMAL			///< handshake done
+} VNC_PHASE;
+
+typedef struct {
+	int			fd;					///< socket, -1 if this slot is free
+	VNC_PHASE	phase;
+	int			minor;				///< RFB protocol minor version (3, 7 or 8)
+
+	uint8_t		in[VNC_INBUF_SIZE];	///< partial incoming message
+	size_t		inlen;
+	uint32_t	skip;				///< bytes of cut text still to discard
+
+	uint8_t		*out;				///< data waiting to be sent
+	size_t		outlen, outsize;
+
+	// Pixel format the viewer wants
+	int			bytes_pp;			///< 1, 2 or 4
+	bool		big_endian;
+	bool		true_colour;
+	uint16_t	max[3];				///< red, green, blue maximums
+	uint8_t		shift[3];			///< red, green, blue shifts
+	uint32_t	pix[2];				///< pixel values for background, foreground
+
+	bool		update_requested;	///< viewer is waiting for an update
+	bool		full;				///< send the whole screen, not just changes
+	bool		reverse;			///< reverse video state the viewer has
+	uint32_t	dirty[VIDEO_DIRTY_WORDS];	///< scanlines written since last update
+	uint8_t		shadow[VIDEO_HEIGHT * VIDEO_STRIDE];	///< screen the viewer has
+
+	uint16_t	mod;				///< KMOD_ALT while the viewer holds Alt
+	int			buttons;			///< last pointer button mask
+	int			px, py;				///< last pointer position
+	bool		have_pointer;
+} VNC_CLIENT;
+
+static struct {
+	bool		active;
+	int			listen_fd;
+	char		*unix_path;			///< Unix socket path to remove at exit
+	uint8_t		fg[3];				///< foreground colour, R/G/B
+	VNC_CLIENT	clients[VNC_MAX_CLIENTS];
+} vnc;
+
+/********************
+ * Output buffering
+ ********************/
+
+static void out_append(VNC_CLIENT *c, const void *data, size_t len)
+{
+	if (c->outlen + len > c->outsize) {
+		size_t newsize = c->outsize ? c->outsize : 4096;
+		while (newsize < c->outlen + len)
+			newsize *= 2;
+		uint8_t *p = realloc(c->out, newsize);
+		if (p == NULL) {
+			// Can't keep the stream in sync any more; drop the viewer
+			close(c->fd);
+			c->fd = -1;
+			return;
+		}
+		c->out = p;
+		c->outsize = newsize;
+	}
+	memcpy(&c->out[c->outlen], data, len);
+	c->outlen += len;
+}
+
+static void out_u8(VNC_CLIENT *c, uint8_t v)
+{
+	out_append(c, &v, 1);
+}
+
+static void out_u16(VNC_CLIENT *c, uint16_t v)
+{
+	uint8_t b[2] = { v >> 8, v };
+	out_append(c, b, 2);
+}
+
+static void out_u32(VNC_CLIENT *c, uint32_t v)
+{
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	out_append(c, b, 4);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+static void client_close(VNC_CLIENT *c)
+{
+	if (c->fd >= 0) {
+		close(c->fd);
+		printf("VNC: viewer disconnected.\n");
+	}
+	c->fd = -1;
+	free(c->out);
+	c->out = NULL;
+	c->outlen = c->outsize = 0;
+}
+
+/**
+ * @brief	Send as much queued output as the socket will take.
+ */
+static void client_flush(VNC_CLIENT *c)
+{
+	while (c->fd >= 0 && c->outlen > 0) {
+#ifdef MSG_NOSIGNAL
+		ssize_t n = send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+#else
+		ssize_t n = send(c->fd, c->out, c->outlen, 0);
+#endif
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(c);
+			return;
+		}
+		memmove(c->out, &c->out[n], c->outlen - n);
+		c->outlen -= n;
+	}
+}
+
+/********************
+ * Framebuffer updates
+ ********************/
+
+/**
+ * @brief	Work out the pixel values for the viewer's pixel format.
+ */
+static void client_set_colours(VNC_CLIENT *c)
+{
+	if (c->true_colour) {
+		for (int i = 0; i < 2; i++) {
+			uint32_t p = 0;
+			for (int j = 0; j < 3; j++) {
+				uint32_t v = i ? vnc.fg[j] : 0;
+				p |= ((v * c->max[j] + 127) / 255) << c->shift[j];
+			}
+			c->pix[i] = p;
+		}
+	} else {
+		// Colour map: entry 0 is black, entry 1 the foreground colour
+		c->pix[0] = 0;
+		c->pix[1] = 1;
+		out_u8(c, RFB_SET_COLOUR_MAP_ENTRIES);
+		out_u8(c, 0);
+		out_u16(c, 0);
+		out_u16(c, 2);
+		for (int i = 0; i < 3; i++)
+			out_u16(c, 0);
+		for (int i = 0; i < 3; i++)
+			out_u16(c, vnc.fg[i] * 0x101);
+	}
+
+	if (c->reverse) {
+		uint32_t t = c->pix[0];
+		c->pix[0] = c->pix[1];
+		c->pix[1] = t;
+	}
+}
+
+/**
+ * @brief	Append a run of pixels from one scanline in the viewer's format.
+ * @param	line	Start of the scanline in VRAM.
+ * @param	x		First pixel; a multiple of 16.
+ * @param	w		Number of pixels; a multiple of 16.
+ */
+static void put_pixels(VNC_CLIENT *c, const uint8_t *line, int x, int w)
+{
+	uint8_t buf[VIDEO_WIDTH * 4];
+	uint8_t *p = buf;
+
+	for (int word = x / 16; word < (x + w) / 16; word++) {
+		// Leftmost pixel is the LSB of the big-endian word
+		uint16_t bits = line[word * 2 + 1] | (line[word * 2] << 8);
+		for (int b = 0; b < 16; b++, bits >>= 1) {
+			uint32_t v = c->pix[bits & 1];
+			switch (c->bytes_pp) {
+				case 1:
+					*p++ = v;
+					break;
+				case 2:
+					if (c->big_endian) {
+						*p++ = v >> 8;	*p++ = v;
+					} else {
+						*p++ = v;		*p++ = v >> 8;
+					}
+					break;
+				default:
+					if (c->big_endian) {
+						*p++ = v >> 24;	*p++ = v >> 16;	*p++ = v >> 8;	*p++ = v;
+					} else {
+						*p++ = v;		*p++ = v >> 8;	*p++ = v >> 16;	*p++ = v >> 24;
+					}
+					break;
+			}
+		}
+	}
+
+	out_append(c, buf, p - buf);
+}
+
+/**
+ * @brief	Send the parts of the screen the viewer doesn't have yet.
+ *
+ * Consecutive changed scanlines are merged into one rectangle, as wide as the
+ * widest change among them. If nothing has changed nothing is sent, and the
+ * viewer's request stays pending until something does.
+ */
+static void client_update(VNC_CLIENT *c, const uint8_t *vram, bool reverse)
+{
+	struct { uint16_t y, h, first, last; } rects[VIDEO_HEIGHT];
+	int nrects = 0;
+	bool open = false;
+
+	if (reverse != c->reverse) {
+		c->reverse = reverse;
+		client_set_colours(c);
+		c->full = true;
+	}
+
+	for (int y = 0; y < VIDEO_HEIGHT; y++) {
+		const uint8_t *v = &vram[y * VIDEO_STRIDE];
+		uint8_t *s = &c->shadow[y * VIDEO_STRIDE];
+		int first = -1, last = -1;
+
+		if (c->full) {
+			first = 0;
+			last = VIDEO_STRIDE / 2 - 1;
+		} else if (video_line_dirty(c->dirty, y)) {
+			for (int i = 0; i < VIDEO_STRIDE; i++) {
+				if (v[i] != s[i]) {
+					if (first < 0)
+						first = i / 2;
+					last = i / 2;
+				}
+			}
+		}
+
+		if (first < 0) {
+			open = false;
+			continue;
+		}
+
+		memcpy(s, v, VIDEO_STRIDE);
+		if (open) {
+			rects[nrects - 1].h++;
+			if (first < rects[nrects - 1].first)
+				rects[nrects - 1].first = first;
+			if (last > rects[nrects - 1].last)
+				rects[nrects - 1].last = last;
+		} else {
+			rects[nrects].y = y;
+			rects[nrects].h = 1;
+			rects[nrects].first = first;
+			rects[nrects].last = last;
+			nrects++;
+			open = true;
+		}
+	}
+
+	memset(c->dirty, 0, sizeof(c->dirty));
+	c->full = false;
+	if (nrects == 0)
+		return;
+
+	out_u8(c, RFB_FB_UPDATE);
+	out_u8(c, 0);
+	out_u16(c, nrects);
+	for (int i = 0; i < nrects; i++) {
+		int x = rects[i].first * 16;
+		int w = (rects[i].last - rects[i].first + 1) * 16;
+
+		out_u16(c, x);
+		out_u16(c, rects[i].y);
+		out_u16(c, w);
+		out_u16(c, rects[i].h);
+		out_u32(c, 0);		// Raw encoding
+		for (int y = rects[i].y; y < rects[i].y + rects[i].h; y++)
+			put_pixels(c, &vram[y * VIDEO_STRIDE], x, w);
+	}
+
+	c->update_requested = false;
+}
+
+/********************
+ * Input
+ ********************/
+
+/**
+ * @brief	Map an X11 keysym (as sent by RFB viewers) to an SDL key code.
+ * @return	false if the 3B1 keyboard has nothing for it.
+ */
+static bool keysym_to_key(uint32_t sym, SDL_Keycode *key)
+{
+	static const struct {
+		uint32_t	sym;
+		SDL_Keycode	key;
+	} map[] = {
+		{ 0xff08, SDLK_BACKSPACE },		{ 0xff09, SDLK_TAB },
+		{ 0xff0d, SDLK_RETURN },		{ 0xff8d, SDLK_RETURN },	// KP_Enter
+		{ 0xff13, SDLK_PAUSE },			{ 0xff1b, SDLK_ESCAPE },
+		{ 0xff50, SDLK_HOME },			{ 0xff51, SDLK_LEFT },
+		{ 0xff52, SDLK_UP },			{ 0xff53, SDLK_RIGHT },
+		{ 0xff54, SDLK_DOWN },			{ 0xff55, SDLK_PAGEUP },
+		{ 0xff56, SDLK_PAGEDOWN },		{ 0xff57, SDLK_END },
+		{ 0xff63, SDLK_INSERT },		{ 0xff7f, SDLK_NUMLOCKCLEAR },
+		{ 0xffff, SDLK_DELETE },		{ 0xffe5, SDLK_CAPSLOCK },
+		{ 0xffe1, SDLK_LSHIFT },		{ 0xffe2, SDLK_RSHIFT },
+		{ 0xffe3, SDLK_LCTRL },			{ 0xffe4, SDLK_RCTRL },
+		{ 0xffad, SDLK_KP_MINUS },		{ 0xffae, SDLK_KP_PERIOD },
+		{ 0xffb0, SDLK_KP_0 },			{ 0xffb1, SDLK_KP_1 },
+		{ 0xffb2, SDLK_KP_2 },			{ 0xffb3, SDLK_KP_3 },
+		{ 0xffb4, SDLK_KP_4 },			{ 0xffb5, SDLK_KP_5 },
+		{ 0xffb6, SDLK_KP_6 },			{ 0xffb7, SDLK_KP_7 },
+		{ 0xffb8, SDLK_KP_8 },			{ 0xffb9, SDLK_KP_9 },
+		{ 0xffbe, SDLK_F1 },			{ 0xffbf, SDLK_F2 },
+		{ 0xffc0, SDLK_F3 },			{ 0xffc1, SDLK_F4 },
+		{ 0xffc2, SDLK_F5 },			{ 0xffc3, SDLK_F6 },
+		{ 0xffc4, SDLK_F7 },			{ 0xffc5, SDLK_F8 },
+		{ 0xffc6, SDLK_F9 },
+	};
+	bool shift;
+
+	// Latin-1 keysyms are the characters themselves. The viewer sends Shift
+	// separately, so a shifted character just needs its unshifted key.
+	if (sym >= 0x20 && sym < 0x7f)
+		return keyboard_char_to_key(sym, key, &shift);
+
+	for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		if (map[i].sym == sym) {
+			*key = map[i].key;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void client_key(VNC_CLIENT *c, KEYBOARD_STATE *kbd, bool down, uint32_t sym)
+{
+	SDL_Keycode key;
+
+	// Alt selects the extended keys (see keyboard.c); it isn't a key itself
+	if (sym == 0xffe9 || sym == 0xffea) {
+		c->mod = down ? KMOD_ALT : 0;
+		return;
+	}
+
+	if (keysym_to_key(sym, &key))
+		keyboard_inject(kbd, key, c->mod, down);
+}
+
+static void client_pointer(VNC_CLIENT *c, KEYBOARD_STATE *kbd, uint8_t mask, int x, int y)
+{
+	// RFB buttons 1/2/3 are left/middle/right
+	int buttons = ((mask & 1) ? MOUSE_BUTTON_LEFT : 0) |
+		((mask & 2) ? MOUSE_BUTTON_MIDDLE : 0) |
+		((mask & 4) ? MOUSE_BUTTON_RIGHT : 0);
+
+	// The 3B1 mouse is relative, so send the movement since the last event,
+	// split into steps the mouse protocol can carry.
+	int dx = c->have_pointer ? x - c->px : 0;
+	int dy = c->have_pointer ? y - c->py : 0;
+	c->px = x;
+	c->py = y;
+	c->have_pointer = true;
+
+	while (dx != 0 || dy != 0 || buttons != c->buttons) {
+		int sx = dx > 127 ? 127 : (dx < -127 ? -127 : dx);
+		int sy = dy > 127 ? 127 : (dy < -127 ? -127 : dy);
+		mouse_event(kbd, sx, sy, buttons);
+		c->buttons = buttons;
+		dx -= sx;
+		dy -= sy;
+	}
+}
+
+/**
+ * @brief	Handle one complete message from the viewer.
+ * @return	Bytes consumed, 0 if the message isn't all here yet, or -1 if the
+ *			viewer is talking nonsense.
+ */
+static int client_message(VNC_CLIENT *c, KEYBOARD_STATE *kbd, const uint8_t *m, size_t len)
+{
+	switch (c->phase) {
+		case PHASE_VERSION:
+			if (len < 12)
+				return 0;
+			if (memcmp(m, "RFB 003.", 8) != 0)
+				return -1;
+			c->minor = atoi((const char *)&m[8]);
+			if (c->minor >= 7) {
+				// Offer security type 1, None
+				out_u8(c, 1);
+				out_u8(c, 1);
+				c->phase = PHASE_SECURITY;
+			} else {
+				c->minor = 3;
+				out_u32(c, 1);
+				c->phase = PHASE_INIT;
+			}
+			return 12;
+
+		case PHASE_SECURITY:
+			if (len < 1)
+				return 0;
+			if (m[0] != 1)
+				return -1;
+			if (c->minor >= 8)
+				out_u32(c, 0);		// SecurityResult: OK
+			c->phase = PHASE_INIT;
+			return 1;
+
+		case PHASE_INIT:
+			if (len < 1)
+				return 0;
+			// ServerInit: size, pixel format (32bpp xRGB, little-endian), name
+			out_u16(c, VIDEO_WIDTH);
+			out_u16(c, VIDEO_HEIGHT);
+			{
+				static const uint8_t pf[16] = { 32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0 };
+				out_append(c, pf, sizeof(pf));
+			}
+			out_u32(c, strlen(VNC_DESKTOP_NAME));
+			out_append(c, VNC_DESKTOP_NAME, strlen(VNC_DESKTOP_NAME));
+			c->phase = PHASE_NORMAL;
+			return 1;
+
+		case PHASE_NORMAL:
+			break;
+	}
+
+	switch (m[0]) {
+		case RFB_SET_PIXEL_FORMAT:
+			if (len < 20)
+				return 0;
+			if (m[4] != 8 && m[4] != 16 && m[4] != 32)
+				return -1;
+			c->bytes_pp = m[4] / 8;
+			c->big_endian = m[6] != 0;
+			c->true_colour = m[7] != 0;
+			for (int i = 0; i < 3; i++) {
+				c->max[i] = get16(&m[8 + i * 2]);
+				c->shift[i] = m[14 + i];
+			}
+			client_set_colours(c);
+			c->full = true;
+			return 20;
+
+		case RFB_SET_ENCODINGS:
+			if (len < 4 || len < 4 + 4 * (size_t)get16(&m[2]))
+				return len < VNC_INBUF_SIZE ? 0 : -1;
+			// Raw is always allowed, and it's all we send
+			return 4 + 4 * get16(&m[2]);
+
+		case RFB_FB_UPDATE_REQUEST:
+			if (len < 10)
+				return 0;
+			c->update_requested = true;
+			if (!m[1])
+				c->full = true;
+			return 10;
+
+		case RFB_KEY_EVENT:
+			if (len < 8)
+				return 0;
+			client_key(c, kbd, m[1] != 0, get32(&m[4]));
+			return 8;
+
+		case RFB_POINTER_EVENT:
+			if (len < 6)
+				return 0;
+			client_pointer(c, kbd, m[1], get16(&m[2]), get16(&m[4]));
+			return 6;
+
+		case RFB_CLIENT_CUT_TEXT:
+			if (len < 8)
+				return 0;
+			c->skip = get32(&m[4]);
+			return 8;
+
+		default:
+			return -1;
+	}
+}
+
+/**
+ * @brief	Read and act on whatever the viewer has sent.
+ */
+static void client_read(VNC_CLIENT *c, KEYBOARD_STATE *kbd)
+{
+	for (;;) {
+		ssize_t n = recv(c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen, 0);
+		if (n == 0) {
+			client_close(c);
+			return;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(c);
+			break;
+		}
+		c->inlen += n;
+
+		size_t pos = 0;
+		while (pos < c->inlen) {
+			if (c->skip) {
+				size_t k = c->inlen - pos < c->skip ? c->inlen - pos : c->skip;
+				c->skip -= k;
+				pos += k;
+				continue;
+			}
+			int used = client_message(c, kbd, &c->in[pos], c->inlen - pos);
+			if (used < 0) {
+				fprintf(stderr, "VNC: protocol error from viewer; disconnecting it.\n");
+				client_close(c);
+				return;
+			}
+			if (used == 0)
+				break;
+			pos += used;
+		}
+		memmove(c->in, &c->in[pos], c->inlen - pos);
+		c->inlen -= pos;
+	}
+}
+
+static void accept_client(void)
+{
+	int fd = accept(vnc.listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	VNC_CLIENT *c = NULL;
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		if (vnc.clients[i].fd < 0) {
+			c = &vnc.clients[i];
+			break;
+		}
+	}
+	if (c == NULL) {
+		fprintf(stderr, "VNC: too many viewers; refusing another.\n");
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));	// fails harmlessly on Unix sockets
+
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	c->phase = PHASE_VERSION;
+	c->bytes_pp = 4;
+	c->true_colour = true;
+	c->max[0] = c->max[1] = c->max[2] = 255;
+	c->shift[0] = 16;
+	c->shift[1] = 8;
+	c->shift[2] = 0;
+	client_set_colours(c);
+	c->full = true;
+	out_append(c, "RFB 003.008\n", 12);
+	client_flush(c);
+	printf("VNC: viewer connected.\n");
+}
+
+/********************
+ * Server
+ ********************/
+
+/**
+ * @brief	Create the listening socket.
+ * @param	spec	"unix:/path", "host:port" or "port". A bare port listens
+ *					on the loopback interface only.
+ * @return	Socket, or -1 on error.
+ */
+static int open_listener(const char *spec)
+{
+	int fd;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		struct stat st;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+		// Replace a socket left behind by an earlier run, but nothing else
+		if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr.sun_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
+		}
+		vnc.unix_path = strdup(addr.sun_path);
+	} else {
+		struct sockaddr_in addr;
+		char host[64] = "127.0.0.1";
+		const char *colon = strrchr(spec, ':');
+		int one = 1;
+
+		if (colon != NULL) {
+			snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+			spec = colon + 1;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(spec));
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (listen(fd, 2) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+void vnc_init(void)
+{
+	const char *spec = fbc_get_string("vnc", "listen");
+
+	memset(&vnc, 0, sizeof(vnc));
+	vnc.listen_fd = -1;
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++)
+		vnc.clients[i].fd = -1;
+
+	if (spec == NULL || spec[0] == '\0')
+		return;
+
+	if ((vnc.listen_fd = open_listener(spec)) < 0) {
+		fprintf(stderr, "NOTE: could not listen for VNC viewers on '%s' (%s); VNC disabled.\n",
+				spec, strerror(errno));
+		return;
+	}
+
+	vnc.fg[0] = fbc_get_int("display", "red");
+	vnc.fg[1] = fbc_get_int("display", "green");
+	vnc.fg[2] = fbc_get_int("display", "blue");
+
+	// A viewer going away mid-send mustn't kill the emulator
+	signal(SIGPIPE, SIG_IGN);
+
+	vnc.active = true;
+	printf("VNC server listening on '%s'.\n", spec);
+}
+
+void vnc_done(void)
+{
+	if (!vnc.active)
+		return;
+
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++)
+		client_close(&vnc.clients[i]);
+	close(vnc.listen_fd);
+	if (vnc.unix_path != NULL) {
+		unlink(vnc.unix_path);
+		free(vnc.unix_path);
+	}
+
+	vnc.active = false;
+}
+
+void vnc_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse, const uint32_t *dirty)
+{
+	struct pollfd pfd[VNC_MAX_CLIENTS + 1];
+	VNC_CLIENT *pc[VNC_MAX_CLIENTS + 1];
+	int n = 0;
+
+	if (!vnc.active)
+		return;
+
+	// One poll() covers the listener and every viewer
+	pfd[n].fd = vnc.listen_fd;
+	pfd[n].events = POLLIN;
+	pfd[n].revents = 0;
+	pc[n++] = NULL;
+	for (int i = 0; i < VNC_MAX_CLIENTS; i++) {
+		VNC_CLIENT *c = &vnc.clients[i];
+		if (c->fd < 0)
+			continue;
+		for (int w = 0; w < VIDEO_DIRTY_WORDS; w++)
+			c->dirty[w] |= dirty[w];
+		pfd[n].fd = c->fd;
+		pfd[n].events = POLLIN | (c->outlen ? POLLOUT : 0);
+		pfd[n].revents = 0;
+		pc[n++] = c;
+	}
+
+	if (poll(pfd, n, 0) <= 0 && n == 1)
+		return;
+
+	for (int i = 1; i < n; i++) {
+		VNC_CLIENT *c = pc[i];
+		if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+			client_read(c, kbd);
+		if (c->fd >= 0 && c->outlen)
+			client_flush(c);
+		// Only build an update once the last one has gone; a slow viewer
+		// just gets fewer, bigger updates.
+		if (c->fd >= 0 && c->phase == PHASE_NORMAL && c->update_requested && c->outlen == 0)
+			client_update(c, vram, reverse);
+		if (c->fd >= 0 && c->outlen)
+			client_flush(c);
+	}
+
+	if (pfd[0].revents & POLLIN)
+		accept_client();
+}
+
+#else
+
+// No sockets; the server is unavailable
+
+void vnc_init(void)
+{
+	const char *spec = fbc_get_string("vnc", "listen");
+
+	if (spec != NULL && spec[0] != '\0')
+		fprintf(stderr, "NOTE: VNC server not supported on this platform.\n");
+}
+
+void vnc_done(void)
+{
+}
+
+void vnc_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse, const uint32_t *dirty)
+{
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _VNC_H
+#define _VNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "keyboard.h"
+
+/**
+ * @brief	Built-in RFB (VNC) server, for viewing and driving the emulator
+ *			on a host without a display.
+ *
+ * Serves the 720x348 screen using Raw encoding in whatever true-colour or
+ * colour-map pixel format the viewer asks for. Only scanlines which VRAM
+ * writes have touched are compared against what each viewer already has,
+ * and only the columns which actually differ are sent, so an idle screen
+ * costs one poll() per 60Hz tick. Keyboard and pointer events from viewers
+ * are fed to the emulated keyboard and mouse.
+ *
+ * No authentication is offered, so by default the server only listens on
+ * the loopback interface or a Unix domain socket.
+ */
+
+/**
+ * @brief	Start listening, if [vnc] listen is set in the config.
+ */
+void vnc_init(void);
+
+/**
+ * @brief	Disconnect all viewers and stop listening.
+ */
+void vnc_done(void);
+
+/**
+ * @brief	Service the server. Call this on every 60Hz tick.
+ * @param	kbd			Keyboard to send viewers' key and pointer events to.
+ * @param	vram		Video RAM contents.
+ * @param	reverse		True if whole screen reverse video is on.
+ * @param	dirty		Scanlines written since the last tick (VIDEO_DIRTY_WORDS).
+ */
+void vnc_poll(KEYBOARD_STATE *kbd, const uint8_t *vram, bool reverse, const uint32_t *dirty);
+
+#endif
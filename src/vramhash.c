@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "vramhash.h"
+#include "video.h"
+#include "fbconfig.h"
+
+static struct {
+	bool		active;
+	FILE		*fp;			///< hash output, NULL if none
+	bool		have_stop;
+	uint64_t	stop_hash;		///< exit when a frame hashes to this
+	bool		have_last;
+	uint64_t	last;			///< last hash reported
+	uint32_t	frame;			///< current 60Hz tick number
+} vh;
+
+/********************
+ * XXH64, from the xxHash specification (Yann Collet, BSD licence)
+ ********************/
+
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// xxHash is defined on little-endian loads, whatever the host byte order
+static inline uint64_t read64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+
+		do {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= end - 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += len;
+
+	while (p + 8 <= end) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p++) * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/**
+ * @brief	Open the hash output.
+ * @param	name	File name, or "unix:" followed by the path of a listening
+ *					Unix domain socket to connect to.
+ * @return	Stream to write to, or NULL on error.
+ */
+static FILE *open_output(const char *name)
+{
+	if (strncmp(name, "unix:", 5) == 0) {
+#ifndef _WIN32
+		struct sockaddr_un addr;
+		int fd;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, name + 5, sizeof(addr.sun_path) - 1);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return NULL;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(fd);
+			return NULL;
+		}
+		// A reader going away shouldn't take the emulator down with it
+		signal(SIGPIPE, SIG_IGN);
+		FILE *fp = fdopen(fd, "w");
+		if (fp != NULL)
+			setvbuf(fp, NULL, _IOLBF, 0);
+		return fp;
+#else
+		errno = ENOTSUP;
+		return NULL;
+#endif
+	}
+
+	return fopen(name, "w");
+}
+
+void vramhash_init(void)
+{
+	const char *output = fbc_get_string("vramhash", "output");
+	const char *stop = fbc_get_string("vramhash", "stop_on_hash");
+
+	memset(&vh, 0, sizeof(vh));
+
+	if (output != NULL && output[0] != '\0') {
+		if ((vh.fp = open_output(output)) == NULL) {
+			fprintf(stderr, "NOTE: could not open VRAM hash output '%s' (%s); not hashing to it.\n",
+					output, strerror(errno));
+		} else {
+			printf("Writing VRAM hashes to '%s'.\n", output);
+		}
+	}
+
+	if (stop != NULL && stop[0] != '\0') {
+		char *endp;
+		vh.stop_hash = strtoull(stop, &endp, 16);
+		if (*endp != '\0') {
+			fprintf(stderr, "NOTE: vramhash.stop_on_hash '%s' is not a hex number; ignored.\n", stop);
+		} else {
+			vh.have_stop = true;
+			printf("Will exit when VRAM hash is %016llx.\n", (unsigned long long)vh.stop_hash);
+		}
+	}
+
+	vh.active = (vh.fp != NULL) || vh.have_stop;
+}
+
+void vramhash_done(void)
+{
+	if (vh.fp != NULL)
+		fclose(vh.fp);
+	vh.fp = NULL;
+	vh.active = false;
+}
+
+bool vramhash_frame(const uint8_t *vram, bool changed, uint64_t cycles)
+{
+	bool stop = false;
+
+	if (!vh.active)
+		return false;
+
+	if (changed || !vh.have_last) {
+		uint64_t h = xxh64(vram, VIDEO_HEIGHT * VIDEO_STRIDE, 0);
+
+		if (!vh.have_last || h != vh.last) {
+			if (vh.fp != NULL)
+				fprintf(vh.fp, "%llu %u %016llx\n",
+						(unsigned long long)cycles, vh.frame, (unsigned long long)h);
+			vh.last = h;
+			vh.have_last = true;
+
+			if (vh.have_stop && h == vh.stop_hash) {
+				printf("VRAM hash %016llx reached at frame %u; exiting.\n",
+						(unsigned long long)h, vh.frame);
+				stop = true;
+			}
+		}
+	}
+
+	vh.frame++;
+	return stop;
+}
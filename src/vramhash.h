@@ -0,0 +1,52 @@
+#ifndef _VRAMHASH_H
+#define _VRAMHASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief	VRAM hash stream -- a cheap fingerprint of every frame, for
+ *			regression testing against a golden run.
+ *
+ * On each 60Hz tick where VRAM may have changed, the whole of VRAM is hashed
+ * with XXH64 (seed 0). Whenever the hash differs from the previous one, a
+ * line is written to the configured file or Unix socket:
+ *
+ *		<emulated cycle> <frame number> <hash, 16 hex digits>
+ *
+ * The emulated cycle count and frame number are deterministic for a given
+ * boot, so two runs of the same guest produce identical streams. Reverse
+ * video isn't part of the hash; it doesn't touch VRAM.
+ */
+
+/**
+ * @brief	Compute the XXH64 hash of a buffer.
+ * @param	data	Data to hash.
+ * @param	len		Length of data in bytes.
+ * @param	seed	Hash seed.
+ * @return	64-bit hash.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/**
+ * @brief	Open the hash output and read the stop condition from the config.
+ */
+void vramhash_init(void);
+
+/**
+ * @brief	Flush and close the hash output.
+ */
+void vramhash_done(void);
+
+/**
+ * @brief	Hash a frame if needed. Call this on every 60Hz tick.
+ * @param	vram		Video RAM contents.
+ * @param	changed		True if VRAM may have changed since the last call.
+ * @param	cycles		Emulated CPU cycles since startup.
+ * @return	true if the frame matched the configured stop hash, and the
+ *			emulator should exit.
+ */
+bool vramhash_frame(const uint8_t *vram, bool changed, uint64_t cycles);
+
+#endif
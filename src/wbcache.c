@@ -0,0 +1,357 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SDL.h"
+#include "fbconfig.h"
+#include "wbcache.h"
+
+/// Hash table size; a power of two
+#define WBCACHE_HASH_SIZE	1024
+
+typedef enum {
+	WBCACHE_POLICY_IDLE,
+	WBCACHE_POLICY_TIMER,
+	WBCACHE_POLICY_EXIT
+} WBCACHE_POLICY;
+
+/// A cached sector
+typedef struct wbcache_entry {
+	struct wbcache_entry	*next;		///< next in hash chain
+	uint32_t				lba;
+	uint32_t				gen;		///< write generation, to spot rewrites during a flush
+	uint8_t					data[];
+} WBCACHE_ENTRY;
+
+/// A sector taken from the cache for writing back
+typedef struct {
+	uint32_t	lba;
+	uint32_t	gen;
+} WBCACHE_SNAP;
+
+struct wbcache {
+	char			*name;
+	size_t			secsz;
+	WBCACHE_OPS		ops;
+	void			*arg;
+
+	WBCACHE_POLICY	policy;
+	uint32_t		delay_ms;		///< idle time or timer period
+	size_t			max_dirty;		///< sectors held before writing back regardless
+
+	WBCACHE_ENTRY	*hash[WBCACHE_HASH_SIZE];
+	size_t			ndirty;
+	uint32_t		gen;
+	uint32_t		last_write;		///< SDL_GetTicks() of the last write
+
+	SDL_mutex		*lock;			///< protects the entries and the fields above
+	SDL_mutex		*io;			///< serialises access to the image
+	SDL_mutex		*flushing;		///< one write-back at a time
+	SDL_cond		*wake;
+	SDL_Thread		*thread;
+	bool			urgent, quit;
+};
+
+static inline unsigned int hash_lba(uint32_t lba)
+{
+	return (lba * 2654435761u) >> 22;
+}
+
+static WBCACHE_ENTRY *find_entry(WBCACHE *c, uint32_t lba)
+{
+	WBCACHE_ENTRY *e;
+
+	for (e = c->hash[hash_lba(lba)]; e != NULL; e = e->next)
+		if (e->lba == lba)
+			return e;
+	return NULL;
+}
+
+static int cmp_snap(const void *a, const void *b)
+{
+	uint32_t la = ((const WBCACHE_SNAP *)a)->lba, lb = ((const WBCACHE_SNAP *)b)->lba;
+	return (la > lb) - (la < lb);
+}
+
+/**
+ * @brief	Write every cached sector back to the image.
+ *
+ * Sectors stay in the cache until the image has them, so a read racing with
+ * the write-back finds them in one place or the other. Any that were
+ * rewritten meanwhile are left dirty for next time.
+ */
+static void write_back(WBCACHE *c)
+{
+	WBCACHE_SNAP *snap;
+	uint8_t *buf;
+	size_t n = 0, i, run;
+	bool ok = true;
+
+	SDL_LockMutex(c->flushing);
+
+	// Copy out everything that's dirty, in LBA order
+	SDL_LockMutex(c->lock);
+	if (c->ndirty == 0) {
+		SDL_UnlockMutex(c->lock);
+		SDL_UnlockMutex(c->flushing);
+		return;
+	}
+	snap = malloc(c->ndirty * sizeof(*snap));
+	buf = malloc(c->ndirty * c->secsz);
+	if (snap == NULL || buf == NULL) {
+		SDL_UnlockMutex(c->lock);
+		fprintf(stderr, "NOTE: %s: out of memory writing back the disk cache.\n", c->name);
+		free(snap);
+		free(buf);
+		SDL_UnlockMutex(c->flushing);
+		return;
+	}
+	for (i = 0; i < WBCACHE_HASH_SIZE; i++) {
+		for (WBCACHE_ENTRY *e = c->hash[i]; e != NULL; e = e->next) {
+			snap[n].lba = e->lba;
+			snap[n].gen = e->gen;
+			n++;
+		}
+	}
+	qsort(snap, n, sizeof(*snap), cmp_snap);
+	for (i = 0; i < n; i++)
+		memcpy(buf + i * c->secsz, find_entry(c, snap[i].lba)->data, c->secsz);
+	SDL_UnlockMutex(c->lock);
+
+	// Write back runs of consecutive sectors
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && snap[i + run].lba == snap[i].lba + run; run++)
+			;
+		SDL_LockMutex(c->io);
+		if (!c->ops.write(c->arg, snap[i].lba, run, buf + i * c->secsz))
+			ok = false;
+		SDL_UnlockMutex(c->io);
+	}
+	if (c->ops.sync) {
+		SDL_LockMutex(c->io);
+		c->ops.sync(c->arg);
+		SDL_UnlockMutex(c->io);
+	}
+
+	// Drop the sectors which are now on the image and weren't rewritten
+	SDL_LockMutex(c->lock);
+	if (ok) {
+		for (i = 0; i < n; i++) {
+			WBCACHE_ENTRY **pe = &c->hash[hash_lba(snap[i].lba)];
+			while (*pe != NULL && (*pe)->lba != snap[i].lba)
+				pe = &(*pe)->next;
+			if (*pe != NULL && (*pe)->gen == snap[i].gen) {
+				WBCACHE_ENTRY *e = *pe;
+				*pe = e->next;
+				free(e);
+				c->ndirty--;
+			}
+		}
+	} else {
+		fprintf(stderr, "NOTE: %s: error writing back the disk cache; will retry.\n", c->name);
+	}
+	SDL_UnlockMutex(c->lock);
+
+	free(snap);
+	free(buf);
+	SDL_UnlockMutex(c->flushing);
+}
+
+static int wbcache_thread(void *arg)
+{
+	WBCACHE *c = arg;
+
+	SDL_LockMutex(c->lock);
+	while (!c->quit) {
+		bool due;
+
+		if (c->policy == WBCACHE_POLICY_EXIT)
+			SDL_CondWait(c->wake, c->lock);
+		else
+			SDL_CondWaitTimeout(c->wake, c->lock, c->delay_ms);
+		if (c->quit)
+			break;
+
+		switch (c->policy) {
+			case WBCACHE_POLICY_IDLE:
+				due = (c->ndirty > 0) && SDL_TICKS_PASSED(SDL_GetTicks(), c->last_write + c->delay_ms);
+				break;
+			case WBCACHE_POLICY_TIMER:
+				due = (c->ndirty > 0);
+				break;
+			default:
+				due = false;
+				break;
+		}
+		if (due || c->urgent) {
+			c->urgent = false;
+			SDL_UnlockMutex(c->lock);
+			write_back(c);
+			SDL_LockMutex(c->lock);
+		}
+	}
+	SDL_UnlockMutex(c->lock);
+
+	return 0;
+}
+
+WBCACHE *wbcache_new(const char *name, size_t secsz, const WBCACHE_OPS *ops, void *arg)
+{
+	const char *policy = fbc_get_string("disk_cache", "policy");
+	double delay = fbc_get_double("disk_cache", "delay");
+	int size = fbc_get_int("disk_cache", "size");
+	WBCACHE *c;
+
+	if (policy == NULL || strcmp(policy, "off") == 0)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	if (strcmp(policy, "idle") == 0) {
+		c->policy = WBCACHE_POLICY_IDLE;
+	} else if (strcmp(policy, "timer") == 0) {
+		c->policy = WBCACHE_POLICY_TIMER;
+	} else if (strcmp(policy, "exit") == 0) {
+		c->policy = WBCACHE_POLICY_EXIT;
+	} else {
+		fprintf(stderr, "NOTE: unknown disk cache policy '%s'; using 'idle'.\n", policy);
+		c->policy = WBCACHE_POLICY_IDLE;
+	}
+	if (delay <= 0.0)
+		delay = 1.0;
+	c->delay_ms = delay * 1000.0;
+	if (size < 1)
+		size = 1;
+	c->max_dirty = ((size_t)size * 1024) / secsz;
+	if (c->max_dirty < 4)
+		c->max_dirty = 4;
+
+	c->name = strdup(name);
+	c->secsz = secsz;
+	c->ops = *ops;
+	c->arg = arg;
+
+	c->lock = SDL_CreateMutex();
+	c->io = SDL_CreateMutex();
+	c->flushing = SDL_CreateMutex();
+	c->wake = SDL_CreateCond();
+	if (c->lock && c->io && c->flushing && c->wake)
+		c->thread = SDL_CreateThread(wbcache_thread, "wbcache", c);
+	if (!c->thread) {
+		fprintf(stderr, "NOTE: could not start disk cache thread (%s); %s is not cached.\n", SDL_GetError(), name);
+		if (c->lock) SDL_DestroyMutex(c->lock);
+		if (c->io) SDL_DestroyMutex(c->io);
+		if (c->flushing) SDL_DestroyMutex(c->flushing);
+		if (c->wake) SDL_DestroyCond(c->wake);
+		free(c->name);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+int wbcache_read(WBCACHE *c, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	int n;
+
+	// Holding the image lock across the overlay means a sector can't be
+	// written back and dropped between the two steps.
+	SDL_LockMutex(c->io);
+	n = c->ops.read(c->arg, lba, count, buf);
+	SDL_LockMutex(c->lock);
+	if (c->ndirty > 0) {
+		for (uint32_t i = 0; i < count; i++) {
+			WBCACHE_ENTRY *e = find_entry(c, lba + i);
+			if (e != NULL) {
+				memcpy(buf + i * c->secsz, e->data, c->secsz);
+				if (n >= 0 && (uint32_t)n < i + 1)
+					n = i + 1;
+			}
+		}
+	}
+	SDL_UnlockMutex(c->lock);
+	SDL_UnlockMutex(c->io);
+
+	return n;
+}
+
+void wbcache_write(WBCACHE *c, uint32_t lba, uint32_t count, const uint8_t *buf)
+{
+	bool full = false;
+	uint32_t stored;
+
+	SDL_LockMutex(c->lock);
+	for (stored = 0; stored < count; stored++) {
+		WBCACHE_ENTRY *e = find_entry(c, lba + stored);
+		if (e == NULL) {
+			e = malloc(sizeof(*e) + c->secsz);
+			if (e == NULL)
+				break;
+			e->lba = lba + stored;
+			e->next = c->hash[hash_lba(e->lba)];
+			c->hash[hash_lba(e->lba)] = e;
+			c->ndirty++;
+		}
+		memcpy(e->data, buf + stored * c->secsz, c->secsz);
+		e->gen = ++c->gen;
+	}
+	c->last_write = SDL_GetTicks();
+
+	// Start writing back early, and only make the guest wait if it's
+	// outrunning the flush thread.
+	if (c->ndirty >= c->max_dirty || stored < count) {
+		full = true;
+	} else if (c->ndirty >= (c->max_dirty * 3) / 4 && !c->urgent) {
+		c->urgent = true;
+		SDL_CondSignal(c->wake);
+	}
+	SDL_UnlockMutex(c->lock);
+
+	if (full)
+		write_back(c);
+
+	// Out of memory: the sectors which didn't fit go straight to the image
+	if (stored < count) {
+		SDL_LockMutex(c->io);
+		c->ops.write(c->arg, lba + stored, count - stored, buf + stored * c->secsz);
+		SDL_UnlockMutex(c->io);
+	}
+}
+
+void wbcache_flush(WBCACHE *c)
+{
+	write_back(c);
+}
+
+void wbcache_free(WBCACHE *c)
+{
+	if (c == NULL)
+		return;
+
+	SDL_LockMutex(c->lock);
+	c->quit = true;
+	SDL_CondSignal(c->wake);
+	SDL_UnlockMutex(c->lock);
+	SDL_WaitThread(c->thread, NULL);
+
+	write_back(c);
+	if (c->ndirty > 0)
+		fprintf(stderr, "NOTE: %s: %zu sectors could not be written back.\n", c->name, c->ndirty);
+
+	for (int i = 0; i < WBCACHE_HASH_SIZE; i++) {
+		while (c->hash[i] != NULL) {
+			WBCACHE_ENTRY *e = c->hash[i];
+			c->hash[i] = e->next;
+			free(e);
+		}
+	}
+	SDL_DestroyMutex(c->lock);
+	SDL_DestroyMutex(c->io);
+	SDL_DestroyMutex(c->flushing);
+	SDL_DestroyCond(c->wake);
+	free(c->name);
+	free(c);
+}
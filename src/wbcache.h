@@ -0,0 +1,73 @@
+#ifndef _WBCACHE_H
+#define _WBCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief	Write-back sector cache.
+ *
+ * Sits between a disc controller and its image. Written sectors are kept in
+ * memory and handed to the image later by a background thread, sorted and
+ * coalesced into runs of consecutive sectors, so a burst of guest writes
+ * becomes a few large host writes instead of one per sector.
+ *
+ * When the cache writes back is set by [disk_cache] policy:
+ *	"idle"	once no sector has been written for `delay` seconds
+ *	"timer"	every `delay` seconds
+ *	"exit"	only when the image is unloaded or the emulator exits
+ *	"off"	no cache; wbcache_new returns NULL
+ *
+ * Whatever the policy, the cache also writes back once it holds `size` KiB,
+ * and wbcache_flush and wbcache_free always write everything back before
+ * returning.
+ *
+ * All access to the image must go through the cache once it exists: the
+ * cache serialises it against the flush thread.
+ */
+
+/// Image access routines the cache writes back through
+typedef struct {
+	/// Read `count` sectors from `lba`. Returns the number of sectors read, or -1.
+	int (*read)(void *arg, uint32_t lba, uint32_t count, uint8_t *buf);
+	/// Write `count` sectors at `lba`. Returns false on error.
+	bool (*write)(void *arg, uint32_t lba, uint32_t count, const uint8_t *buf);
+	/// Push written sectors to the host disk. May be NULL.
+	void (*sync)(void *arg);
+} WBCACHE_OPS;
+
+typedef struct wbcache WBCACHE;
+
+/**
+ * @brief	Create a write-back cache, as configured in [disk_cache].
+ * @param	name	Image name, for messages.
+ * @param	secsz	Sector size in bytes.
+ * @param	ops		Image access routines.
+ * @param	arg		Passed to the access routines.
+ * @return	New cache, or NULL if caching is off or couldn't be started.
+ */
+WBCACHE *wbcache_new(const char *name, size_t secsz, const WBCACHE_OPS *ops, void *arg);
+
+/**
+ * @brief	Read sectors, from the cache where they've been written.
+ * @return	Number of sectors read, or -1 on error.
+ */
+int wbcache_read(WBCACHE *c, uint32_t lba, uint32_t count, uint8_t *buf);
+
+/**
+ * @brief	Write sectors into the cache.
+ */
+void wbcache_write(WBCACHE *c, uint32_t lba, uint32_t count, const uint8_t *buf);
+
+/**
+ * @brief	Write back every cached sector and sync the image.
+ */
+void wbcache_flush(WBCACHE *c);
+
+/**
+ * @brief	Write back, stop the flush thread and free the cache. NULL is ignored.
+ */
+void wbcache_free(WBCACHE *c);
+
+#endif
@@ -3,9 +3,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <arpa/inet.h>
-#include "SDL.h"
 #include "musashi/m68k.h"
+#include "fbconfig.h"
+#include "sched.h"
 #include "wd2010.h"
 
 //#define WD2010_DEBUG
@@ -15,6 +17,10 @@
 #endif
 #include "utils.h"
 
+// Size of the first block of the image, which holds the disk label
+#define WD2010_LABEL_SIZE 512
+
+// Time taken by a seek or restore, in milliseconds of emulated time
 #ifndef WD2010_SEEK_DELAY
 #define WD2010_SEEK_DELAY 30
 #endif
@@ -50,9 +56,14 @@
 #endif
 
 extern int cpu_log_enabled;
-static int wd2010_default_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int heads);
-static int wd2010_disk_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum);
-static int wd2010_pre_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum);
+static int wd2010_default_init(WD2010_CTX *ctx, HD_IMAGE *img, int drivenum, int secsz, int spt, int heads);
+static int wd2010_disk_label_init(WD2010_CTX *ctx, const uint8_t *block0, int drivenum);
+static int wd2010_pre_label_init(WD2010_CTX *ctx, const uint8_t *block0, int drivenum);
+static void wd2010_io_work(DISKIO_REQ *req);
+static void wd2010_io_complete(DISKIO_REQ *req);
+static void seek_complete(void *arg);
+static void transfer_seek_complete(void *arg);
+static void wd2010_ra_invalidate(WD2010_CTX *ctx, int drive, uint64_t offset, uint64_t len);
 
 /// WD2010 command constants
 enum {
@@ -67,17 +78,10 @@ enum {
 };
 
 
-static int wd2010_default_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int heads)
+static int wd2010_default_init(WD2010_CTX *ctx, HD_IMAGE *img, int drivenum, int secsz, int spt, int heads)
 {
-	size_t filesize;
-
-	// Start by finding out how big the image file is
-	fseek(fp, 0, SEEK_END);
-	filesize = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-
-	// Now figure out how many tracks it contains
-	unsigned int tracks = filesize / secsz / spt / heads;
+	// Figure out how many tracks the image contains
+	unsigned int tracks = img->size / secsz / spt / heads;
 	// Confirm...
 	if (tracks < 1 || tracks > 1400) {
 		if (tracks > 1400) {
@@ -96,9 +100,8 @@ static int wd2010_default_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secs
 	return WD2010_ERR_OK;
 }
 
-static int wd2010_disk_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum)
+static int wd2010_disk_label_init(WD2010_CTX *ctx, const uint8_t *block0, int drivenum)
 {
-	ssize_t count;
 	/*
 	 * As seen in the s4 utils, the UNIX PC was ahead of most of its
 	 * contemporaries, sporting a disk label describing the disk's geometry.
@@ -118,12 +121,7 @@ static int wd2010_disk_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum)
 	}  __attribute__((__packed__));
 	struct s4_dswprt disk_label;
 
-	(void) fseek(fp, 0L, SEEK_SET);
-	if ((count = fread(& disk_label, 1, sizeof(disk_label), fp)) != sizeof(disk_label)) {
-		fprintf(stderr, "I/O error reading disk image: %s\n", strerror(errno));
-		return WD2010_ERR_IO_ERROR;
-	}
-	(void) fseek(fp, 0L, SEEK_SET);
+	memcpy(& disk_label, block0, sizeof(disk_label));
 
 	drivenum = drivenum ? 1 : 0;	// force to 1 or 0
 	// convert big endian data to native data
@@ -135,25 +133,25 @@ static int wd2010_disk_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum)
 	return WD2010_ERR_OK;
 }
 
-static int wd2010_pre_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum)
+static int wd2010_pre_label_init(WD2010_CTX *ctx, const uint8_t *block0, int drivenum)
 {
 	int numheads, numcyls, blocks_per_track, block_size;
 	int count;
-	char buffer[BUFSIZ];
+	char buffer[WD2010_LABEL_SIZE + 1];
+	char *line;
 
-	(void) fseek(fp, 0L, SEEK_SET);
-	(void) fgets(buffer, sizeof(buffer), fp);	// skip magic
+	memcpy(buffer, block0, WD2010_LABEL_SIZE);
+	buffer[WD2010_LABEL_SIZE] = '\0';
 
-	if (fgets(buffer, sizeof(buffer), fp) == NULL)
+	// skip magic
+	if ((line = strchr(buffer, '\n')) == NULL)
 		return WD2010_ERR_IO_ERROR;
 
-	count = sscanf(buffer, "heads: %d cyls: %d bpt: %d blksiz: %d",
+	count = sscanf(line + 1, "heads: %d cyls: %d bpt: %d blksiz: %d",
 			& numheads, & numcyls, & blocks_per_track, & block_size);
 	if (count != 4)
 		return WD2010_ERR_BAD_GEOM;
 
-	(void) fseek(fp, 0L, SEEK_SET);
-
 	drivenum = drivenum ? 1 : 0;	// force to 1 or 0
 	ctx->geometry[drivenum].tracks = numcyls;
 	ctx->geometry[drivenum].secsz = block_size;
@@ -164,10 +162,10 @@ static int wd2010_pre_label_init(WD2010_CTX *ctx, FILE *fp, int drivenum)
 }
 
 
-int wd2010_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int heads)
+int wd2010_init(WD2010_CTX *ctx, HD_IMAGE *img, int drivenum, int secsz, int spt, int heads)
 {
 	int result;
-	char magic[4];
+	uint8_t block0[WD2010_LABEL_SIZE];
 
 	wd2010_reset(ctx);
 
@@ -175,16 +173,17 @@ int wd2010_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int
 	// if UNIX PC magic, get real geometry
 	// else if early magic, get user-specified geometry
 	// else do default settings
-	(void) fseek(fp, 0L, SEEK_SET);
-	if (fread(magic, 1, 4, fp) != 4)
+	if (hdimg_read(img, block0, sizeof(block0), 0) != sizeof(block0)) {
+		fprintf(stderr, "I/O error reading disk image: %s\n", strerror(errno));
 		return WD2010_ERR_IO_ERROR;
+	}
 
-	if (strncmp(magic, "UQVQ", 4) == 0) {
-		result = wd2010_disk_label_init(ctx, fp, drivenum);
-	} else if (strncmp(magic, "free", 4) == 0) {
-		result = wd2010_pre_label_init(ctx, fp, drivenum);
+	if (memcmp(block0, "UQVQ", 4) == 0) {
+		result = wd2010_disk_label_init(ctx, block0, drivenum);
+	} else if (memcmp(block0, "free", 4) == 0) {
+		result = wd2010_pre_label_init(ctx, block0, drivenum);
 	} else {
-		result = wd2010_default_init(ctx, fp, drivenum, secsz, spt, heads);
+		result = wd2010_default_init(ctx, img, drivenum, secsz, spt, heads);
 	}
 
 	if (result != WD2010_ERR_OK) return result;
@@ -202,8 +201,21 @@ int wd2010_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int
 	if (!ctx->data[drivenum])
 		return WD2010_ERR_NO_MEMORY;
 
-	(void) fseek(fp, 0L, SEEK_SET);
-	ctx->disc_image[drivenum] = fp;
+	// Allocate the read-ahead buffer; without one, reads go straight to the image
+	free(ctx->ra_buf[drivenum]);
+	ctx->ra_buf[drivenum] = NULL;
+	ctx->ra_size[drivenum] = ctx->ra_len[drivenum] = 0;
+	if (fbc_get_int("hard_disk", "readahead") > 0) {
+		ctx->ra_size[drivenum] = (size_t)fbc_get_int("hard_disk", "readahead") *
+			ctx->geometry[drivenum].secsz * ctx->geometry[drivenum].spt;
+		ctx->ra_buf[drivenum] = malloc(ctx->ra_size[drivenum]);
+		if (!ctx->ra_buf[drivenum])
+			ctx->ra_size[drivenum] = 0;
+	}
+
+	ctx->disc_image[drivenum] = img;
+	disktrace_set_size(DISKTRACE_HDD, drivenum,
+			ctx->geometry[drivenum].tracks * ctx->geometry[drivenum].heads * ctx->geometry[drivenum].spt);
 
 	return result;
 }
@@ -211,6 +223,16 @@ int wd2010_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int
 
 void wd2010_reset(WD2010_CTX *ctx)
 {
+	// Let any image access finish before the state it updates is cleared
+	diskio_finish(&ctx->io);
+	ctx->io.work = wd2010_io_work;
+	ctx->io.complete = wd2010_io_complete;
+	ctx->io.ctx = ctx;
+
+	// Forget any seek in progress
+	sched_cancel(seek_complete, ctx);
+	sched_cancel(transfer_seek_complete, ctx);
+
 	// track, head and sector unknown
 	ctx->track = ctx->head = ctx->sector = 0;
 
@@ -239,13 +261,22 @@ void wd2010_done(WD2010_CTX *ctx)
 	// Reset the WD2010
 	wd2010_reset(ctx);
 
+	if (ctx->ra_hits + ctx->ra_misses > 0) {
+		printf("Hard disk read-ahead: %llu of %llu reads served from memory\n",
+				(unsigned long long)ctx->ra_hits, (unsigned long long)(ctx->ra_hits + ctx->ra_misses));
+	}
+
 	// Free any allocated memory
 	for (i = 0; i < 2; i++) {
 		if (ctx->data[i]) {
 			free(ctx->data[i]);
 			ctx->data[i] = NULL;
 		}
+		free(ctx->ra_buf[i]);
+		ctx->ra_buf[i] = NULL;
+		ctx->ra_size[i] = ctx->ra_len[i] = 0;
 	}
+	ctx->ra_hits = ctx->ra_misses = 0;
 }
 
 
@@ -305,37 +336,146 @@ void wd2010_write_data(WD2010_CTX *ctx, uint8_t val)
 		ctx->data[ctx->mcr2_ddrive1][ctx->data_pos++] = val;
 		// set IRQ and write data if this is the last data byte
 		if (ctx->data_pos == ctx->data_len) {
+			ctx->drq = false;
 			if (!ctx->formatting){
-				fseek(ctx->disc_image[ctx->mcr2_ddrive1], ctx->write_pos, SEEK_SET);
-				fwrite(ctx->data[ctx->mcr2_ddrive1], 1, ctx->data_len, ctx->disc_image[ctx->mcr2_ddrive1]);
-				fflush(ctx->disc_image[ctx->mcr2_ddrive1]);
+				// Write to the image; wd2010_io_complete() sets IRQ
+				ctx->io_write = true;
+				ctx->io_drive = ctx->mcr2_ddrive1;
+				ctx->io_offset = ctx->write_pos;
+				ctx->io_len = ctx->data_len;
+				ctx->write_pos = -1;
+				ctx->status = SR_BUSY | SR_COMMAND_IN_PROGRESS;
+				diskio_submit(&ctx->io);
+				return;
 			}
+			// The sectors being formatted can't be in the read-ahead buffer any more
+			wd2010_ra_invalidate(ctx, ctx->mcr2_ddrive1, ctx->write_pos,
+					(uint64_t)ctx->geometry[ctx->mcr2_ddrive1].secsz * ctx->geometry[ctx->mcr2_ddrive1].spt);
+			disktrace_log(DISKTRACE_HDD, ctx->mcr2_ddrive1, DISKTRACE_FORMAT, ctx->io_cmd,
+					ctx->track, ctx->head, 0, ctx->write_pos / ctx->geometry[ctx->mcr2_ddrive1].secsz,
+					ctx->geometry[ctx->mcr2_ddrive1].spt, sched_now(), 0);
 			ctx->formatting = false;
 			ctx->status = SR_READY | SR_SEEK_COMPLETE;
 			// Set IRQ and reset write pointer
 			ctx->irq = true;
 			ctx->write_pos = -1;
-			ctx->drq = false;
-			LOG("WD2010: write done");
+			LOG("WD2010: format done");
 		}
 	}else{
 		LOGS("WD2010: attempt to write to data buffer without a write command in progress");
 	}
 }
 
-uint32_t seek_complete(uint32_t interval, WD2010_CTX *ctx)
+/*
+ * Read-ahead. A read which misses fetches from the requested sector to the
+ * end of the track, plus any further tracks configured by [hard_disk]
+ * readahead, so the guest's next reads on the track come from memory.
+ * The buffer is only touched by the work routine, or while no request is in
+ * flight, so it needs no locking.
+ */
+static void wd2010_ra_invalidate(WD2010_CTX *ctx, int drive, uint64_t offset, uint64_t len)
+{
+	if (offset < ctx->ra_start[drive] + ctx->ra_len[drive] && ctx->ra_start[drive] < offset + len)
+		ctx->ra_len[drive] = 0;
+}
+
+static ssize_t wd2010_ra_read(WD2010_CTX *ctx, int drive, uint8_t *buf, size_t len, uint64_t offset)
 {
-	/*m68k_end_timeslice();*/
+	HD_IMAGE *img = ctx->disc_image[drive];
+	uint64_t track_bytes = (uint64_t)ctx->geometry[drive].secsz * ctx->geometry[drive].spt;
+	uint64_t end;
+	ssize_t n;
+
+	if (ctx->ra_buf[drive] == NULL || len > ctx->ra_size[drive])
+		return hdimg_read(img, buf, len, offset);
+
+	if (offset >= ctx->ra_start[drive] && offset + len <= ctx->ra_start[drive] + ctx->ra_len[drive]) {
+		ctx->ra_hits++;
+		memcpy(buf, ctx->ra_buf[drive] + (offset - ctx->ra_start[drive]), len);
+		return len;
+	}
+	ctx->ra_misses++;
+
+	// Fill the buffer from here to the end of the read-ahead window
+	end = offset - (offset % track_bytes) + ctx->ra_size[drive];
+	if (end > img->size)
+		end = img->size;
+	if (end < offset + len)
+		end = offset + len;
+	ctx->ra_len[drive] = 0;
+	n = hdimg_read(img, ctx->ra_buf[drive], end - offset, offset);
+	if (n < (ssize_t)len) {
+		if (n > 0)
+			memcpy(buf, ctx->ra_buf[drive], n);
+		return n;
+	}
+	ctx->ra_start[drive] = offset;
+	ctx->ra_len[drive] = n;
+	memcpy(buf, ctx->ra_buf[drive], len);
+	return len;
+}
+
+/*
+ * Image access for a command, via diskio. The work routine may run on the
+ * I/O thread, so it touches only the data buffer and the io_* fields.
+ */
+static void wd2010_io_work(DISKIO_REQ *req)
+{
+	WD2010_CTX *ctx = req->ctx;
+	HD_IMAGE *img = ctx->disc_image[ctx->io_drive];
+	uint8_t *buf = ctx->data[ctx->io_drive];
+
+	if (ctx->io_write) {
+		wd2010_ra_invalidate(ctx, ctx->io_drive, ctx->io_offset, ctx->io_len);
+		ctx->io_result = hdimg_write(img, buf, ctx->io_len, ctx->io_offset);
+	} else {
+		ctx->io_result = wd2010_ra_read(ctx, ctx->io_drive, buf, ctx->io_len, ctx->io_offset);
+	}
+}
+
+static void wd2010_io_complete(DISKIO_REQ *req)
+{
+	WD2010_CTX *ctx = req->ctx;
+	int secsz = ctx->geometry[ctx->io_drive].secsz;
+
+	disktrace_log(DISKTRACE_HDD, ctx->io_drive, ctx->io_write ? DISKTRACE_WRITE : DISKTRACE_READ, ctx->io_cmd,
+			ctx->io_cyl, ctx->io_head, ctx->io_sect, ctx->io_offset / secsz, ctx->io_len / secsz,
+			req->submitted, req->host_usec);
+
+	if (ctx->io_write) {
+		ctx->status = SR_READY | SR_SEEK_COMPLETE;
+		ctx->irq = true;
+		LOG("WD2010: write done");
+		return;
+	}
+
+	// TODO: check the read length! if short, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
+	ctx->data_len = (ctx->io_result > 0) ? ctx->io_result : 0;
+	LOG("\tREAD len=%zu, pos=%zu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geometry[ctx->io_drive].secsz);
+
+	ctx->status = 0;
+	ctx->status |= (ctx->data_pos < ctx->data_len) ? SR_DRQ | SR_COMMAND_IN_PROGRESS | SR_BUSY : 0x00;
+	/*sched_add(SCHED_MSEC(WD2010_SEEK_DELAY), transfer_seek_complete, ctx);*/
+	ctx->drq = true;
+}
+
+/*
+ * Seek timing. These run from the emulated-time event queue, on the
+ * emulation thread, WD2010_SEEK_DELAY ms of emulated time after the command.
+ */
+static void seek_complete(void *arg)
+{
+	WD2010_CTX *ctx = arg;
+
 	ctx->status = SR_READY | SR_SEEK_COMPLETE;
 	ctx->irq = true;
-	return (0);
 }
 
-uint32_t transfer_seek_complete(uint32_t interval, WD2010_CTX *ctx)
+static void transfer_seek_complete(void *arg)
 {
-	/*m68k_end_timeslice();*/
+	WD2010_CTX *ctx = arg;
+
 	ctx->drq = true;
-	return (0);
 }
 
 uint8_t wd2010_read_reg(WD2010_CTX *ctx, uint8_t addr)
@@ -373,6 +513,9 @@ uint8_t wd2010_read_reg(WD2010_CTX *ctx, uint8_t addr)
 			// HDC is busy if there is still data in the buffer
 			temp |= (ctx->data_pos < ctx->data_len) ? SR_BUSY : 0;	// if data in buffer, then DMA hasn't copied it yet, and we're still busy!
 																	// TODO: also if seek delay / read delay hasn't passed (but that's for later)
+			// ... or if the image access for the command hasn't finished
+			if (diskio_pending(&ctx->io))
+				temp |= SR_BUSY;
 			/*XXX: should anything else be set here?*/
 			return temp;
 		default:
@@ -427,6 +570,10 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 			ctx->sdh = val;
 			break;
 		case WD2010_REG_COMMAND:	// Command register
+			// Finish off the previous command's image access first
+			diskio_finish(&ctx->io);
+			ctx->io_cmd = val;
+
 			// write to command register clears interrupt request
 			ctx->irq = false;
 			ctx->error_reg = 0;
@@ -436,7 +583,8 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 				case CMD_RESTORE:
 					// Restore. Set track to 0 and throw an IRQ.
 					ctx->track = 0;
-					SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_TimerCallback)seek_complete, ctx);
+					disktrace_log(DISKTRACE_HDD, ctx->mcr2_ddrive1, DISKTRACE_SEEK, val, 0, 0, 0, 0, 0, sched_now(), 0);
+					sched_add(SCHED_MSEC(WD2010_SEEK_DELAY), seek_complete, ctx);
 					break;
 				case CMD_SCAN_ID:
 					ctx->cylinder_high_reg = (ctx->track >> 8) & CYLH_MASK;
@@ -467,7 +615,10 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 					ctx->formatting = cmd == CMD_WRITE_FORMAT;
 					switch (cmd){
 						case CMD_SEEK:
-							SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_TimerCallback)seek_complete, ctx);
+							disktrace_log(DISKTRACE_HDD, ctx->mcr2_ddrive1, DISKTRACE_SEEK, val, ctx->track, ctx->head, 0,
+									ctx->track * ctx->geometry[ctx->mcr2_ddrive1].heads * ctx->geometry[ctx->mcr2_ddrive1].spt,
+									0, sched_now(), 0);
+							sched_add(SCHED_MSEC(WD2010_SEEK_DELAY), seek_complete, ctx);
 							break;
 						case CMD_READ_SECTOR:
 							/*XXX: does a separate function to set the head have to be added?*/
@@ -500,25 +651,25 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 								ctx->multi_sector = 0;
 								sector_count = 1;
 							}
-							for (int i=0; i<sector_count; i++) {
-								// Calculate the LBA address of the required sector
-								// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
-								lba = (((ctx->track * ctx->geometry[ctx->mcr2_ddrive1].heads * ctx->geometry[ctx->mcr2_ddrive1].spt) + (ctx->head * ctx->geometry[ctx->mcr2_ddrive1].spt) + ctx->sector) + i);
-								// convert LBA to byte address
-								lba *= ctx->geometry[ctx->mcr2_ddrive1].secsz;
-								LOG("\tREAD lba = %zu", lba);
-
-								// Read the sector from the file
-								fseek(ctx->disc_image[ctx->mcr2_ddrive1], lba, SEEK_SET);
-								// TODO: check fread return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
-								ctx->data_len += fread(&ctx->data[ctx->mcr2_ddrive1][ctx->data_len], 1, ctx->geometry[ctx->mcr2_ddrive1].secsz, ctx->disc_image[ctx->mcr2_ddrive1]);
-								LOG("\tREAD len=%zu, pos=%zu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geometry[ctx->mcr2_ddrive1].secsz);
-							}
-
-							ctx->status = 0;
-							ctx->status |= (ctx->data_pos < ctx->data_len) ? SR_DRQ | SR_COMMAND_IN_PROGRESS | SR_BUSY : 0x00;
-							/*SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_TimerCallback)transfer_seek_complete, ctx);*/
-							ctx->drq = true;
+							// Calculate the LBA address of the first sector. The rest follow on
+							// from it, so the whole transfer is one read from the image.
+							// LBA = (C * nHeads * nSectors) + (H * nSectors) + S - 1
+							lba = ((ctx->track * ctx->geometry[ctx->mcr2_ddrive1].heads * ctx->geometry[ctx->mcr2_ddrive1].spt) + (ctx->head * ctx->geometry[ctx->mcr2_ddrive1].spt) + ctx->sector);
+							// convert LBA to byte address
+							lba *= ctx->geometry[ctx->mcr2_ddrive1].secsz;
+							LOG("\tREAD lba = %zu", lba);
+
+							// Read from the image; wd2010_io_complete() sets DRQ
+							ctx->io_write = false;
+							ctx->io_drive = ctx->mcr2_ddrive1;
+							ctx->io_offset = lba;
+							ctx->io_len = (size_t)ctx->geometry[ctx->mcr2_ddrive1].secsz * sector_count;
+							ctx->io_cyl = ctx->track;
+							ctx->io_head = ctx->head;
+							ctx->io_sect = ctx->sector;
+							ctx->drq = false;
+							ctx->status = SR_BUSY | SR_COMMAND_IN_PROGRESS;
+							diskio_submit(&ctx->io);
 
 							break;
 						case CMD_WRITE_FORMAT:
@@ -557,10 +708,14 @@ void wd2010_write_reg(WD2010_CTX *ctx, uint8_t addr, uint8_t val)
 							// convert LBA to byte address
 							ctx->write_pos = (lba *= ctx->geometry[ctx->mcr2_ddrive1].secsz);
 							LOG("\tWRITE lba = %zu", lba);
+							// For the trace; the registers may change before the write completes
+							ctx->io_cyl = ctx->track;
+							ctx->io_head = ctx->head;
+							ctx->io_sect = ctx->sector;
 
 							ctx->status = 0;
 							ctx->status |= (ctx->data_pos < ctx->data_len) ? SR_DRQ | SR_COMMAND_IN_PROGRESS | SR_BUSY : 0x00;
-							/*SDL_AddTimer(WD2010_SEEK_DELAY, (SDL_TimerCallback)transfer_seek_complete, ctx);*/
+							/*sched_add(SCHED_MSEC(WD2010_SEEK_DELAY), transfer_seek_complete, ctx);*/
 							ctx->drq = true;
 
 							break;
@@ -5,6 +5,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "diskio.h"
+#include "disktrace.h"
+#include "hdimg.h"
 
 /// WD2010 registers
 typedef enum {
@@ -58,21 +61,36 @@ typedef struct {
 	// Data buffer, current DRQ pointer and length
 	uint8_t					*data[2];
 	size_t					data_pos, data_len;
-	// Current disc image file
-	FILE					*disc_image[2];
+	// Current disc images
+	HD_IMAGE				*disc_image[2];
 	// LBA at which to start writing
 	int						write_pos;
 	// Flag to allow delaying DRQ
 	bool					drq;
+	// Image access for the current command, and its parameters
+	DISKIO_REQ				io;
+	uint8_t					io_cmd;
+	bool					io_write;
+	int						io_drive;
+	size_t					io_offset, io_len;
+	int						io_cyl, io_head, io_sect;
+	ssize_t					io_result;
+	// Read-ahead buffer for each drive, and the part of the image it holds
+	uint8_t					*ra_buf[2];
+	size_t					ra_size[2];
+	uint64_t				ra_start[2], ra_len[2];
+	uint64_t				ra_hits, ra_misses;
 } WD2010_CTX;
 
 /**
  * @brief	Initialise a WD2010 context.
  * @param	ctx		WD2010 context.
+ * @param	img		Disc image for this drive.
+ * @param	drivenum	Drive number, 0 or 1.
  *
  * This must be run once when the context is created.
  */
-int wd2010_init(WD2010_CTX *ctx, FILE *fp, int drivenum, int secsz, int spt, int heads);
+int wd2010_init(WD2010_CTX *ctx, HD_IMAGE *img, int drivenum, int secsz, int spt, int heads);
 
 /**
  * @brief	Reset a WD2010 context.
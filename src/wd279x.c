@@ -1,7 +1,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include "musashi/m68k.h"
+#include "sched.h"
 #include "wd279x.h"
 #include "diskimg.h"
 
@@ -33,6 +35,9 @@ enum {
 	CMD_FORMAT_TRACK		= 0xF0		///< Format Track
 };
 
+static void fdc_io_work(DISKIO_REQ *req);
+static void fdc_io_complete(DISKIO_REQ *req);
+
 
 void wd2797_init(WD2797_CTX *ctx)
 {
@@ -63,12 +68,22 @@ void wd2797_init(WD2797_CTX *ctx)
 	// No disc image loaded
 	ctx->disc_image = NULL;
 	ctx->dif = NULL;
+	ctx->cache = NULL;
 	ctx->geom_secsz = ctx->geom_spt = ctx->geom_heads = ctx->geom_tracks = 0;
+
+	// No image access in progress
+	memset(&ctx->io, 0, sizeof(ctx->io));
+	ctx->io.work = fdc_io_work;
+	ctx->io.complete = fdc_io_complete;
+	ctx->io.ctx = ctx;
 }
 
 
 void wd2797_reset(WD2797_CTX *ctx)
 {
+	// Let any image access finish before the state it updates is cleared
+	diskio_finish(&ctx->io);
+
 	// track, head and sector unknown
 	ctx->track = ctx->head = ctx->sector = 0;
 	ctx->track_reg = 0;
@@ -114,6 +129,123 @@ bool wd2797_get_drq(WD2797_CTX *ctx)
 }
 
 
+/*
+ * Image access for the write-back cache, which works in LBAs counted from 0.
+ */
+
+static int cache_read_sectors(void *arg, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+	WD2797_CTX *ctx = arg;
+
+	for (uint32_t i = 0; i < count; i++, lba++) {
+		int cyl = lba / (ctx->geom_heads * ctx->geom_spt);
+		int head = (lba / ctx->geom_spt) % ctx->geom_heads;
+		int sect = (lba % ctx->geom_spt) + 1;
+		if (ctx->dif->read_sector(ctx->dif, cyl, head, sect, &buf[i * ctx->geom_secsz]) != (size_t)ctx->geom_secsz)
+			return i;
+	}
+	return count;
+}
+
+static bool cache_write_sectors(void *arg, uint32_t lba, uint32_t count, const uint8_t *buf)
+{
+	WD2797_CTX *ctx = arg;
+
+	for (uint32_t i = 0; i < count; i++, lba++) {
+		int cyl = lba / (ctx->geom_heads * ctx->geom_spt);
+		int head = (lba / ctx->geom_spt) % ctx->geom_heads;
+		int sect = (lba % ctx->geom_spt) + 1;
+		ctx->dif->write_sector(ctx->dif, cyl, head, sect, (uint8_t *)&buf[i * ctx->geom_secsz]);
+	}
+	return true;
+}
+
+static void cache_sync(void *arg)
+{
+	WD2797_CTX *ctx = arg;
+
+	fflush(ctx->disc_image);
+}
+
+static const WBCACHE_OPS cache_ops = {
+	.read = cache_read_sectors,
+	.write = cache_write_sectors,
+	.sync = cache_sync
+};
+
+/// Read a sector, through the cache if there is one
+static size_t fdc_read_sector(WD2797_CTX *ctx, int cyl, int head, int sect, uint8_t *data)
+{
+	if (ctx->cache) {
+		uint32_t lba = (cyl * ctx->geom_heads * ctx->geom_spt) + (head * ctx->geom_spt) + sect - 1;
+		return (wbcache_read(ctx->cache, lba, 1, data) == 1) ? (size_t)ctx->geom_secsz : 0;
+	}
+	return ctx->dif->read_sector(ctx->dif, cyl, head, sect, data);
+}
+
+/// Write a sector, through the cache if there is one
+static void fdc_write_sector(WD2797_CTX *ctx, int cyl, int head, int sect, uint8_t *data)
+{
+	if (ctx->cache) {
+		uint32_t lba = (cyl * ctx->geom_heads * ctx->geom_spt) + (head * ctx->geom_spt) + sect - 1;
+		wbcache_write(ctx->cache, lba, 1, data);
+		return;
+	}
+	ctx->dif->write_sector(ctx->dif, cyl, head, sect, data);
+}
+
+
+/*
+ * Image access for a command, via diskio. The work routine may run on the
+ * I/O thread, so it touches only the data buffer and the io_* fields.
+ */
+static void fdc_io_work(DISKIO_REQ *req)
+{
+	WD2797_CTX *ctx = req->ctx;
+
+	if (ctx->io_write) {
+		fdc_write_sector(ctx, ctx->io_cyl, ctx->io_head, ctx->io_sect, ctx->data);
+		return;
+	}
+
+	ctx->io_len = 0;
+	for (int i=0; i<ctx->io_count; i++) {
+		LOG("\tREAD C,H,S = %i,%i,%i", ctx->io_cyl, ctx->io_head, ctx->io_sect+i);
+
+		// Read the sector from the file
+		ctx->io_len += fdc_read_sector(ctx, ctx->io_cyl, ctx->io_head, ctx->io_sect+i, &ctx->data[ctx->io_len]);
+		// TODO: check read_sector return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
+	}
+}
+
+static void fdc_io_complete(DISKIO_REQ *req)
+{
+	WD2797_CTX *ctx = req->ctx;
+	uint32_t lba = (ctx->io_cyl * ctx->geom_heads * ctx->geom_spt) + (ctx->io_head * ctx->geom_spt) + ctx->io_sect - 1;
+
+	disktrace_log(DISKTRACE_FDD, 0, ctx->io_write ? DISKTRACE_WRITE : DISKTRACE_READ, ctx->io_cmd,
+			ctx->io_cyl, ctx->io_head, ctx->io_sect, lba, ctx->io_count, req->submitted, req->host_usec);
+
+	if (ctx->io_write) {
+		// Set IRQ now the sector is on the disc
+		ctx->irq = true;
+		return;
+	}
+
+	ctx->data_len = ctx->io_len;
+	LOG("\tREAD len=%lu, pos=%lu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geom_secsz);
+
+	ctx->status = 0;
+	// B6 = 0
+	// B5 = Record Type -- 1 = deleted, 0 = normal. We can't emulate anything but normal data blocks.
+	// B4 = Record Not Found. Basically, the CHS parameters are bullcrap.
+	// B3 = CRC Error. Not possible.
+	// B2 = Lost Data. Caused if DRQ isn't serviced in time. FIXME-not emulated
+	// B1 = DRQ. Data request.
+	ctx->status |= (ctx->data_pos < ctx->data_len) ? 0x02 : 0x00;
+}
+
+
 WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int heads, int tracks, int writeable)
 {
 	uint8_t buf[4];
@@ -146,10 +278,15 @@ WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int heads, int trac
 	// Load the image and the geometry data
 	ctx->disc_image = fp;
 	ctx->geom_tracks = tracks;
+	disktrace_set_size(DISKTRACE_FDD, 0, tracks * heads * ctx->geom_spt);
 	ctx->geom_secsz = secsz;
 	ctx->geom_heads = heads;
 	ctx->writeable = writeable;
 
+	// Only writes are cached, so read-only images don't need it
+	if (writeable)
+		ctx->cache = wbcache_new("floppy", secsz, &cache_ops, ctx);
+
 	printf("Floppy image loaded (%s, %i sectors/track).\n", (ctx->dif == &imd_format) ? "ImageDisk" : "raw", ctx->geom_spt);
 	return WD2797_ERR_OK;
 }
@@ -157,6 +294,13 @@ WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int heads, int trac
 
 void wd2797_unload(WD2797_CTX *ctx)
 {
+	// Finish any image access in progress
+	diskio_finish(&ctx->io);
+
+	// Write back anything still cached while the image is still there
+	wbcache_free(ctx->cache);
+	ctx->cache = NULL;
+
 	// Free memory buffer
 	if (ctx->data) {
 		free(ctx->data);
@@ -196,7 +340,10 @@ uint8_t wd2797_read_reg(WD2797_CTX *ctx, uint8_t addr)
 			}
 			// FDC is busy if there is still data in the buffer
 			temp |= (ctx->data_pos < ctx->data_len) ? 0x81 : 0x00;	// if data in buffer, then DMA hasn't copied it yet, and we're still busy!
-																	// TODO: also if seek delay / read delay hasn't passed (but that's for later)
+																	// TODO: also if seek delay hasn't passed (but that's for later)
+			// ... or if the image access for the command hasn't finished
+			if (diskio_pending(&ctx->io))
+				temp |= 0x01;
 			return temp;
 
 		case WD2797_REG_TRACK:		// Track register
@@ -242,6 +389,10 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 			LOG("WD279X: command %x", val);		
 			ctx->irq = false;
 
+			// Finish off the previous command's image access first
+			diskio_finish(&ctx->io);
+			ctx->io_cmd = val;
+
 			// Is the drive ready?
 			if (ctx->disc_image == NULL) {
 				// No disc image, thus the drive is busy.
@@ -307,6 +458,9 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 			}
 
 			if (is_type1) {
+				disktrace_log(DISKTRACE_FDD, 0, DISKTRACE_SEEK, val, ctx->track, ctx->head, 0,
+						ctx->track * ctx->geom_heads * ctx->geom_spt, 0, sched_now(), 0);
+
 				// Terminate any sector reads or writes
 				ctx->data_len = ctx->data_pos = 0;
 
@@ -416,23 +570,14 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 					else
 						temp = 1;
 
-					for (int i=0; i<temp; i++) {
-						LOG("\tREAD C,H,S = %i,%i,%i", ctx->track, ctx->head, ctx->sector+i);
-
-						// Read the sector from the file
-						ctx->data_len += ctx->dif->read_sector(ctx->dif, ctx->track, ctx->head, ctx->sector+i, &ctx->data[ctx->data_len]);
-						// TODO: check read_sector return value! if < secsz, BAIL! (call it a crc error or secnotfound maybe? also log to stderr)
-						LOG("\tREAD len=%lu, pos=%lu, ssz=%d", ctx->data_len, ctx->data_pos, ctx->geom_secsz);
-					}
-
+					// Read the sectors from the image; fdc_io_complete() sets DRQ
+					ctx->io_write = false;
+					ctx->io_cyl = ctx->track;
+					ctx->io_head = ctx->head;
+					ctx->io_sect = ctx->sector;
+					ctx->io_count = temp;
 					ctx->status = 0;
-					// B6 = 0
-					// B5 = Record Type -- 1 = deleted, 0 = normal. We can't emulate anything but normal data blocks.
-					// B4 = Record Not Found. Basically, the CHS parameters are bullcrap.
-					// B3 = CRC Error. Not possible.
-					// B2 = Lost Data. Caused if DRQ isn't serviced in time. FIXME-not emulated
-					// B1 = DRQ. Data request.
-					ctx->status |= (ctx->data_pos < ctx->data_len) ? 0x02 : 0x00;
+					diskio_submit(&ctx->io);
 					break;
 
 				case CMD_READ_TRACK:
@@ -480,6 +625,8 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 				case CMD_FORMAT_TRACK:
 					// Write Track (aka Format Track)
 					ctx->head = (val & 0x02) ? 1 : 0;
+					disktrace_log(DISKTRACE_FDD, 0, DISKTRACE_FORMAT, val, ctx->track, ctx->head, 0,
+							(ctx->track * ctx->geom_heads + ctx->head) * ctx->geom_spt, ctx->geom_spt, sched_now(), 0);
 					ctx->status = 0;
 					// B6 = Write Protect. FIXME -- emulate this!
 					// B5, B4, B3 = 0
@@ -534,15 +681,19 @@ void wd2797_write_reg(WD2797_CTX *ctx, uint8_t addr, uint8_t val)
 					if (!ctx->formatting){
 						if (ctx->data_len != 512) fprintf(stderr, "floppy sector write error: sector write size != 512");
 						// Convert LBA back to CHS
-						int write_cyl = ctx->write_pos / (ctx->geom_heads * ctx->geom_spt);
-						int write_head = (ctx->write_pos / ctx->geom_spt) % ctx->geom_heads;
-						int write_sector = (ctx->write_pos % ctx->geom_spt) + 1;
-						ctx->dif->write_sector(ctx->dif, write_cyl, write_head, write_sector, ctx->data);
+						ctx->io_write = true;
+						ctx->io_cyl = ctx->write_pos / (ctx->geom_heads * ctx->geom_spt);
+						ctx->io_head = (ctx->write_pos / ctx->geom_spt) % ctx->geom_heads;
+						ctx->io_sect = (ctx->write_pos % ctx->geom_spt) + 1;
+						ctx->io_count = 1;
+						// Reset write pointer; fdc_io_complete() sets IRQ
+						ctx->write_pos = -1;
+						diskio_submit(&ctx->io);
+					} else {
+						// Set IRQ and end the format
+						ctx->irq = true;
+						ctx->formatting = false;
 					}
-					// Set IRQ and reset write pointer
-					ctx->irq = true;
-					ctx->write_pos = -1;
-					ctx->formatting = false;
 				}
 
 			}
@@ -6,6 +6,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "diskimg.h"
+#include "diskio.h"
+#include "disktrace.h"
+#include "wbcache.h"
 
 /// WD279x registers
 typedef enum {
@@ -53,6 +56,14 @@ typedef struct {
 	int						formatting;
 	// Disc image format i/o
 	DISK_IMAGE				*dif;
+	// Write-back cache in front of the image, or NULL
+	WBCACHE					*cache;
+	// Image access for the current command, and its parameters
+	DISKIO_REQ				io;
+	uint8_t					io_cmd;
+	bool					io_write;
+	int						io_cyl, io_head, io_sect, io_count;
+	size_t					io_len;
 } WD2797_CTX;
 
 /**
@@ -104,6 +115,8 @@ WD2797_ERR wd2797_load(WD2797_CTX *ctx, FILE *fp, int secsz, int heads, int trac
 /**
  * @brief	Deassign the current image file.
  * @param	ctx		WD2797 context.
+ *
+ * Any cached writes are written back to the image first.
  */
 void wd2797_unload(WD2797_CTX *ctx);
 
@@ -0,0 +1,224 @@
+/*
+ * fbv2y4m.c --- convert a freebee screen recording (see src/recorder.h)
+ * to a YUV4MPEG2 stream or raw RGB frames, for feeding to a video encoder.
+ *
+ * e.g.	fbv2y4m session.fbv | ffmpeg -i - session.mp4
+ *	fbv2y4m -f rgb session.fbv | ffmpeg -f rawvideo -pix_fmt rgb24 \
+ *		-s 720x348 -r 60 -i - session.mp4
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FBV_HEADER_SIZE		16
+#define FBV_RECORD_SIZE		7
+#define FBV_FLAG_REVERSE	0x01
+#define FBV_FLAG_END		0x80
+
+enum { FMT_Y4M, FMT_RGB };
+
+static int width, height, stride, rate;
+static uint8_t *vram;		/* current frame, as recorded */
+static uint8_t *outbuf;		/* current frame, converted */
+static uint8_t fg[3], bg[3] = { 0, 0, 0 };
+static int format = FMT_Y4M;
+
+/* usage --- print a usage message and exit */
+
+void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-H] [-f y4m|rgb] [-c rrggbb] [-o output] recording\n",
+			progname);
+	exit(EXIT_FAILURE);
+}
+
+/* get16, get32 --- fetch little-endian values */
+
+static unsigned
+get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long
+get32(const uint8_t *p)
+{
+	return get16(p) | ((unsigned long) get16(p + 2) << 16);
+}
+
+/* convert --- expand the current frame into the output format */
+
+static void
+convert(int flags)
+{
+	const uint8_t *on = fg, *off = bg;
+	uint8_t yuv_on[3], yuv_off[3];
+	int x, y, i;
+
+	if (flags & FBV_FLAG_REVERSE) {
+		on = bg;
+		off = fg;
+	}
+
+	/* BT.601 limited range */
+	for (i = 0; i < 2; i++) {
+		const uint8_t *c = i ? off : on;
+		uint8_t *o = i ? yuv_off : yuv_on;
+		o[0] = 16 + (( 66 * c[0] + 129 * c[1] +  25 * c[2] + 128) >> 8);
+		o[1] = 128 + ((-38 * c[0] -  74 * c[1] + 112 * c[2] + 128) >> 8);
+		o[2] = 128 + ((112 * c[0] -  94 * c[1] -  18 * c[2] + 128) >> 8);
+	}
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			/*
+			 * 16-bit big-endian words, leftmost pixel in the LSB:
+			 * pixels 0-7 are in the second byte, 8-15 in the first.
+			 */
+			const uint8_t *w = &vram[y * stride + (x / 16) * 2];
+			int bit = x % 16;
+			int set = (bit < 8) ? (w[1] >> bit) & 1 : (w[0] >> (bit - 8)) & 1;
+			size_t pix = (size_t) y * width + x;
+
+			if (format == FMT_RGB) {
+				memcpy(&outbuf[pix * 3], set ? on : off, 3);
+			} else {
+				const uint8_t *c = set ? yuv_on : yuv_off;
+				for (i = 0; i < 3; i++)
+					outbuf[i * width * height + pix] = c[i];
+			}
+		}
+	}
+}
+
+/* emit --- write out the current frame */
+
+static void
+emit(FILE *out)
+{
+	if (format == FMT_Y4M)
+		fputs("FRAME\n", out);
+	if (fwrite(outbuf, 3, (size_t) width * height, out) != (size_t) width * height) {
+		fprintf(stderr, "error: cannot write output: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* main --- parse args, read the recording and write the frames */
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	const char *outfile = NULL;
+	const char *colour = NULL;
+	FILE *in, *out = stdout;
+	uint8_t hdr[FBV_HEADER_SIZE], rhdr[FBV_RECORD_SIZE];
+	unsigned long frame, next = 0;
+	int flags = 0, have_frame = 0, ended = 0;
+
+	while ((c = getopt(argc, argv, "Hf:c:o:")) != EOF) {
+		switch (c) {
+		case 'f':
+			if (strcmp(optarg, "y4m") == 0)
+				format = FMT_Y4M;
+			else if (strcmp(optarg, "rgb") == 0)
+				format = FMT_RGB;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			colour = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'H':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if ((in = fopen(argv[optind], "rb")) == NULL) {
+		fprintf(stderr, "error: %s: cannot open: %s\n", argv[optind], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) || memcmp(hdr, "FBV1", 4) != 0) {
+		fprintf(stderr, "error: %s: not a freebee recording\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	width = get16(&hdr[4]);
+	height = get16(&hdr[6]);
+	stride = get16(&hdr[8]);
+	rate = get16(&hdr[10]);
+	memcpy(fg, &hdr[12], 3);
+	if (colour != NULL) {
+		unsigned long rgb = strtoul(colour, NULL, 16);
+		fg[0] = rgb >> 16;
+		fg[1] = rgb >> 8;
+		fg[2] = rgb;
+	}
+
+	vram = calloc(height, stride);
+	outbuf = malloc((size_t) width * height * 3);
+	if (vram == NULL || outbuf == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (outfile != NULL && (out = fopen(outfile, "wb")) == NULL) {
+		fprintf(stderr, "error: %s: cannot open for writing: %s\n", outfile, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (format == FMT_Y4M)
+		fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, rate);
+
+	while (!ended && fread(rhdr, 1, sizeof(rhdr), in) == sizeof(rhdr)) {
+		unsigned nlines = get16(&rhdr[5]);
+
+		frame = get32(rhdr);
+		ended = (rhdr[4] & FBV_FLAG_END) != 0;
+
+		/* frames up to this one are repeats of the last one recorded */
+		for (; have_frame && next < frame; next++)
+			emit(out);
+
+		while (nlines--) {
+			uint8_t line[2];
+			if (fread(line, 1, 2, in) != 2 || get16(line) >= (unsigned) height ||
+					fread(&vram[get16(line) * stride], 1, stride, in) != (size_t) stride) {
+				fprintf(stderr, "warning: recording is truncated or corrupt\n");
+				ended = 1;
+				break;
+			}
+		}
+
+		if (!ended) {
+			flags = rhdr[4];
+			convert(flags);
+			have_frame = 1;
+			next = frame;
+		}
+	}
+
+	/* a recording which wasn't closed properly just stops on its last frame */
+	if (have_frame && !ended)
+		emit(out);
+
+	if (out != stdout)
+		fclose(out);
+	fclose(in);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1304 @@
+/*
+ * hdfile.c --- list, extract, insert and delete files in the UNIX
+ * filesystems on a freebee 3B1 hard disk image, with the emulator stopped.
+ *
+ * e.g.	hdfile -f hd.img parts
+ *	hdfile -f hd.img ls -l /usr/bin
+ *	hdfile -f hd.img put src /u/guest/src
+ *	hdfile -f hd.img get /etc/passwd passwd
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../src/hdimg.h"	// to recognise overlay and compressed images
+
+#define SECTOR_SIZE	512
+
+/*
+ * Volume home block: the first sector of the disk. It starts with the
+ * disk label (see wd2010.c), followed by the partition table -- the
+ * starting track of each of MAXSLICE partitions. A partition runs up to
+ * the start of the next one, or the end of the disk.
+ */
+#define VHB_MAGIC	"UQVQ"
+#define VHB_HEADS	16
+#define VHB_PSECTRK	18
+#define VHB_CYLS	14
+#define VHB_PARTAB	26
+#define MAXSLICE	16
+
+/*
+ * System V filesystem, as on the UNIX PC: big-endian, with the 68000's
+ * 2-byte alignment of longs in the superblock.
+ */
+#define FS_MAGIC	0xfd187e20
+#define FS_OKAY		0x7c269d38	/* s_state + s_time, if the fs is clean */
+#define SUPERB_OFF	512			/* superblock offset in the partition */
+#define NICFREE		50
+#define NICINOD		100
+#define INODE_SIZE	64
+#define DIRENT_SIZE	16
+#define DIRSIZ		14
+#define NDIRECT		10
+#define ROOT_INO	2
+
+/* superblock (struct filsys) field offsets */
+#define SB_ISIZE	0		/* first data block */
+#define SB_FSIZE	2		/* blocks in the filesystem */
+#define SB_NFREE	6
+#define SB_FREE		8		/* [NICFREE] free block cache */
+#define SB_NINODE	208
+#define SB_INODE	210		/* [NICINOD] free inode cache */
+#define SB_FMOD		412
+#define SB_TIME		414
+#define SB_TFREE	426
+#define SB_TINODE	430
+#define SB_FNAME	432
+#define SB_FPACK	438
+#define SB_STATE	500
+#define SB_MAGIC	504
+#define SB_TYPE		508
+
+/* on-disc inode (struct dinode) field offsets */
+#define DI_MODE		0
+#define DI_NLINK	2
+#define DI_UID		4
+#define DI_GID		6
+#define DI_SIZE		8
+#define DI_ADDR		12		/* 13 three-byte block numbers */
+#define DI_ATIME	52
+#define DI_MTIME	56
+#define DI_CTIME	60
+
+/* inode modes, as on the UNIX PC */
+#define FS_IFMT		0170000
+#define FS_IFDIR	0040000
+#define FS_IFREG	0100000
+#define FS_IFCHR	0020000
+#define FS_IFBLK	0060000
+#define FS_IFIFO	0010000
+
+typedef struct {
+	uint32_t start, nsect;	/* in sectors */
+	int in_table;			/* partition number, or -1 if found by scanning */
+} PART;
+
+typedef struct {
+	uint32_t ino;
+	unsigned char d[INODE_SIZE];
+} INODE;
+
+static const char *progname;
+static const char *imgname = "hd.img";
+static int imgfd = -1;
+static int writable;
+static unsigned uid, gid;
+
+static PART parts[MAXSLICE * 4];
+static int nparts;
+
+static off_t fsoff;				/* byte offset of the filesystem */
+static unsigned bsize;			/* filesystem block size */
+static unsigned nindir;			/* block numbers per indirect block */
+static uint32_t isize, fsize, ninodes;
+static unsigned char sb[SECTOR_SIZE];
+static int sb_dirty;
+static uint32_t iscan = ROOT_INO + 1;	/* where to look for free inodes next */
+
+/* usage --- print a usage message and exit */
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-H] [-f image] [-p partition] [-s sector] [-u uid] [-g gid] command [args]\n"
+			"commands:\n"
+			"  parts                  list partitions and filesystems\n"
+			"  ls [-l] [path]         list a directory\n"
+			"  get path [hostpath]    extract a file or directory tree (- for stdout)\n"
+			"  put hostpath [path]    insert a file or directory tree\n"
+			"  mkdir path             make a directory\n"
+			"  rm [-r] path           delete a file, or a directory and its contents\n",
+			progname);
+	exit(EXIT_FAILURE);
+}
+
+static void close_fs(void);
+
+/*
+ * fatal --- print an error message and exit. Blocks and inodes already
+ * allocated are in use, so the superblock's free lists go back too.
+ */
+
+static void
+fatal(const char *fmt, ...)
+{
+	static int exiting;
+	va_list ap;
+
+	fprintf(stderr, "%s: ", progname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	if (writable && ! exiting++)
+		close_fs();
+	exit(EXIT_FAILURE);
+}
+
+/* get16, get32, put16, put32 --- big-endian values */
+
+static unsigned
+get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+static void
+put16(unsigned char *p, unsigned v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+/* img_read, img_write --- access the image */
+
+static void
+img_read(off_t off, void *buf, size_t len)
+{
+	ssize_t n = pread(imgfd, buf, len, off);
+
+	if (n < 0)
+		fatal("%s: read error: %s", imgname, strerror(errno));
+	if ((size_t) n < len)
+		memset((char *) buf + n, 0, len - n);	/* past the end reads as zeros */
+}
+
+static void
+img_write(off_t off, const void *buf, size_t len)
+{
+	if (pwrite(imgfd, buf, len, off) != (ssize_t) len)
+		fatal("%s: write error: %s", imgname, strerror(errno));
+}
+
+/* bread, bwrite --- access filesystem blocks */
+
+static void
+bread(uint32_t blk, unsigned char *buf)
+{
+	if (blk >= fsize)
+		fatal("block %lu is outside the filesystem", (unsigned long) blk);
+	img_read(fsoff + (off_t) blk * bsize, buf, bsize);
+}
+
+static void
+bwrite(uint32_t blk, const unsigned char *buf)
+{
+	if (blk < isize || blk >= fsize)
+		fatal("refusing to write block %lu, outside the data area", (unsigned long) blk);
+	img_write(fsoff + (off_t) blk * bsize, buf, bsize);
+}
+
+/* ---------- partitions ---------- */
+
+/* find_partitions --- read the partition table, and look for filesystems */
+
+static void
+find_partitions(void)
+{
+	unsigned char vhb[SECTOR_SIZE], buf[65536];
+	struct stat sbuf;
+	uint32_t disk_sects, psectrk;
+	off_t off;
+	int i, j;
+
+	if (fstat(imgfd, & sbuf) < 0)
+		fatal("%s: %s", imgname, strerror(errno));
+	disk_sects = sbuf.st_size / SECTOR_SIZE;
+
+	img_read(0, vhb, sizeof(vhb));
+	if (memcmp(vhb, HDOVL_MAGIC, 8) == 0 || memcmp(vhb, HDCMP_MAGIC, 8) == 0)
+		fatal("%s: is an overlay or compressed image; use a plain image", imgname);
+
+	if (memcmp(vhb, VHB_MAGIC, 4) == 0 && (psectrk = get16(vhb + VHB_PSECTRK)) != 0) {
+		for (i = 0; i < MAXSLICE; i++) {
+			uint32_t strk = get32(vhb + VHB_PARTAB + 4 * i);
+			uint32_t start = strk * psectrk, end = disk_sects;
+
+			if (i > 0 && strk == 0)
+				continue;		/* unused */
+			for (j = 0; j < MAXSLICE; j++) {
+				uint32_t s = get32(vhb + VHB_PARTAB + 4 * j) * psectrk;
+				if (s > start && s < end)
+					end = s;
+			}
+			if (start >= disk_sects)
+				continue;
+			parts[nparts].start = start;
+			parts[nparts].nsect = end - start;
+			parts[nparts].in_table = i;
+			nparts++;
+		}
+	}
+
+	/*
+	 * Also scan for superblocks, in case the table is missing or
+	 * describes the disk differently than we expect.
+	 */
+	for (off = 0; off < sbuf.st_size; off += sizeof(buf)) {
+		img_read(off, buf, sizeof(buf));
+		for (i = 0; i < (int) sizeof(buf); i += SECTOR_SIZE) {
+			uint32_t sect = (off + i) / SECTOR_SIZE;
+			unsigned type = get32(buf + i + SB_TYPE);
+
+			if (sect == 0 || get32(buf + i + SB_MAGIC) != FS_MAGIC || type < 1 || type > 3)
+				continue;
+			for (j = 0; j < nparts; j++)
+				if (parts[j].start == sect - 1)
+					break;
+			if (j < nparts || nparts == (int) (sizeof(parts) / sizeof(parts[0])))
+				continue;
+			parts[nparts].start = sect - 1;
+			parts[nparts].nsect = disk_sects - (sect - 1);
+			parts[nparts].in_table = -1;
+			nparts++;
+		}
+	}
+}
+
+/* has_fs --- check for a filesystem at a sector; return its superblock */
+
+static int
+has_fs(uint32_t start, unsigned char *sbuf)
+{
+	img_read((off_t) start * SECTOR_SIZE + SUPERB_OFF, sbuf, SECTOR_SIZE);
+	return get32(sbuf + SB_MAGIC) == FS_MAGIC && get32(sbuf + SB_TYPE) >= 1 && get32(sbuf + SB_TYPE) <= 3;
+}
+
+/* open_fs --- load the superblock of the filesystem at a sector */
+
+static void
+open_fs(uint32_t start)
+{
+	fsoff = (off_t) start * SECTOR_SIZE;
+	if (! has_fs(start, sb))
+		fatal("no filesystem at sector %lu", (unsigned long) start);
+
+	bsize = SECTOR_SIZE << (get32(sb + SB_TYPE) - 1);
+	nindir = bsize / 4;
+	isize = get16(sb + SB_ISIZE);
+	fsize = get32(sb + SB_FSIZE);
+	ninodes = (isize - 2) * (bsize / INODE_SIZE);
+	if (isize < 3 || fsize <= isize)
+		fatal("filesystem at sector %lu has a bad superblock", (unsigned long) start);
+}
+
+/* close_fs --- write back the superblock if it changed */
+
+static void
+close_fs(void)
+{
+	uint32_t now = time(NULL);
+	int clean;
+
+	if (! sb_dirty)
+		return;
+
+	/* keep the clean flag, if it was set */
+	clean = (uint32_t) (get32(sb + SB_STATE) + get32(sb + SB_TIME)) == FS_OKAY;
+	put32(sb + SB_TIME, now);
+	if (clean)
+		put32(sb + SB_STATE, FS_OKAY - now);
+	img_write(fsoff + SUPERB_OFF, sb, SECTOR_SIZE);
+	sb_dirty = 0;
+}
+
+/* select_fs --- pick the filesystem to work on */
+
+static void
+select_fs(int partno, long sector)
+{
+	unsigned char sbuf[SECTOR_SIZE];
+	int i;
+
+	if (sector >= 0) {
+		open_fs(sector);
+		return;
+	}
+
+	find_partitions();
+	for (i = 0; i < nparts; i++) {
+		if (partno >= 0 ? parts[i].in_table == partno : has_fs(parts[i].start, sbuf)) {
+			open_fs(parts[i].start);
+			return;
+		}
+	}
+	if (partno >= 0)
+		fatal("%s: no partition %d in the disk label", imgname, partno);
+	fatal("%s: no filesystem found", imgname);
+}
+
+/* cmd_parts --- list the partitions and any filesystems in them */
+
+static void
+cmd_parts(void)
+{
+	unsigned char sbuf[SECTOR_SIZE];
+	int i;
+
+	find_partitions();
+	if (nparts == 0)
+		printf("no partition table or filesystems found\n");
+
+	for (i = 0; i < nparts; i++) {
+		if (parts[i].in_table >= 0)
+			printf("partition %2d: ", parts[i].in_table);
+		else
+			printf("found       : ");
+		printf("sectors %8lu - %8lu", (unsigned long) parts[i].start,
+				(unsigned long) (parts[i].start + parts[i].nsect - 1));
+		if (has_fs(parts[i].start, sbuf)) {
+			unsigned bs = SECTOR_SIZE << (get32(sbuf + SB_TYPE) - 1);
+			printf("  filesystem %-6.6s %-6.6s %u-byte blocks, %lu blocks (%lu free), %u inodes free",
+					(char *) sbuf + SB_FNAME, (char *) sbuf + SB_FPACK, bs,
+					(unsigned long) get32(sbuf + SB_FSIZE), (unsigned long) get32(sbuf + SB_TFREE),
+					get16(sbuf + SB_TINODE));
+		}
+		printf("\n");
+	}
+}
+
+/* ---------- blocks and inodes ---------- */
+
+/* balloc --- allocate a zeroed data block */
+
+static uint32_t
+balloc(void)
+{
+	unsigned char buf[bsize];
+	unsigned nfree = get16(sb + SB_NFREE);
+	uint32_t blk;
+
+	if (nfree == 0 || nfree > NICFREE || (blk = get32(sb + SB_FREE + 4 * --nfree)) == 0)
+		fatal("filesystem is full");
+	if (blk < isize || blk >= fsize)
+		fatal("free list is corrupt (block %lu); run fsck in the emulator", (unsigned long) blk);
+
+	if (nfree == 0) {
+		/* the last block in the cache holds the next part of the free list */
+		bread(blk, buf);
+		nfree = get16(buf);
+		if (nfree > NICFREE)
+			fatal("free list is corrupt; run fsck in the emulator");
+		memcpy(sb + SB_FREE, buf + 2, nfree * 4);
+	}
+	put16(sb + SB_NFREE, nfree);
+	put32(sb + SB_TFREE, get32(sb + SB_TFREE) - 1);
+	sb_dirty = 1;
+
+	memset(buf, 0, bsize);
+	bwrite(blk, buf);
+	return blk;
+}
+
+/* bfree --- free a data block */
+
+static void
+bfree(uint32_t blk)
+{
+	unsigned char buf[bsize];
+	unsigned nfree = get16(sb + SB_NFREE);
+
+	if (blk < isize || blk >= fsize)
+		fatal("freeing bad block %lu", (unsigned long) blk);
+
+	if (nfree == NICFREE || nfree == 0) {
+		/* move the cache out into the block being freed */
+		memset(buf, 0, bsize);
+		put16(buf, nfree);
+		memcpy(buf + 2, sb + SB_FREE, nfree * 4);
+		bwrite(blk, buf);
+		nfree = 0;
+	}
+	put32(sb + SB_FREE + 4 * nfree++, blk);
+	put16(sb + SB_NFREE, nfree);
+	put32(sb + SB_TFREE, get32(sb + SB_TFREE) + 1);
+	sb_dirty = 1;
+}
+
+/* iget, iput --- read and write an inode */
+
+static void
+iget(uint32_t ino, INODE *ip)
+{
+	if (ino < 1 || ino > ninodes)
+		fatal("bad inode number %lu", (unsigned long) ino);
+	ip->ino = ino;
+	img_read(fsoff + (off_t) (2 + (ino - 1) / (bsize / INODE_SIZE)) * bsize +
+			((ino - 1) % (bsize / INODE_SIZE)) * INODE_SIZE, ip->d, INODE_SIZE);
+}
+
+static void
+iput(const INODE *ip)
+{
+	img_write(fsoff + (off_t) (2 + (ip->ino - 1) / (bsize / INODE_SIZE)) * bsize +
+			((ip->ino - 1) % (bsize / INODE_SIZE)) * INODE_SIZE, ip->d, INODE_SIZE);
+}
+
+#define imode(ip)	get16((ip)->d + DI_MODE)
+#define isize_of(ip)	get32((ip)->d + DI_SIZE)
+#define isdir(ip)	((imode(ip) & FS_IFMT) == FS_IFDIR)
+
+/* ialloc --- allocate an inode */
+
+static void
+ialloc(INODE *ip, unsigned mode)
+{
+	unsigned char buf[bsize];
+	unsigned ninode;
+	uint32_t now = time(NULL), ino;
+	int wrapped = 0;
+
+	for (;;) {
+		ninode = get16(sb + SB_NINODE);
+		if (ninode == 0 || ninode > NICINOD) {
+			/* refill the cache by scanning the inode list */
+			ninode = 0;
+			while (ninode < NICINOD) {
+				if (iscan > ninodes) {
+					if (wrapped++)
+						break;
+					iscan = ROOT_INO + 1;
+				}
+				img_read(fsoff + (off_t) (2 + (iscan - 1) / (bsize / INODE_SIZE)) * bsize +
+						((iscan - 1) % (bsize / INODE_SIZE)) * INODE_SIZE, buf, INODE_SIZE);
+				if (get16(buf + DI_MODE) == 0 && get16(buf + DI_NLINK) == 0)
+					put16(sb + SB_INODE + 2 * ninode++, iscan);
+				iscan++;
+			}
+			if (ninode == 0)
+				fatal("filesystem is out of inodes");
+		}
+		ino = get16(sb + SB_INODE + 2 * --ninode);
+		put16(sb + SB_NINODE, ninode);
+		sb_dirty = 1;
+		iget(ino, ip);
+		if (imode(ip) == 0)
+			break;		/* otherwise the cache was stale; try again */
+	}
+
+	memset(ip->d, 0, INODE_SIZE);
+	put16(ip->d + DI_MODE, mode);
+	put16(ip->d + DI_NLINK, 1);
+	put16(ip->d + DI_UID, uid);
+	put16(ip->d + DI_GID, gid);
+	put32(ip->d + DI_ATIME, now);
+	put32(ip->d + DI_MTIME, now);
+	put32(ip->d + DI_CTIME, now);
+	put16(sb + SB_TINODE, get16(sb + SB_TINODE) - 1);
+}
+
+/* ifree --- free an inode */
+
+static void
+ifree(INODE *ip)
+{
+	unsigned ninode = get16(sb + SB_NINODE);
+
+	memset(ip->d, 0, INODE_SIZE);
+	iput(ip);
+	if (ninode < NICINOD) {
+		put16(sb + SB_INODE + 2 * ninode, ip->ino);
+		put16(sb + SB_NINODE, ninode + 1);
+	}
+	put16(sb + SB_TINODE, get16(sb + SB_TINODE) + 1);
+	sb_dirty = 1;
+}
+
+/* get_addr, set_addr --- an inode's three-byte block numbers */
+
+static uint32_t
+get_addr(const INODE *ip, int i)
+{
+	const unsigned char *p = ip->d + DI_ADDR + 3 * i;
+
+	return ((uint32_t) p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static void
+set_addr(INODE *ip, int i, uint32_t blk)
+{
+	unsigned char *p = ip->d + DI_ADDR + 3 * i;
+
+	p[0] = blk >> 16;
+	p[1] = blk >> 8;
+	p[2] = blk;
+}
+
+/*
+ * bmap --- map a block of a file to a filesystem block. Returns 0 for
+ * a hole, unless alloc is set, in which case the block is allocated.
+ */
+
+static uint32_t
+bmap(INODE *ip, uint32_t lbn, int alloc)
+{
+	unsigned char buf[bsize];
+	uint32_t blk, span = 1, next;
+	int level;
+
+	if (lbn < NDIRECT) {
+		if ((blk = get_addr(ip, lbn)) == 0 && alloc) {
+			blk = balloc();
+			set_addr(ip, lbn, blk);
+		}
+		return blk;
+	}
+
+	/* single, double or triple indirect */
+	lbn -= NDIRECT;
+	for (level = 1; level <= 3; level++) {
+		span *= nindir;
+		if (lbn < span)
+			break;
+		lbn -= span;
+	}
+	if (level > 3)
+		fatal("file too large");
+
+	if ((blk = get_addr(ip, NDIRECT - 1 + level)) == 0) {
+		if (! alloc)
+			return 0;
+		blk = balloc();
+		set_addr(ip, NDIRECT - 1 + level, blk);
+	}
+	for (; level > 0; level--) {
+		span /= nindir;
+		bread(blk, buf);
+		next = get32(buf + 4 * ((lbn / span) % nindir));
+		if (next == 0) {
+			if (! alloc)
+				return 0;
+			next = balloc();
+			put32(buf + 4 * ((lbn / span) % nindir), next);
+			bwrite(blk, buf);
+		}
+		blk = next;
+	}
+	return blk;
+}
+
+/* free_tree --- free a block and, if it's an indirect block, what it points to */
+
+static void
+free_tree(uint32_t blk, int level)
+{
+	unsigned char buf[bsize];
+	unsigned i;
+
+	if (level > 0) {
+		bread(blk, buf);
+		for (i = 0; i < nindir; i++)
+			if (get32(buf + 4 * i) != 0)
+				free_tree(get32(buf + 4 * i), level - 1);
+	}
+	bfree(blk);
+}
+
+/* itrunc --- free all of a file's blocks */
+
+static void
+itrunc(INODE *ip)
+{
+	int i;
+
+	for (i = 0; i < NDIRECT + 3; i++) {
+		if (get_addr(ip, i) != 0)
+			free_tree(get_addr(ip, i), i < NDIRECT ? 0 : i - NDIRECT + 1);
+		set_addr(ip, i, 0);
+	}
+	put32(ip->d + DI_SIZE, 0);
+}
+
+/* ---------- directories ---------- */
+
+/*
+ * dir_scan --- find an entry by name (or, if name is NULL, the first free
+ * slot). Returns its byte offset in the directory, or -1.
+ */
+
+static long
+dir_scan(INODE *dp, const char *name, uint32_t *ino)
+{
+	unsigned char buf[bsize];
+	uint32_t size = isize_of(dp), off, blk;
+
+	for (off = 0; off < size; off += DIRENT_SIZE) {
+		if (off % bsize == 0) {
+			if ((blk = bmap(dp, off / bsize, 0)) == 0)
+				memset(buf, 0, bsize);
+			else
+				bread(blk, buf);
+		}
+		unsigned char *de = buf + off % bsize;
+		if (name == NULL ? get16(de) == 0 :
+				get16(de) != 0 && strncmp((char *) de + 2, name, DIRSIZ) == 0) {
+			if (ino)
+				*ino = get16(de);
+			return off;
+		}
+	}
+	return -1;
+}
+
+/* dir_set --- write the entry at an offset in a directory */
+
+static void
+dir_set(INODE *dp, uint32_t off, const char *name, uint32_t ino)
+{
+	unsigned char buf[bsize];
+	uint32_t blk = bmap(dp, off / bsize, 1);
+
+	bread(blk, buf);
+	memset(buf + off % bsize, 0, DIRENT_SIZE);
+	put16(buf + off % bsize, ino);
+	if (ino != 0)
+		strncpy((char *) buf + off % bsize + 2, name, DIRSIZ);
+	bwrite(blk, buf);
+}
+
+/* dir_enter --- add a name to a directory */
+
+static void
+dir_enter(INODE *dp, const char *name, uint32_t ino)
+{
+	long off = dir_scan(dp, NULL, NULL);
+
+	if (off < 0) {
+		off = isize_of(dp);
+		put32(dp->d + DI_SIZE, off + DIRENT_SIZE);
+	}
+	dir_set(dp, off, name, ino);
+	put32(dp->d + DI_MTIME, time(NULL));
+	iput(dp);
+}
+
+/* dir_empty --- check that a directory has nothing but . and .. in it */
+
+static int
+dir_empty(INODE *dp)
+{
+	unsigned char buf[bsize];
+	uint32_t size = isize_of(dp), off, blk;
+
+	for (off = 0; off < size; off += DIRENT_SIZE) {
+		if (off % bsize == 0) {
+			if ((blk = bmap(dp, off / bsize, 0)) == 0)
+				memset(buf, 0, bsize);
+			else
+				bread(blk, buf);
+		}
+		unsigned char *de = buf + off % bsize;
+		if (get16(de) != 0 && strncmp((char *) de + 2, ".", DIRSIZ) != 0 &&
+				strncmp((char *) de + 2, "..", DIRSIZ) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * namei --- look up a path. If parent is non-NULL, look up everything but
+ * the last component instead, and put that in leaf. Returns the inode
+ * number, or 0 if it doesn't exist.
+ */
+
+static uint32_t
+namei(const char *path, INODE *ip, char *leaf)
+{
+	char comp[DIRSIZ + 1];
+	uint32_t ino = ROOT_INO;
+	const char *p = path, *end;
+	size_t len;
+
+	iget(ino, ip);
+	for (;;) {
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+		end = strchr(p, '/');
+		len = end ? (size_t) (end - p) : strlen(p);
+		if (len > DIRSIZ)
+			fatal("%.*s: name longer than %d characters", (int) len, p, DIRSIZ);
+		memcpy(comp, p, len);
+		comp[len] = '\0';
+		p += len;
+
+		/* stop at the last component, if asked */
+		if (leaf != NULL && strspn(p, "/") == strlen(p)) {
+			strcpy(leaf, comp);
+			return ino;
+		}
+
+		if (! isdir(ip))
+			fatal("%s: not a directory", path);
+		if (dir_scan(ip, comp, &ino) < 0)
+			return 0;
+		iget(ino, ip);
+	}
+	if (leaf != NULL)
+		fatal("%s: needs a file name", path);
+	return ino;
+}
+
+/* ---------- commands ---------- */
+
+/* mode_string --- ls -l style mode */
+
+static const char *
+mode_string(unsigned mode)
+{
+	static char s[11];
+	const char *rwx = "rwxrwxrwx";
+	int i;
+
+	switch (mode & FS_IFMT) {
+	case FS_IFDIR:	s[0] = 'd'; break;
+	case FS_IFCHR:	s[0] = 'c'; break;
+	case FS_IFBLK:	s[0] = 'b'; break;
+	case FS_IFIFO:	s[0] = 'p'; break;
+	default:		s[0] = '-'; break;
+	}
+	for (i = 0; i < 9; i++)
+		s[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+	s[10] = '\0';
+	return s;
+}
+
+/* list_one --- print one entry, ls style */
+
+static void
+list_one(uint32_t ino, const char *name, int longfmt)
+{
+	INODE ino_buf;
+	char tbuf[32];
+	time_t t;
+
+	if (! longfmt) {
+		printf("%s\n", name);
+		return;
+	}
+	iget(ino, &ino_buf);
+	t = get32(ino_buf.d + DI_MTIME);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M", gmtime(&t));
+	if ((imode(&ino_buf) & FS_IFMT) == FS_IFCHR || (imode(&ino_buf) & FS_IFMT) == FS_IFBLK)
+		printf("%s %3u %5u %5u %4u,%4u %s %s\n", mode_string(imode(&ino_buf)), get16(ino_buf.d + DI_NLINK),
+				get16(ino_buf.d + DI_UID), get16(ino_buf.d + DI_GID),
+				get_addr(&ino_buf, 0) >> 8, get_addr(&ino_buf, 0) & 0xff, tbuf, name);
+	else
+		printf("%s %3u %5u %5u %9lu %s %s\n", mode_string(imode(&ino_buf)), get16(ino_buf.d + DI_NLINK),
+				get16(ino_buf.d + DI_UID), get16(ino_buf.d + DI_GID),
+				(unsigned long) isize_of(&ino_buf), tbuf, name);
+}
+
+/* cmd_ls --- list a directory */
+
+static void
+cmd_ls(const char *path, int longfmt)
+{
+	unsigned char buf[bsize];
+	char name[DIRSIZ + 1];
+	INODE dir;
+	uint32_t ino, size, off, blk;
+
+	if ((ino = namei(path, &dir, NULL)) == 0)
+		fatal("%s: not found", path);
+	if (! isdir(&dir)) {
+		list_one(ino, path, longfmt);
+		return;
+	}
+
+	size = isize_of(&dir);
+	for (off = 0; off < size; off += DIRENT_SIZE) {
+		if (off % bsize == 0) {
+			if ((blk = bmap(&dir, off / bsize, 0)) == 0)
+				memset(buf, 0, bsize);
+			else
+				bread(blk, buf);
+		}
+		unsigned char *de = buf + off % bsize;
+		if (get16(de) == 0)
+			continue;
+		memcpy(name, de + 2, DIRSIZ);
+		name[DIRSIZ] = '\0';
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		list_one(get16(de), name, longfmt);
+	}
+}
+
+/* get_file --- copy a file out to the host */
+
+static void
+get_file(INODE *ip, const char *path, const char *dest)
+{
+	unsigned char buf[bsize];
+	uint32_t size = isize_of(ip), off, blk, n;
+	FILE *fp;
+
+	if ((imode(ip) & FS_IFMT) != FS_IFREG) {
+		fprintf(stderr, "%s: %s: not a regular file; skipped\n", progname, path);
+		return;
+	}
+
+	if (strcmp(dest, "-") == 0)
+		fp = stdout;
+	else if ((fp = fopen(dest, "wb")) == NULL)
+		fatal("%s: cannot create: %s", dest, strerror(errno));
+
+	for (off = 0; off < size; off += n) {
+		n = (size - off < bsize) ? size - off : bsize;
+		if ((blk = bmap(ip, off / bsize, 0)) == 0)
+			memset(buf, 0, bsize);
+		else
+			bread(blk, buf);
+		if (fwrite(buf, 1, n, fp) != n)
+			fatal("%s: write error: %s", dest, strerror(errno));
+	}
+
+	if (fp != stdout) {
+		if (fclose(fp) != 0)
+			fatal("%s: write error: %s", dest, strerror(errno));
+		(void) chmod(dest, imode(ip) & 07777);
+	}
+}
+
+/* get_tree --- copy a file or directory tree out to the host */
+
+static void
+get_tree(uint32_t ino, const char *path, const char *dest)
+{
+	unsigned char buf[bsize];
+	char name[DIRSIZ + 1], *subpath, *subdest;
+	INODE ip;
+	uint32_t size, off, blk;
+
+	iget(ino, &ip);
+	if (! isdir(&ip)) {
+		get_file(&ip, path, dest);
+		return;
+	}
+
+	if (mkdir(dest, 0755) < 0 && errno != EEXIST)
+		fatal("%s: cannot create: %s", dest, strerror(errno));
+
+	size = isize_of(&ip);
+	for (off = 0; off < size; off += DIRENT_SIZE) {
+		if (off % bsize == 0) {
+			if ((blk = bmap(&ip, off / bsize, 0)) == 0)
+				memset(buf, 0, bsize);
+			else
+				bread(blk, buf);
+		}
+		unsigned char *de = buf + off % bsize;
+		if (get16(de) == 0)
+			continue;
+		memcpy(name, de + 2, DIRSIZ);
+		name[DIRSIZ] = '\0';
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		subpath = malloc(strlen(path) + DIRSIZ + 2);
+		subdest = malloc(strlen(dest) + DIRSIZ + 2);
+		if (subpath == NULL || subdest == NULL)
+			fatal("out of memory");
+		sprintf(subpath, "%s/%s", path, name);
+		sprintf(subdest, "%s/%s", dest, name);
+		get_tree(get16(de), subpath, subdest);
+		free(subpath);
+		free(subdest);
+	}
+	(void) chmod(dest, imode(&ip) & 07777);
+}
+
+/* base_name --- the last component of a path */
+
+static const char *
+base_name(const char *path)
+{
+	static char buf[4096];
+	char *p;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	while ((p = strrchr(buf, '/')) != NULL && p[1] == '\0' && p != buf)
+		*p = '\0';
+	return (p = strrchr(buf, '/')) ? p + 1 : buf;
+}
+
+/* cmd_get --- extract a file or directory tree */
+
+static void
+cmd_get(const char *path, const char *dest)
+{
+	INODE ip;
+	uint32_t ino;
+
+	if ((ino = namei(path, &ip, NULL)) == 0)
+		fatal("%s: not found", path);
+	if (dest == NULL)
+		dest = (ino == ROOT_INO) ? "root" : base_name(path);
+	get_tree(ino, path, dest);
+}
+
+/* make_dir --- make a directory in a parent directory */
+
+static uint32_t
+make_dir(INODE *parent, const char *name, unsigned perm)
+{
+	INODE dir;
+
+	ialloc(&dir, FS_IFDIR | (perm & 07777));
+	put16(dir.d + DI_NLINK, 2);
+	dir_enter(&dir, ".", dir.ino);
+	dir_enter(&dir, "..", parent->ino);
+
+	put16(parent->d + DI_NLINK, get16(parent->d + DI_NLINK) + 1);
+	dir_enter(parent, name, dir.ino);
+	return dir.ino;
+}
+
+/* put_file --- copy a host file into a new or existing file */
+
+static void
+put_file(const char *src, INODE *parent, const char *name, const struct stat *st)
+{
+	unsigned char buf[bsize];
+	INODE ip;
+	uint32_t ino, lbn = 0;
+	size_t n, total = 0;
+	FILE *fp;
+
+	if ((fp = fopen(src, "rb")) == NULL)
+		fatal("%s: cannot open: %s", src, strerror(errno));
+
+	if (dir_scan(parent, name, &ino) >= 0) {
+		/* replace the contents of an existing file */
+		iget(ino, &ip);
+		if ((imode(&ip) & FS_IFMT) != FS_IFREG)
+			fatal("%s: exists and is not a regular file", name);
+		itrunc(&ip);
+		put16(ip.d + DI_MODE, FS_IFREG | (st->st_mode & 07777));
+	} else {
+		ialloc(&ip, FS_IFREG | (st->st_mode & 07777));
+		iput(&ip);
+		dir_enter(parent, name, ip.ino);
+	}
+
+	while ((n = fread(buf, 1, bsize, fp)) > 0) {
+		memset(buf + n, 0, bsize - n);
+		bwrite(bmap(&ip, lbn++, 1), buf);
+		total += n;
+	}
+	if (ferror(fp))
+		fatal("%s: read error: %s", src, strerror(errno));
+	fclose(fp);
+
+	put32(ip.d + DI_SIZE, total);
+	put32(ip.d + DI_MTIME, st->st_mtime);
+	iput(&ip);
+}
+
+/* put_tree --- copy a host file or directory tree in */
+
+static void
+put_tree(const char *src, INODE *parent, const char *name)
+{
+	struct stat st;
+	struct dirent *ent;
+	INODE dir;
+	uint32_t ino;
+	char *subsrc;
+	DIR *dp;
+
+	if (strlen(name) > DIRSIZ)
+		fatal("%s: name longer than %d characters", name, DIRSIZ);
+	if (stat(src, &st) < 0)
+		fatal("%s: %s", src, strerror(errno));
+
+	if (S_ISREG(st.st_mode)) {
+		put_file(src, parent, name, &st);
+		return;
+	}
+	if (! S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: %s: not a regular file or directory; skipped\n", progname, src);
+		return;
+	}
+
+	/* merge into an existing directory, or make a new one */
+	if (dir_scan(parent, name, &ino) < 0)
+		ino = make_dir(parent, name, st.st_mode);
+	iget(ino, &dir);
+	if (! isdir(&dir))
+		fatal("%s: exists and is not a directory", name);
+
+	if ((dp = opendir(src)) == NULL)
+		fatal("%s: %s", src, strerror(errno));
+	while ((ent = readdir(dp)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if ((subsrc = malloc(strlen(src) + strlen(ent->d_name) + 2)) == NULL)
+			fatal("out of memory");
+		sprintf(subsrc, "%s/%s", src, ent->d_name);
+		put_tree(subsrc, &dir, ent->d_name);
+		free(subsrc);
+		iget(ino, &dir);	/* entries may have changed it */
+	}
+	closedir(dp);
+}
+
+/* check_tree --- check a host tree's names fit, before changing anything */
+
+static void
+check_tree(const char *src, const char *name)
+{
+	struct stat st;
+	struct dirent *ent;
+	char *subsrc;
+	DIR *dp;
+
+	if (strlen(name) > DIRSIZ)
+		fatal("%s: name longer than %d characters", src, DIRSIZ);
+	if (stat(src, &st) < 0)
+		fatal("%s: %s", src, strerror(errno));
+	if (! S_ISDIR(st.st_mode))
+		return;
+
+	if ((dp = opendir(src)) == NULL)
+		fatal("%s: %s", src, strerror(errno));
+	while ((ent = readdir(dp)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if ((subsrc = malloc(strlen(src) + strlen(ent->d_name) + 2)) == NULL)
+			fatal("out of memory");
+		sprintf(subsrc, "%s/%s", src, ent->d_name);
+		check_tree(subsrc, ent->d_name);
+		free(subsrc);
+	}
+	closedir(dp);
+}
+
+/* cmd_put --- insert a file or directory tree */
+
+static void
+cmd_put(const char *src, const char *path)
+{
+	char leaf[DIRSIZ + 1];
+	INODE parent, target;
+	uint32_t ino;
+
+	if (path == NULL)
+		path = "/";
+
+	/* putting into an existing directory keeps the source's name */
+	if ((ino = namei(path, &target, NULL)) != 0 && isdir(&target)) {
+		check_tree(src, base_name(src));
+		put_tree(src, &target, base_name(src));
+		return;
+	}
+
+	if (namei(path, &parent, leaf) == 0 || ! isdir(&parent))
+		fatal("%s: parent directory not found", path);
+	check_tree(src, leaf);
+	put_tree(src, &parent, leaf);
+}
+
+/* cmd_mkdir --- make a directory */
+
+static void
+cmd_mkdir(const char *path)
+{
+	char leaf[DIRSIZ + 1];
+	INODE parent;
+
+	if (namei(path, &parent, leaf) == 0 || ! isdir(&parent))
+		fatal("%s: parent directory not found", path);
+	if (dir_scan(&parent, leaf, NULL) >= 0)
+		fatal("%s: already exists", path);
+	make_dir(&parent, leaf, 0755);
+}
+
+/* remove_entry --- unlink a name, and free the inode if it was the last link */
+
+static void
+remove_entry(INODE *parent, const char *name, const char *path, int recursive)
+{
+	unsigned char buf[bsize];
+	char subname[DIRSIZ + 1], *subpath;
+	INODE ip;
+	uint32_t ino, size, off, blk;
+	long pos;
+
+	if ((pos = dir_scan(parent, name, &ino)) < 0)
+		fatal("%s: not found", path);
+	iget(ino, &ip);
+
+	if (isdir(&ip)) {
+		if (! dir_empty(&ip) && ! recursive)
+			fatal("%s: directory not empty (use rm -r)", path);
+
+		/* remove the contents first */
+		size = isize_of(&ip);
+		for (off = 0; off < size; off += DIRENT_SIZE) {
+			if ((blk = bmap(&ip, off / bsize, 0)) == 0)
+				continue;
+			bread(blk, buf);
+			unsigned char *de = buf + off % bsize;
+			if (get16(de) == 0)
+				continue;
+			memcpy(subname, de + 2, DIRSIZ);
+			subname[DIRSIZ] = '\0';
+			if (strcmp(subname, ".") == 0 || strcmp(subname, "..") == 0)
+				continue;
+			if ((subpath = malloc(strlen(path) + DIRSIZ + 2)) == NULL)
+				fatal("out of memory");
+			sprintf(subpath, "%s/%s", path, subname);
+			remove_entry(&ip, subname, subpath, recursive);
+			free(subpath);
+			iget(ino, &ip);
+		}
+
+		/* its .. no longer links to the parent */
+		put16(parent->d + DI_NLINK, get16(parent->d + DI_NLINK) - 1);
+		put16(ip.d + DI_NLINK, 0);
+	} else {
+		put16(ip.d + DI_NLINK, get16(ip.d + DI_NLINK) - 1);
+	}
+
+	dir_set(parent, pos, NULL, 0);
+	put32(parent->d + DI_MTIME, time(NULL));
+	iput(parent);
+
+	if (get16(ip.d + DI_NLINK) == 0) {
+		if ((imode(&ip) & FS_IFMT) != FS_IFCHR && (imode(&ip) & FS_IFMT) != FS_IFBLK)
+			itrunc(&ip);
+		ifree(&ip);
+	} else {
+		iput(&ip);
+	}
+}
+
+/* cmd_rm --- delete a file or directory */
+
+static void
+cmd_rm(const char *path, int recursive)
+{
+	char leaf[DIRSIZ + 1];
+	INODE parent;
+
+	if (namei(path, &parent, leaf) == 0 || ! isdir(&parent))
+		fatal("%s: not found", path);
+	if (strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0)
+		fatal("%s: cannot remove . or ..", path);
+	remove_entry(&parent, leaf, path, recursive);
+}
+
+/* main --- parse args, open the image, run the command */
+
+int
+main(int argc, char **argv)
+{
+	int c, partno = -1;
+	long sector = -1;
+	const char *cmd;
+	int flag = 0;
+
+	progname = argv[0];
+
+	while ((c = getopt(argc, argv, "+Hf:p:s:u:g:")) != EOF) {
+		switch (c) {
+		case 'f':
+			imgname = optarg;
+			break;
+		case 'p':
+			partno = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			sector = strtol(optarg, NULL, 10);
+			break;
+		case 'u':
+			uid = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			gid = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+		default:
+			usage();
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+	cmd = *argv++;
+	argc--;
+
+	/* the only per-command options: ls -l and rm -r */
+	if (argc > 0 && (strcmp(argv[0], "-l") == 0 || strcmp(argv[0], "-r") == 0)) {
+		flag = 1;
+		argv++;
+		argc--;
+	}
+
+	writable = strcmp(cmd, "put") == 0 || strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "rm") == 0;
+	if ((imgfd = open(imgname, writable ? O_RDWR : O_RDONLY)) < 0)
+		fatal("%s: cannot open: %s", imgname, strerror(errno));
+
+	if (strcmp(cmd, "parts") == 0 && argc == 0 && ! flag) {
+		cmd_parts();
+	} else {
+		select_fs(partno, sector);
+		if (strcmp(cmd, "ls") == 0 && argc <= 1)
+			cmd_ls(argc ? argv[0] : "/", flag);
+		else if (strcmp(cmd, "get") == 0 && (argc == 1 || argc == 2) && ! flag)
+			cmd_get(argv[0], argc == 2 ? argv[1] : NULL);
+		else if (strcmp(cmd, "put") == 0 && (argc == 1 || argc == 2) && ! flag)
+			cmd_put(argv[0], argc == 2 ? argv[1] : NULL);
+		else if (strcmp(cmd, "mkdir") == 0 && argc == 1 && ! flag)
+			cmd_mkdir(argv[0]);
+		else if (strcmp(cmd, "rm") == 0 && argc == 1)
+			cmd_rm(argv[0], flag);
+		else
+			usage();
+		close_fs();
+	}
+
+	if (close(imgfd) < 0)
+		fatal("%s: %s", imgname, strerror(errno));
+	return EXIT_SUCCESS;
+}
@@ -23,6 +23,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -32,34 +33,241 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "../src/hdimg.h"	// overlay and compressed image formats
+
 #define BLOCK_SIZE	512	// no other value makes sense, hardcode it
 #define MAX_CYLS	1400	// OS doesn't allow more than this
 
+static const char *outfile = "hd.img";
+
 /* usage --- print a usage message and exit */
 
 void
 usage(const char *progname)
 {
-	fprintf(stderr, "usage: %s [-H] -h numheads -c numcyls -b blocks_per_track [-o image]\n",
+	fprintf(stderr, "usage: %s [-H] [-l] [-z] -h numheads -c numcyls -b blocks_per_track [-o image]\n",
 			progname);
+	fprintf(stderr, "       %s [-H] -O base_image -o overlay\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+/* fail --- report an error writing the output, remove it, and exit */
+
+static void
+fail(const char *what)
+{
+	fprintf(stderr, "error: %s: cannot %s: %s\n", outfile, what, strerror(errno));
+	(void) unlink(outfile);
 	exit(EXIT_FAILURE);
 }
 
-/* main.c --- parse args, allocate and initialize memory, create the file */
+/* put16be, put32be, put32le, put64le --- store integers in a byte buffer */
+
+static void
+put16be(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32be(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put32le(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+put64le(unsigned char *p, uint64_t v)
+{
+	put32le(p, (uint32_t) v);
+	put32le(p + 4, (uint32_t) (v >> 32));
+}
+
+/* make_block0 --- build the first block of the disk */
+
+static void
+make_block0(unsigned char *block, int label, int numheads, int numcyls, int blocks_per_track)
+{
+	uint32_t sum = 0;
+	int i;
+
+	memset(block, '\0', BLOCK_SIZE);
+
+	if (! label) {
+		/* freebee's own sizing information */
+		sprintf((char *) block, "free\nheads: %d cyls: %d bpt: %d blksiz: %d\n",
+				numheads, numcyls, blocks_per_track, BLOCK_SIZE);
+		return;
+	}
+
+	/*
+	 * A UNIX PC disk label: the s4_dswprt structure at the start of
+	 * the volume home block, big-endian, as read by wd2010.c.
+	 *	magic[4], checksum, name[6], cyls, heads, psectrk, pseccyl,
+	 *	flags, step, sectorsz
+	 */
+	memcpy(block, "UQVQ", 4);
+	put16be(block + 14, numcyls);
+	put16be(block + 16, numheads);
+	put16be(block + 18, blocks_per_track);
+	put16be(block + 20, numheads * blocks_per_track);
+	put16be(block + 24, BLOCK_SIZE);
+
+	/* checksum makes the block's 32-bit words sum to zero */
+	for (i = 0; i < BLOCK_SIZE; i += 4)
+		sum += ((uint32_t) block[i] << 24) | (block[i+1] << 16) | (block[i+2] << 8) | block[i+3];
+	put32be(block + 4, -sum);
+}
+
+/* write_all --- write a buffer at an offset, or fail */
+
+static void
+write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	if (pwrite(fd, buf, len, offset) != (ssize_t) len)
+		fail("write data");
+}
+
+/* create_plain --- a flat image: block 0, then a hole */
+
+static void
+create_plain(int fd, const unsigned char *block0, uint64_t disk_size)
+{
+	write_all(fd, block0, BLOCK_SIZE, 0);
+	if (ftruncate(fd, disk_size) != 0)
+		fail("set size");
+}
+
+/*
+ * create_compressed --- a compressed image. Chunk 0, which holds block 0,
+ * is stored raw after the index; every other chunk reads as zeros.
+ */
+
+static void
+create_compressed(int fd, const unsigned char *block0, uint64_t disk_size)
+{
+	unsigned char hdr[HDCMP_HEADER_SIZE];
+	unsigned char *index;
+	uint32_t chunk_size = HDCMP_DEFAULT_CHUNK;
+	uint32_t nchunks = (disk_size + chunk_size - 1) / chunk_size;
+	uint64_t index_offset = HDCMP_HEADER_SIZE;
+	uint64_t chunk0_offset = index_offset + (uint64_t) nchunks * HDCMP_INDEX_ENTRY;
+	uint32_t chunk0_len = disk_size < chunk_size ? disk_size : chunk_size;
+
+	memset(hdr, '\0', sizeof(hdr));
+	memcpy(hdr, HDCMP_MAGIC, 8);
+	put32le(hdr + 8, HDCMP_HEADER_SIZE);
+	put32le(hdr + 12, chunk_size);
+	put64le(hdr + 16, disk_size);
+	put64le(hdr + 24, index_offset);
+	put32le(hdr + 32, nchunks);
+
+	if ((index = calloc(nchunks, HDCMP_INDEX_ENTRY)) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		(void) unlink(outfile);
+		exit(EXIT_FAILURE);
+	}
+	put64le(index, chunk0_offset);
+	put32le(index + 8, chunk0_len);
+	index[12] = HDCMP_CHUNK_RAW;
+
+	write_all(fd, hdr, sizeof(hdr), 0);
+	write_all(fd, index, (size_t) nchunks * HDCMP_INDEX_ENTRY, index_offset);
+	write_all(fd, block0, BLOCK_SIZE, chunk0_offset);
+	if (ftruncate(fd, chunk0_offset + chunk0_len) != 0)
+		fail("set size");
+	free(index);
+}
+
+/* base_disk_size --- how big the disk in a base image is */
+
+static uint64_t
+base_disk_size(const char *base)
+{
+	unsigned char hdr[HDCMP_HEADER_SIZE];
+	struct stat sbuf;
+	uint64_t size;
+	int fd;
+
+	if ((fd = open(base, O_RDONLY)) < 0 || fstat(fd, & sbuf) < 0) {
+		fprintf(stderr, "error: %s: cannot open: %s\n", base, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	size = sbuf.st_size;
+	if (pread(fd, hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+		if (memcmp(hdr, HDCMP_MAGIC, 8) == 0) {
+			/* compressed: the header says how big the disk is */
+			size = (uint64_t) hdr[16] | ((uint64_t) hdr[17] << 8) | ((uint64_t) hdr[18] << 16) |
+				((uint64_t) hdr[19] << 24) | ((uint64_t) hdr[20] << 32) | ((uint64_t) hdr[21] << 40) |
+				((uint64_t) hdr[22] << 48) | ((uint64_t) hdr[23] << 56);
+		} else if (memcmp(hdr, HDOVL_MAGIC, 8) == 0) {
+			fprintf(stderr, "error: %s: is an overlay; overlays can't be stacked\n", base);
+			exit(EXIT_FAILURE);
+		}
+	}
+	(void) close(fd);
+
+	if (size < BLOCK_SIZE) {
+		fprintf(stderr, "error: %s: too small to be a disk image\n", base);
+		exit(EXIT_FAILURE);
+	}
+	return size;
+}
+
+/* create_overlay --- an empty overlay: the header, then a hole */
+
+static void
+create_overlay(int fd, const char *base, uint64_t disk_size)
+{
+	unsigned char hdr[HDOVL_HEADER_SIZE];
+	uint32_t block_size = HDOVL_DEFAULT_BLOCK;
+	uint64_t nblocks = (disk_size + block_size - 1) / block_size;
+	uint64_t bitmap_offset = HDOVL_HEADER_SIZE;
+	uint64_t data_offset = ((bitmap_offset + (nblocks + 7) / 8 + block_size - 1) / block_size) * block_size;
+
+	memset(hdr, '\0', sizeof(hdr));
+	memcpy(hdr, HDOVL_MAGIC, 8);
+	put32le(hdr + 8, HDOVL_HEADER_SIZE);
+	put32le(hdr + 12, block_size);
+	put64le(hdr + 16, disk_size);
+	put64le(hdr + 24, bitmap_offset);
+	put64le(hdr + 32, data_offset);
+	strncpy((char *) hdr + 40, base, 255);
+
+	write_all(fd, hdr, sizeof(hdr), 0);
+	if (ftruncate(fd, data_offset + nblocks * block_size) != 0)
+		fail("set size");
+}
+
+/* main --- parse args, create the file */
 
 int
 main(int argc, char **argv)
 {
 	int c, fd;
-	const char *outfile = "hd.img";
-	char *buffer;
-	size_t buffer_size;
-	ssize_t count;
+	const char *base = NULL;
+	unsigned char block0[BLOCK_SIZE];
+	uint64_t disk_size;
 	int numheads, numcyls, blocks_per_track;
+	int label = 0, compressed = 0, named = 0;
+	struct stat base_st, out_st;
 
-	buffer_size = numheads = numcyls = blocks_per_track = 0;
+	numheads = numcyls = blocks_per_track = 0;
 
-	while ((c = getopt(argc, argv, "Hh:c:b:o:")) != EOF) {
+	while ((c = getopt(argc, argv, "Hh:c:b:o:lzO:")) != EOF) {
 		switch (c) {
 		case 'h':
 			numheads = strtol(optarg, NULL, 10);
@@ -72,6 +280,16 @@ main(int argc, char **argv)
 			break;
 		case 'o':
 			outfile = optarg;
+			named = 1;
+			break;
+		case 'l':
+			label = 1;
+			break;
+		case 'z':
+			compressed = 1;
+			break;
+		case 'O':
+			base = optarg;
 			break;
 		case 'H':
 		default:
@@ -80,47 +298,55 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (numheads <= 0 || numcyls <= 0 || blocks_per_track <= 0) {
-		fprintf(stderr, "error: invalid value supplied or value missing for "
-				"one or more parameters\n");
-		usage(argv[0]);
-	}
+	if (base != NULL) {
+		/* the base image has the geometry and the label */
+		if (numheads || numcyls || blocks_per_track || label || compressed) {
+			fprintf(stderr, "error: -O cannot be combined with -h, -c, -b, -l or -z\n");
+			usage(argv[0]);
+		}
+		/* the default output name is likely the base itself */
+		if (! named) {
+			fprintf(stderr, "error: -O needs -o to name the overlay\n");
+			usage(argv[0]);
+		}
+		disk_size = base_disk_size(base);
+		if (stat(base, & base_st) == 0 && stat(outfile, & out_st) == 0 &&
+				base_st.st_dev == out_st.st_dev && base_st.st_ino == out_st.st_ino) {
+			fprintf(stderr, "error: %s: the overlay cannot be the base image\n", outfile);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		if (numheads <= 0 || numcyls <= 0 || blocks_per_track <= 0) {
+			fprintf(stderr, "error: invalid value supplied or value missing for "
+					"one or more parameters\n");
+			usage(argv[0]);
+		}
 
-	if (numcyls > MAX_CYLS) {
-		fprintf(stderr, "error: number of cylinders cannot exceed %d\n", MAX_CYLS);
-		exit(EXIT_FAILURE);
-	}
+		if (numcyls > MAX_CYLS) {
+			fprintf(stderr, "error: number of cylinders cannot exceed %d\n", MAX_CYLS);
+			exit(EXIT_FAILURE);
+		}
 
-	buffer_size = numheads * numcyls * blocks_per_track * BLOCK_SIZE;
-	buffer = (char *) malloc(buffer_size);
-	if (buffer == NULL) {
-		fprintf(stderr, "error: could not allocate %lu bytes of memory: %s\n",
-				buffer_size, strerror(errno));
-		exit(EXIT_FAILURE);
+		disk_size = (uint64_t) numheads * numcyls * blocks_per_track * BLOCK_SIZE;
+		make_block0(block0, label, numheads, numcyls, blocks_per_track);
 	}
 
-	/* write info into the buffer */
-	memset(buffer, '\0', buffer_size);
-	sprintf(buffer, "free\nheads: %d cyls: %d bpt: %d blksiz: %d\n",
-			numheads, numcyls, blocks_per_track, BLOCK_SIZE);
-
-	/* write to file */
+	/* write to file; only the headers are written, the rest is a hole */
 	if ((fd = open(outfile, O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0) {
 		fprintf(stderr, "error: %s: cannot open for writing: %s\n",
 				outfile, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	if ((count = write(fd, buffer, buffer_size)) != buffer_size) {
-		fprintf(stderr, "error: %s: cannot write data: %s\n",
-				outfile, strerror(errno));
-		(void) close(fd);
-		(void) unlink(outfile);
-		exit(EXIT_FAILURE);
-	}
+	if (base != NULL)
+		create_overlay(fd, base, disk_size);
+	else if (compressed)
+		create_compressed(fd, block0, disk_size);
+	else
+		create_plain(fd, block0, disk_size);
 
-	(void) close(fd);
-	(void) free(buffer);
+	if (close(fd) != 0)
+		fail("close");
 
 	return EXIT_SUCCESS;
 }